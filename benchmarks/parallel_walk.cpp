@@ -0,0 +1,90 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a benchmark comparing the parallel walker with a single threaded walk of a large tree of files
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../src/parallel_walk.hpp"
+
+bool useVerboseOutput = false;
+
+// Function which creates a tree of <fileCount> empty files under <root> (100 files per directory, 100 directories per parent directory)
+//	The tree is only created once, later runs reuse it (the file marking that the tree is complete is stored next to it)
+void generateTree(const std::filesystem::path& root, size_t fileCount) {
+	auto marker = root.parent_path() / (root.filename().string() + "-" + std::to_string(fileCount));
+	if(exists(marker)) return;
+
+	std::cout << "Generating " << fileCount << " files under " << root << "..." << std::endl;
+	std::filesystem::remove_all(root);
+	std::filesystem::remove_all(marker);
+	constexpr size_t filesPerDirectory = 100, directoriesPerDirectory = 100;
+	for(size_t i = 0; i < fileCount; i++) {
+		size_t directory = i / filesPerDirectory;
+		auto path = root / std::to_string(directory / (directoriesPerDirectory * directoriesPerDirectory))
+			/ std::to_string(directory / directoriesPerDirectory % directoriesPerDirectory) / std::to_string(directory % directoriesPerDirectory);
+		if(i % filesPerDirectory == 0) create_directories(path);
+
+		int fd = ::open((path / ("file" + std::to_string(i))).c_str(), O_WRONLY | O_CREAT, 0666);
+		if(fd < 0) {
+			std::cerr << "Failed to create the tree" << std::endl;
+			std::exit(1);
+		}
+		::close(fd);
+	}
+	std::ofstream(marker).close();
+}
+
+// The single threaded walk the parallel walker replaced: a recursive directory iterator, fetching each file's modification time and size
+size_t iteratorWalk(const std::filesystem::path& root) {
+	size_t files = 0;
+	for(auto& entry: std::filesystem::recursive_directory_iterator(root)) {
+		if(!entry.is_regular_file()) continue;
+		volatile auto timestamp = entry.last_write_time().time_since_epoch().count();
+		volatile auto size = entry.file_size();
+		(void) timestamp; (void) size;
+		files++;
+	}
+	return files;
+}
+
+// Function which times how long (in seconds) a function takes, also returning what the function returned
+template<typename F>
+std::pair<double, size_t> time(F&& f) {
+	auto start = std::chrono::steady_clock::now();
+	size_t result = f();
+	return {std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), result};
+}
+
+// Usage: parallel_walk [root] [files] [threads]
+// NOTE: Every walk but the first reads from the operating system's cache, drop the cache before running to measure a cold walk
+int main(int argc, char* argv[]) {
+	std::filesystem::path root = argc > 1 ? argv[1] : (std::filesystem::temp_directory_path() / "wnts-walk-benchmark").string();
+	size_t fileCount = argc > 2 ? std::stoul(argv[2]) : 1'000'000;
+	size_t threads = argc > 3 ? std::stoul(argv[3]) : ParallelWalker::defaultThreadCount();
+
+	generateTree(root, fileCount);
+	IgnoreRules::singleton().setup({root});
+
+	auto [iteratorTime, iteratorFiles] = time([&] { return iteratorWalk(root); });
+	std::cout << "Recursive directory iterator: " << iteratorTime * 1000 << "ms (" << iteratorFiles << " files)" << std::endl;
+
+	// Measure the walker with 1, 2, 4... threads, and the requested number of threads
+	std::vector<size_t> threadCounts;
+	for(size_t t = 1; t < threads; t *= 2) threadCounts.push_back(t);
+	threadCounts.push_back(threads);
+	for(size_t t: threadCounts) {
+		auto [walkTime, walkFiles] = time([&] { return ParallelWalker::walk({root}, nullptr, nullptr, false, t).size(); });
+		std::cout << "Parallel walker (" << t << " threads): " << walkTime * 1000 << "ms (" << walkFiles << " files)" << std::endl;
+	}
+
+	// With a directory cache, a walk of an unchanged tree only reads the directories' metadata (and a sample of the files)
+	DirectoryCache cache;
+	ParallelWalker::walk({root}, &cache, nullptr, false, threads);
+	auto [cachedTime, cachedFiles] = time([&] { return ParallelWalker::walk({root}, &cache, nullptr, false, threads).size(); });
+	std::cout << "Parallel walker (" << threads << " threads, unchanged tree with a directory cache): " << cachedTime * 1000 << "ms (" << cachedFiles << " files)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a benchmark comparing how the message queue performs when many threads push onto it at once
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <queue>
+#include <random>
+#include <string>
+
+#include "../src/bucket_priority_queue.hpp"
+#include "../src/monitor.hpp"
+
+bool useVerboseOutput = false;
+
+// A queued value, about the size of a small message
+struct Item {
+	size_t producer = 0, sequence = 0;
+	std::string payload;
+};
+
+// The queue messages used to wait in before the bucket queue: a standard priority queue behind a shared mutex
+//	(every push and pop takes the write lock, just as the message manager used to)
+struct LockedPriorityQueue {
+	struct Entry {
+		size_t priority, order;
+		Item item;
+		bool operator<(const Entry& o) const { return priority != o.priority ? priority > o.priority : order > o.order; }
+	};
+
+	void push(size_t priority, Item&& item) {
+		auto lock = queue.write_lock();
+		lock->push({priority, order++, std::move(item)});
+	}
+
+	bool pop(Item& out) {
+		auto lock = queue.write_lock();
+		if(lock->empty()) return false;
+		out = std::move(const_cast<Entry&>(lock->top()).item);
+		lock->pop();
+		return true;
+	}
+
+protected:
+	monitor<std::priority_queue<Entry>> queue;
+	size_t order = 0;
+};
+
+// Adapter which gives the bucket queue the same interface as the locked queue
+struct BucketQueue {
+	void push(size_t priority, Item&& item) { queue.push(priority, std::move(item)); }
+	bool pop(Item& out) { return queue.pop(out); }
+
+protected:
+	BucketPriorityQueue<Item> queue;
+};
+
+// Function which pushes <perProducer> items from each of <producers> threads while a single thread pops them all
+//	Returns how long (in seconds) it took for every item to be popped, exits if any item is lost or popped out of order
+template<typename Queue>
+double run(size_t producers, size_t perProducer) {
+	Queue queue;
+	std::atomic<bool> go = false;
+	std::vector<std::thread> threads;
+	for(size_t p = 0; p < producers; p++)
+		threads.emplace_back([&, p] {
+			std::mt19937 random(p);
+			std::uniform_int_distribution<size_t> priority(0, 15);
+			while(!go.load(std::memory_order_acquire)) std::this_thread::yield();
+			for(size_t i = 0; i < perProducer; i++)
+				queue.push(priority(random), {p, i, std::string(32, 'x')});
+		});
+
+	// Count how many values from each producer are popped, so lost or duplicated values are caught
+	std::vector<size_t> seen(producers, 0);
+	auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	Item item;
+	for(size_t received = 0, total = producers * perProducer; received < total; ) {
+		if(!queue.pop(item)) {
+			std::this_thread::yield();
+			continue;
+		}
+		seen[item.producer]++;
+		received++;
+	}
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	for(auto& thread: threads) thread.join();
+
+	if(std::any_of(seen.begin(), seen.end(), [perProducer](size_t count) { return count != perProducer; })) {
+		std::cerr << "Items were lost or duplicated!" << std::endl;
+		std::exit(1);
+	}
+	return elapsed;
+}
+
+// Usage: queue_contention [producers] [items per producer] [repetitions]
+int main(int argc, char* argv[]) {
+	size_t producers = argc > 1 ? std::stoul(argv[1]) : std::max<size_t>(std::thread::hardware_concurrency() * 2, 4);
+	size_t perProducer = argc > 2 ? std::stoul(argv[2]) : 100'000;
+	size_t repetitions = argc > 3 ? std::stoul(argv[3]) : 5;
+
+	std::cout << producers << " producers, " << perProducer << " items each, " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+	// Report the best of several runs for each queue, alternating so neither gets a warmer machine
+	double locked = std::numeric_limits<double>::max(), bucket = std::numeric_limits<double>::max();
+	for(size_t i = 0; i < repetitions; i++) {
+		locked = std::min(locked, run<LockedPriorityQueue>(producers, perProducer));
+		bucket = std::min(bucket, run<BucketQueue>(producers, perProducer));
+	}
+
+	double total = producers * perProducer;
+	std::cout << "Locked priority queue: " << locked * 1000 << "ms (" << total / locked / 1e6 << "M items/s)" << std::endl;
+	std::cout << "Bucket priority queue: " << bucket * 1000 << "ms (" << total / bucket / 1e6 << "M items/s)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a benchmark comparing how the sweeper stores what it knows about every file (interned paths and flat arrays)
+	with how it used to (a map from path to timestamp and sweep iteration)
+*/
+
+#include <map>
+#include <string>
+
+#include "../src/path_table.hpp"
+
+bool useVerboseOutput = false;
+
+using Timestamp = std::filesystem::file_time_type;
+
+// The sweeper's old state: a map from each file's path to its timestamp and the last sweep iteration which saw it
+struct MapState {
+	std::map<std::filesystem::path, std::pair<Timestamp, size_t>> timestamps;
+	size_t iteration = 0, changes = 0;
+
+	// Same bookkeeping as the old check: find the file, compare its timestamp, then store the timestamp and iteration
+	void check(const std::filesystem::path& path, Timestamp timestamp) {
+		auto tracked = timestamps.find(path);
+		if(tracked == timestamps.end() || tracked->second.first != timestamp) changes++;
+		timestamps[path] = {timestamp, iteration};
+	}
+
+	// Same bookkeeping as the end of the old sweep: visit every tracked file, looking for any the sweep didn't see
+	size_t finish() {
+		size_t deleted = 0;
+		for(auto& [path, pair]: timestamps)
+			if(pair.second != iteration) deleted++;
+		iteration++;
+		return deleted;
+	}
+};
+
+// The sweeper's current state: paths are interned into IDs, and the per file data lives in arrays indexed by ID
+struct TableState {
+	PathTable paths;
+	std::vector<Timestamp> timestamps;
+	std::vector<uint64_t> sizes;
+	std::vector<uint32_t> sweepIterations;
+	uint32_t iteration = 0;
+	size_t changes = 0;
+
+	// Same bookkeeping as the current check: a single probe finds (or adds) the file, then its entries in the arrays are compared and updated
+	void check(const std::filesystem::path& path, Timestamp timestamp, uint64_t size = 0) {
+		auto [id, added] = paths.insert(path.native());
+		if(added && timestamps.size() < paths.capacity()) {
+			timestamps.resize(paths.capacity());
+			sizes.resize(paths.capacity());
+			sweepIterations.resize(paths.capacity());
+		}
+		if(added || timestamps[id] != timestamp || sizes[id] != size) {
+			changes++;
+			timestamps[id] = timestamp;
+			sizes[id] = size;
+		}
+		sweepIterations[id] = iteration;
+	}
+
+	// Same bookkeeping as the end of the current sweep: visit every tracked file, looking for any the sweep didn't see
+	size_t finish() {
+		size_t deleted = 0;
+		paths.forEach([&](PathTable::ID id) { if(sweepIterations[id] != iteration) deleted++; });
+		iteration++;
+		return deleted;
+	}
+};
+
+// Function which times a number of sweeps over <files> (each file's timestamp comes from <timestamps>), returning the average time (in seconds) of
+//	the first sweep (where every file is new) and of the sweeps after it (where nothing has changed)
+template<typename State>
+std::pair<double, double> run(const std::vector<std::filesystem::path>& files, const std::vector<Timestamp>& timestamps, size_t sweeps) {
+	State state;
+	double first = 0, rest = 0;
+	for(size_t sweep = 0; sweep < sweeps; sweep++) {
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i = 0; i < files.size(); i++)
+			state.check(files[i], timestamps[i]);
+		if(state.finish() != 0) {
+			std::cerr << "Files were reported as deleted!" << std::endl;
+			std::exit(1);
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		(sweep == 0 ? first : rest) += elapsed;
+	}
+	if(state.changes != files.size()) {
+		std::cerr << "Unchanged files were reported as changed!" << std::endl;
+		std::exit(1);
+	}
+	return {first, sweeps > 1 ? rest / (sweeps - 1) : 0};
+}
+
+// Usage: sweep_state [files] [sweeps]
+// NOTE: Only the sweeper's bookkeeping is measured (the paths and timestamps are generated up front, the disk is never touched)
+int main(int argc, char* argv[]) {
+	size_t fileCount = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+	size_t sweeps = argc > 2 ? std::max<size_t>(std::stoul(argv[2]), 2) : 5;
+
+	// Paths shaped like the ones a walk of a real tree produces (100 files per directory, three levels of directories)
+	std::vector<std::filesystem::path> files;
+	std::vector<Timestamp> timestamps;
+	files.reserve(fileCount);
+	timestamps.reserve(fileCount);
+	auto now = Timestamp::clock::now();
+	for(size_t i = 0; i < fileCount; i++) {
+		size_t directory = i / 100;
+		files.emplace_back("/home/user/managed/" + std::to_string(directory / 10000) + "/directory" + std::to_string(directory / 100 % 100)
+			+ "/subdirectory" + std::to_string(directory % 100) + "/file" + std::to_string(i) + ".txt");
+		timestamps.push_back(now - std::chrono::seconds(i));
+	}
+
+	std::cout << fileCount << " files, " << sweeps << " sweeps" << std::endl;
+	auto [mapFirst, mapRest] = run<MapState>(files, timestamps, sweeps);
+	auto [tableFirst, tableRest] = run<TableState>(files, timestamps, sweeps);
+	auto report = [fileCount](const char* name, double first, double rest) {
+		std::cout << name << ": first sweep " << first * 1000 << "ms, later sweeps " << rest * 1000 << "ms (" << rest * 1e9 / fileCount << "ns per file)" << std::endl;
+	};
+	report("Map of paths", mapFirst, mapRest);
+	report("Path table and arrays", tableFirst, tableRest);
+	return 0;
+}
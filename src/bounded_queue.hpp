@@ -0,0 +1,173 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a bounded queue which connects the stages of a pipeline, and statistics about how long each stage takes
+*/
+
+#ifndef __BOUNDED_QUEUE_HPP__
+#define __BOUNDED_QUEUE_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+#include "include_everywhere.hpp"
+
+// Statistics about how long a stage of a pipeline spends on each piece of work (safe to record and read from any thread)
+struct StageStats {
+	// Number of pieces of work done
+	std::atomic<size_t> count = 0;
+	// Average and longest time (in seconds) a piece of work took
+	std::atomic<double> average = 0, longest = 0;
+
+	// Function which records how long a piece of work took
+	void record(std::chrono::steady_clock::duration duration) {
+		double seconds = std::chrono::duration<double>(duration).count();
+		size_t n = ++count;
+		// NOTE: Only ever recorded by a single thread, so the average doesn't need a compare exchange loop
+		average.store(average.load(std::memory_order_relaxed) + (seconds - average.load(std::memory_order_relaxed)) / n, std::memory_order_relaxed);
+		if(seconds > longest.load(std::memory_order_relaxed)) longest.store(seconds, std::memory_order_relaxed);
+	}
+};
+
+// Queue which holds at most a fixed number of values (and a fixed number of bytes), producers wait while it is full
+//	so a slow consumer slows its producers down (backpressure) instead of letting the queue grow without bound
+// NOTE: A value larger than the byte limit is let through once the queue is empty
+// NOTE: The consumer is considered busy with the value it popped until it next calls pop (so draining waits for it to finish with it)
+template<typename T>
+struct BoundedQueue {
+	using Clock = std::chrono::steady_clock;
+
+	// Statistics about the queue
+	struct Stats {
+		// Number of values (and bytes) waiting, values ever pushed and popped, pushes which had to wait for room, and values dropped
+		//	because the queue was closed (or they missed the deadline)
+		size_t waiting = 0, waitingBytes = 0, pushed = 0, popped = 0, blockedPushes = 0, dropped = 0;
+		// Average and longest time (in seconds) a value waited in the queue, and the total time producers spent waiting for room
+		double averageWait = 0, longestWait = 0, blockedTime = 0;
+	};
+
+	BoundedQueue(size_t maxCount, size_t maxBytes = std::numeric_limits<size_t>::max()) : maxCount(maxCount), maxBytes(maxBytes) {}
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Function which adds a value (which takes up <bytes> bytes) to the queue, waiting for room if the queue is full
+	//	Returns false (dropping the value) if the queue is closed, or still full once the deadline passes
+	bool push(T&& value, size_t bytes = 0) {
+		std::unique_lock lock(mutex);
+		auto full = [&] { return !queue.empty() && (queue.size() >= maxCount || stats.waitingBytes + bytes > maxBytes); };
+		if(full() && !closed) {
+			auto start = Clock::now();
+			// NOTE: The deadline may be set while we wait, so we wake up to start waiting on it
+			while(!closed && full() && Clock::now() < deadline)
+				if(deadline == Clock::time_point::max()) notFull.wait(lock);
+				else notFull.wait_until(lock, deadline);
+			stats.blockedPushes++;
+			stats.blockedTime += std::chrono::duration<double>(Clock::now() - start).count();
+		}
+		if(closed || full()) {
+			stats.dropped++;
+			return false;
+		}
+
+		queue.push_back({std::move(value), bytes, Clock::now()});
+		stats.waiting++;
+		stats.waitingBytes += bytes;
+		stats.pushed++;
+		lock.unlock();
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Function which removes the value at the front of the queue, waiting for one to be pushed if the queue is empty
+	//	Returns false if the queue is closed
+	bool pop(T& out) {
+		std::unique_lock lock(mutex);
+		// The consumer is done with the value it popped last
+		if(busy) {
+			busy = false;
+			drained.notify_all();
+		}
+		notEmpty.wait(lock, [this] { return closed || !queue.empty(); });
+		if(closed) return false;
+
+		auto& front = queue.front();
+		double wait = std::chrono::duration<double>(Clock::now() - front.pushed).count();
+		out = std::move(front.value);
+		stats.waiting--;
+		stats.waitingBytes -= front.bytes;
+		stats.popped++;
+		stats.averageWait += (wait - stats.averageWait) / stats.popped;
+		stats.longestWait = std::max(stats.longestWait, wait);
+		queue.pop_front();
+		busy = true;
+		lock.unlock();
+		notFull.notify_all();
+		return true;
+	}
+
+	// Function which closes the queue, waking anyone waiting on it (values still in the queue are dropped)
+	void close() {
+		{
+			std::scoped_lock lock(mutex);
+			closed = true;
+			stats.dropped += queue.size();
+			queue.clear();
+			stats.waiting = stats.waitingBytes = 0;
+		}
+		notEmpty.notify_all();
+		notFull.notify_all();
+		drained.notify_all();
+	}
+
+	// Function which sets when producers stop waiting for room (values which still don't fit are then dropped)
+	void setDeadline(Clock::time_point until) {
+		{
+			std::scoped_lock lock(mutex);
+			deadline = until;
+		}
+		notFull.notify_all();
+	}
+
+	// Function which waits (until the deadline at the latest) for the consumer to pop and finish with every value, then closes the queue
+	//	Returns false if values had to be dropped (or were dropped earlier because they missed the deadline)
+	bool drain(Clock::time_point until) {
+		setDeadline(until);
+		{
+			std::unique_lock lock(mutex);
+			drained.wait_until(lock, until, [this] { return closed || (queue.empty() && !busy); });
+		}
+		close();
+		return getStats().dropped == 0;
+	}
+
+	// Function which gets the current statistics
+	Stats getStats() const {
+		std::scoped_lock lock(mutex);
+		return stats;
+	}
+
+protected:
+	// A value waiting in the queue, how many bytes it takes up, and when it was pushed
+	struct Entry {
+		T value;
+		size_t bytes;
+		Clock::time_point pushed;
+	};
+
+	const size_t maxCount, maxBytes;
+	mutable std::mutex mutex;
+	std::condition_variable notEmpty, notFull, drained;
+	std::deque<Entry> queue;
+	// When producers stop waiting for room
+	Clock::time_point deadline = Clock::time_point::max();
+	bool closed = false;
+	// Whether the consumer is still working on the value it popped last
+	bool busy = false;
+	Stats stats;
+};
+
+#endif // __BOUNDED_QUEUE_HPP__
@@ -0,0 +1,219 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides the concurrent priority queue messages wait in before being processed
+*/
+
+#ifndef __BUCKET_PRIORITY_QUEUE_HPP__
+#define __BUCKET_PRIORITY_QUEUE_HPP__
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <optional>
+
+#include "include_everywhere.hpp"
+
+// Callable which does nothing (the default for the queues' push and pop hooks)
+struct NoHook {
+	template<typename... Args>
+	void operator()(Args&&...) const {}
+};
+
+// Lock free queue which any number of threads may push onto, but only a single thread may pop from
+//	(Dmitry Vyukov's multiple producer single consumer queue, pushing is a single atomic exchange and never waits on other threads)
+// NOTE: A pop racing with a push may briefly see the queue as empty, the pushed value is seen by the next pop
+template<typename T>
+struct MPSCQueue {
+	MPSCQueue() : head(new Node), tail(head.load()) {}
+	~MPSCQueue() {
+		while(tail) {
+			auto next = tail->next.load(std::memory_order_relaxed);
+			delete tail;
+			tail = next;
+		}
+	}
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	// Function which adds a value to the back of the queue (safe to call from any thread)
+	//	<prepare>(value) is called once the value is in its place in the queue, but before it can be popped
+	template<typename Prepare = NoHook>
+	void push(T&& value, Prepare&& prepare = {}) {
+		auto node = new Node;
+		node->value.emplace(std::move(value));
+		prepare(*node->value);
+		// Claim the back of the queue, then link the previous back to the new node
+		auto previous = head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	// Function which gets the value at the front of the queue, without removing it (must only be called from the consuming thread)
+	//	Returns null if the queue is empty
+	T* front() {
+		auto next = tail->next.load(std::memory_order_acquire);
+		return next ? &*next->value : nullptr;
+	}
+
+	// Function which removes the value at the front of the queue (must only be called from the consuming thread)
+	//	<take>(value) is called while the value is still in its place in the queue, just before it is moved into <out>
+	//	Returns false if the queue is empty
+	template<typename Take = NoHook>
+	bool pop(T& out, Take&& take = {}) {
+		auto next = tail->next.load(std::memory_order_acquire);
+		if(!next) return false;
+
+		take(*next->value);
+		// The node after the (already consumed) front node holds the value, it becomes the new front node once its value is taken
+		out = std::move(*next->value);
+		next->value.reset();
+		delete tail;
+		tail = next;
+		return true;
+	}
+
+protected:
+	struct Node {
+		std::atomic<Node*> next = nullptr;
+		std::optional<T> value;
+	};
+
+	// The most recently pushed node (shared by the producers), on its own cache line so it doesn't bounce with the consumer's node
+	alignas(64) std::atomic<Node*> head;
+	// The most recently consumed node (only touched by the consumer)
+	alignas(64) Node* tail;
+};
+
+// Priority queue (lower priorities are popped first) which any number of threads may push onto, but only a single thread may pop from
+// Priorities are small integers, so the queue is a lane (MPSCQueue) per priority, along with atomic counts which let any thread
+//	check what is waiting without touching the lanes themselves; values with the same priority are popped in the order they were pushed
+// Lanes are served in priority order, except that each lane may be given an aging limit: once the value at the front of a lane has waited
+//	longer than its lane's limit it is popped before the more urgent lanes which also have a limit (the value furthest past its limit first),
+//	so busy urgent lanes can't starve the less urgent ones
+// NOTE: Aging never jumps a lane without a limit, so lanes without one (control traffic) are always served before any less urgent lane
+template<typename T, size_t Priorities = 16>
+struct BucketPriorityQueue {
+	using Clock = std::chrono::steady_clock;
+	static constexpr size_t priorityLevels = Priorities;
+
+	// Statistics about a lane (safe to read from any thread)
+	struct LaneStats {
+		// Number of values popped from the lane, and how many of them were popped early because they were past the lane's aging limit
+		std::atomic<size_t> popped = 0, aged = 0;
+		// Average and longest time (in seconds) values waited in the lane
+		std::atomic<double> averageWait = 0, longestWait = 0;
+	};
+
+	BucketPriorityQueue() { agingLimits.fill(Clock::duration::max()); }
+
+	// Function which sets how long values may wait in a lane before they are popped ahead of more urgent lanes (must be called before any values are pushed)
+	void setAgingLimit(size_t priority, Clock::duration limit) { agingLimits[std::min(priority, priorityLevels - 1)] = limit; }
+
+	// Function which adds a value to the queue (safe to call from any thread)
+	//	Priorities past the last level are treated as the last level
+	//	<prepare>(value) is called once the value is in its place in the queue, but before it can be popped (so anything which tracks
+	//	the value's address sees it before the consumer can take it)
+	template<typename Prepare = NoHook>
+	void push(size_t priority, T&& value, Prepare&& prepare = {}) {
+		priority = std::min(priority, priorityLevels - 1);
+		lanes[priority].push({std::move(value), Clock::now()}, [&prepare](Entry& queued) { prepare(queued.value); });
+		// NOTE: The count is only increased once the value can be popped, so a count is never ahead of its lane
+		counts[priority].fetch_add(1, std::memory_order_release);
+	}
+
+	// Function which removes the most urgent value from the queue (must only be called from the consuming thread)
+	//	<take>(value) is called while the value is still in its place in the queue, just before it is moved into <out>
+	//	Returns false if the queue is empty, the priority of the value is stored in <priority> if it isn't null
+	template<typename Take = NoHook>
+	bool pop(T& out, size_t* priority = nullptr, Take&& take = {}) {
+		auto now = Clock::now();
+		// The most urgent lane with anything in it, and the lane (if any) whose front value is furthest past its aging limit
+		//	(only lanes reached before the first non-empty lane without a limit may be chosen for being overdue)
+		size_t urgent = priorityLevels, overdue = priorityLevels;
+		Clock::duration mostOverdue{};
+		for(size_t i = 0; i < priorityLevels; i++) {
+			if(counts[i].load(std::memory_order_acquire) == 0) continue;
+			auto front = lanes[i].front();
+			if(!front) continue;
+
+			if(urgent == priorityLevels) urgent = i;
+			if(agingLimits[i] == Clock::duration::max()) break;
+			auto waited = now - front->enqueued;
+			if(waited > agingLimits[i] && (overdue == priorityLevels || waited - agingLimits[i] > mostOverdue)) {
+				overdue = i;
+				mostOverdue = waited - agingLimits[i];
+			}
+		}
+		if(urgent == priorityLevels) return false;
+
+		size_t chosen = overdue != priorityLevels ? overdue : urgent;
+		if(!popLane(chosen, out, now, take)) return false;
+		// Values which jumped ahead of a more urgent lane are counted as aged
+		if(chosen != urgent) stats[chosen].aged.fetch_add(1, std::memory_order_relaxed);
+		if(priority) *priority = chosen;
+		return true;
+	}
+
+	// Function which removes the value at the front of a specific lane (must only be called from the consuming thread)
+	//	<take> is called as in pop, returns false if the lane is empty
+	template<typename Take = NoHook>
+	bool popFrom(size_t priority, T& out, Take&& take = {}) { return popLane(std::min(priority, priorityLevels - 1), out, Clock::now(), take); }
+
+	// Function which checks if anything with the given priority (or anything more urgent) is waiting (safe to call from any thread)
+	bool hasPendingUpTo(size_t priority) const {
+		priority = std::min(priority, priorityLevels - 1);
+		for(size_t i = 0; i <= priority; i++)
+			if(counts[i].load(std::memory_order_acquire) > 0)
+				return true;
+		return false;
+	}
+
+	// Function which gets the number of values waiting (safe to call from any thread, but may be outdated by the time it returns)
+	size_t size() const {
+		size_t size = 0;
+		for(auto& count: counts)
+			size += count.load(std::memory_order_relaxed);
+		return size;
+	}
+	bool empty() const { return !hasPendingUpTo(priorityLevels - 1); }
+
+	// Function which gets the number of values waiting in a lane (safe to call from any thread)
+	size_t depth(size_t priority) const { return counts[std::min(priority, priorityLevels - 1)].load(std::memory_order_relaxed); }
+	// Function which gets the statistics of a lane (safe to call from any thread)
+	const LaneStats& laneStats(size_t priority) const { return stats[std::min(priority, priorityLevels - 1)]; }
+
+protected:
+	// A value, and when it was pushed
+	struct Entry {
+		T value;
+		Clock::time_point enqueued;
+	};
+
+	std::array<MPSCQueue<Entry>, priorityLevels> lanes;
+	std::array<std::atomic<size_t>, priorityLevels> counts = {};
+	std::array<Clock::duration, priorityLevels> agingLimits;
+	std::array<LaneStats, priorityLevels> stats;
+
+	// Function which removes the value at the front of a lane, and updates the lane's statistics
+	template<typename Take>
+	bool popLane(size_t priority, T& out, Clock::time_point now, Take& take) {
+		if(counts[priority].load(std::memory_order_acquire) == 0) return false;
+		Entry entry;
+		if(!lanes[priority].pop(entry, [&take](Entry& queued) { take(queued.value); })) return false;
+		counts[priority].fetch_sub(1, std::memory_order_relaxed);
+
+		// Update the lane's statistics (only the consuming thread writes them)
+		auto& lane = stats[priority];
+		double wait = std::chrono::duration<double>(now - entry.enqueued).count();
+		size_t popped = lane.popped.load(std::memory_order_relaxed) + 1;
+		lane.popped.store(popped, std::memory_order_relaxed);
+		lane.averageWait.store(lane.averageWait.load(std::memory_order_relaxed) + (wait - lane.averageWait.load(std::memory_order_relaxed)) / popped, std::memory_order_relaxed);
+		if(wait > lane.longestWait.load(std::memory_order_relaxed)) lane.longestWait.store(wait, std::memory_order_relaxed);
+
+		out = std::move(entry.value);
+		return true;
+	}
+};
+
+#endif // __BUCKET_PRIORITY_QUEUE_HPP__
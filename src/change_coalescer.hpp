@@ -0,0 +1,78 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which holds back changes to files that are still being written, so only the settled version is propagated
+*/
+
+#ifndef __CHANGE_COALESCER_HPP__
+#define __CHANGE_COALESCER_HPP__
+
+#include <unordered_map>
+
+#include "include_everywhere.hpp"
+#include "parallel_walk.hpp"
+
+// Class which collects the files the sweeper reports as changed, and only releases a file once it has gone a quiescence window without being modified
+//	(or once it has been waiting for the maximum latency, so that a file which is constantly rewritten is still propagated every so often)
+// Repeated reports of the same file while it is waiting are merged, so intermediate versions of the file never go on the wire
+struct ChangeCoalescer {
+	// How long a file must go without being modified before it is released
+	std::chrono::milliseconds quiescence = 1000ms;
+	// The longest a file may be held back, no matter how often it is being modified
+	std::chrono::milliseconds maxLatency = 5000ms;
+
+	// Function which records that a file has been created or modified
+	void changed(const std::filesystem::path& path) {
+		// NOTE: If the file is already waiting, its first report is what the maximum latency is measured from
+		pending.try_emplace(path.native(), std::chrono::steady_clock::now());
+	}
+
+	// Function which forgets about any pending change to a file (it has been deleted, so there is nothing left to propagate)
+	void cancel(const std::filesystem::path& path) { pending.erase(path.native()); }
+
+	// Function which immediately releases any pending change to a file (calling <release>(path) if there is one)
+	template<typename Func>
+	void flush(const std::filesystem::path& path, Func&& release) {
+		if(pending.erase(path.native()))
+			release(path);
+	}
+
+	// Function which releases (calling <release>(path)) every file which has settled or has waited for the maximum latency
+	//	If <all> is true every pending file is released
+	template<typename Func>
+	void release(Func&& release, bool all = false) {
+		auto now = std::chrono::steady_clock::now();
+		auto fileNow = std::filesystem::file_time_type::clock::now();
+
+		std::vector<std::filesystem::path> ready;
+		for(auto i = pending.begin(); i != pending.end(); ) {
+			std::filesystem::path path = i->first;
+			std::filesystem::file_time_type timestamp;
+			uint64_t size;
+			// If the file no longer exists, the sweeper will report its deletion
+			if(!statFile(path, timestamp, size)) {
+				i = pending.erase(i);
+				continue;
+			}
+
+			// NOTE: The file's own modification time is used, so writes made after the sweeper reported the file still hold it back
+			if(all || fileNow - timestamp >= quiescence || now - i->second >= maxLatency) {
+				ready.emplace_back(std::move(path));
+				i = pending.erase(i);
+			} else i++;
+		}
+
+		for(auto& path: ready)
+			release(path);
+	}
+
+	// Function which checks if any changes are being held back
+	bool empty() const { return pending.empty(); }
+
+protected:
+	// Files with pending changes, and when they were first reported
+	std::unordered_map<std::string, std::chrono::steady_clock::time_point> pending;
+};
+
+#endif // __CHANGE_COALESCER_HPP__
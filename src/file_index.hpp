@@ -0,0 +1,208 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	This file provides a file index singleton, an in memory copy of the managed folder tree which is kept up to date as files change
+*/
+
+#ifndef __FILE_INDEX_HPP__
+#define __FILE_INDEX_HPP__
+
+#include <string>
+#include <limits>
+#include <unordered_map>
+
+#include "include_everywhere.hpp"
+#include "monitor.hpp"
+#include "parallel_walk.hpp"
+
+// Singleton tree of every file in the managed folders, so that code which needs a list of the managed files doesn't need to walk the disk
+// Each path component is interned once, and each directory stores a list of its children
+// NOTE: Files in .wnts folders are never added, so nothing consulting the index needs to check for them
+struct FileIndex {
+	// Type used to identify a node (file or directory) in the tree
+	using NodeID = uint32_t;
+	static constexpr NodeID invalidNode = std::numeric_limits<NodeID>::max();
+	// The virtual node that every managed folder hangs off of
+	static constexpr NodeID rootNode = 0;
+
+	// A file or directory in the tree
+	struct Node {
+		NodeID parent = invalidNode;
+		// Index of the interned name of this node
+		uint32_t name = 0;
+		// Index of this node in its parent's list of children
+		uint32_t indexInParent = 0;
+		bool directory = false;
+		std::vector<NodeID> children;
+	};
+
+	// The data guarded by the index's lock
+	struct Tree {
+		// Interned path components (and a map from component to index)
+		std::vector<std::string> names;
+		std::unordered_map<std::string, uint32_t> nameIDs;
+		// Every node in the tree, and the nodes which have been removed and can be reused
+		std::vector<Node> nodes = {Node{invalidNode, 0, 0, true, {}}};
+		std::vector<NodeID> freeNodes;
+		// Map from (parent, name) to the child node with that name
+		std::unordered_map<uint64_t, NodeID> childLookup;
+		// The number of files (not directories) in the tree
+		size_t fileCount = 0;
+	};
+
+	// Function which gets the FileIndex singleton
+	static FileIndex& singleton() {
+		static FileIndex instance;
+		return instance;
+	}
+
+	// Function which replaces the contents of the index with the files currently on disk in the provided folders
+	void rebuild(const std::vector<std::filesystem::path>& folders) {
+		auto entries = ParallelWalker::walk(folders);
+		auto tree = this->tree.write_lock();
+		*tree = {};
+		for(auto& entry: entries)
+			insert(*tree, entry.path);
+	}
+
+	// Function which adds a file to the index (creating any intermediate directories)
+	void add(const std::filesystem::path& path) {
+		for(auto& component: path)
+			if(component == ".wnts") return;
+
+		auto tree = this->tree.write_lock();
+		insert(*tree, path);
+	}
+
+	// Function which removes a file (or a directory and everything in it) from the index
+	void remove(const std::filesystem::path& path) {
+		auto tree = this->tree.write_lock();
+		NodeID node = find(*tree, path);
+		if(node != invalidNode && node != rootNode)
+			erase(*tree, node);
+	}
+
+	// Function which checks if a file is in the index
+	bool contains(const std::filesystem::path& path) const {
+		auto tree = this->tree.read_lock();
+		NodeID node = find(*tree, path);
+		return node != invalidNode && !tree->nodes[node].directory;
+	}
+
+	// Function which gets the number of files in the index
+	size_t size() const { return tree.read_lock()->fileCount; }
+
+	// Function which gets a list of every file in the index (or only the files inside of <directory> if it is provided)
+	std::vector<std::filesystem::path> files(const std::filesystem::path& directory = {}) const {
+		std::vector<std::filesystem::path> out;
+		auto tree = this->tree.read_lock();
+		NodeID start = directory.empty() ? rootNode : find(*tree, directory);
+		if(start == invalidNode) return out;
+
+		out.reserve(directory.empty() ? tree->fileCount : 0);
+		// Depth first walk, building up each path as we go
+		std::vector<std::pair<NodeID, std::filesystem::path>> stack = {{start, directory}};
+		while(!stack.empty()) {
+			auto [node, path] = std::move(stack.back());
+			stack.pop_back();
+
+			auto& n = tree->nodes[node];
+			if(!n.directory) {
+				out.emplace_back(std::move(path));
+				continue;
+			}
+			for(NodeID child: n.children)
+				stack.emplace_back(child, path / tree->names[tree->nodes[child].name]);
+		}
+		return out;
+	}
+
+protected:
+	// The tree (guarded by a read/write lock so that it can be read from several threads)
+	monitor<Tree> tree;
+
+	// Only the singleton can be constructed
+	FileIndex() {}
+
+	// Function which creates the key used to look up a child in the child lookup map
+	static uint64_t childKey(NodeID parent, uint32_t name) { return (uint64_t(parent) << 32) | name; }
+
+	// Function which finds the node for a path (invalidNode if it isn't in the tree)
+	static NodeID find(const Tree& tree, const std::filesystem::path& path) {
+		NodeID node = rootNode;
+		for(auto& component: path) {
+			auto name = tree.nameIDs.find(component.string());
+			if(name == tree.nameIDs.end()) return invalidNode;
+			auto child = tree.childLookup.find(childKey(node, name->second));
+			if(child == tree.childLookup.end()) return invalidNode;
+			node = child->second;
+		}
+		return node;
+	}
+
+	// Function which adds a path to the tree, the last component is a file every other component is a directory
+	static void insert(Tree& tree, const std::filesystem::path& path) {
+		if(path.empty()) return;
+		NodeID node = rootNode;
+		auto last = std::prev(path.end());
+		for(auto i = path.begin(); i != path.end(); i++) {
+			// Intern the component's name
+			auto [name, added] = tree.nameIDs.try_emplace(i->string(), tree.names.size());
+			if(added) tree.names.push_back(i->string());
+
+			// Find or create the child
+			auto key = childKey(node, name->second);
+			if(auto child = tree.childLookup.find(key); child != tree.childLookup.end()) {
+				node = child->second;
+				// If a file has been replaced by a directory, convert its node
+				if(i != last && !tree.nodes[node].directory) {
+					tree.nodes[node].directory = true;
+					tree.fileCount--;
+				}
+				continue;
+			}
+
+			NodeID child;
+			if(!tree.freeNodes.empty()) {
+				child = tree.freeNodes.back();
+				tree.freeNodes.pop_back();
+			} else {
+				child = tree.nodes.size();
+				tree.nodes.emplace_back();
+			}
+			auto& parent = tree.nodes[node];
+			tree.nodes[child] = Node{node, name->second, uint32_t(parent.children.size()), i != last, {}};
+			parent.children.push_back(child);
+			tree.childLookup[key] = child;
+			if(i == last) tree.fileCount++;
+			node = child;
+		}
+	}
+
+	// Function which removes a node (and all of its children) from the tree
+	static void erase(Tree& tree, NodeID node) {
+		// Remove the node from its parent's list of children (moving the last child into its place)
+		auto& n = tree.nodes[node];
+		auto& siblings = tree.nodes[n.parent].children;
+		siblings[n.indexInParent] = siblings.back();
+		tree.nodes[siblings.back()].indexInParent = n.indexInParent;
+		siblings.pop_back();
+
+		// Release the node and all of its children
+		std::vector<NodeID> stack = {node};
+		while(!stack.empty()) {
+			auto& released = tree.nodes[stack.back()];
+			NodeID id = stack.back();
+			stack.pop_back();
+
+			stack.insert(stack.end(), released.children.begin(), released.children.end());
+			tree.childLookup.erase(childKey(released.parent, released.name));
+			if(!released.directory) tree.fileCount--;
+			released = {};
+			tree.freeNodes.push_back(id);
+		}
+	}
+};
+
+#endif // __FILE_INDEX_HPP__
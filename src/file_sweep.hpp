@@ -8,11 +8,17 @@
 #ifndef __FILE_SWEEP_HPP__
 #define __FILE_SWEEP_HPP__
 
-#include <map>
+#include <algorithm>
 #include <vector>
+#include <functional>
 #include <boost/predef.h>
 
 #include "include_everywhere.hpp"
+#include "ignore_rules.hpp"
+#include "file_index.hpp"
+#include "parallel_walk.hpp"
+#include "path_table.hpp"
+#include "sweep_snapshot.hpp"
 
 // Class which sweeps the provided folder structure every time its sweep function is called
 // There is a fast track optimization, where a recently modified subset of files is sweept every call, or a total sweep scanning all of the folders can be preformed
@@ -20,7 +26,7 @@ struct FilesystemSweeper {
 	// Reference to the folders the system is responsible for sweeping
 	const std::vector<std::filesystem::path>& folders;
 
-	using PathCallback = void(*)(const std::filesystem::path& path);
+	using PathCallback = std::function<void(const std::filesystem::path& path)>;
 	// Function callback (return void, taking path) called when the sweeper detects that a file has been created
 	PathCallback onFileCreated,
 	// Function callback (return void, taking path) called when the sweeper detects that a file has been modified
@@ -32,19 +38,65 @@ struct FilesystemSweeper {
 	// Function callback (return void, taking path) called when the sweeper detects that a file has been unfast-tracked (unlocked)
 		onFileUnFastTracked;
 
-	// Timestamps and counters tracking the last time every file was modified
-	std::map<std::filesystem::path, std::pair<std::filesystem::file_time_type, size_t>> timestamps;
-	// Timestamps and counters tracking when recently modified files were modified
-	std::map<std::filesystem::path, std::pair<std::filesystem::file_time_type, size_t>> fastTrackTimestamps;
+	// Interned paths of every file we are tracking (IDs index into the arrays below)
+	PathTable paths;
+	// The last time every tracked file was modified, its size, the hash of its content (0 if not yet known), and the last sweep iteration which saw the file
+	std::vector<std::filesystem::file_time_type> timestamps;
+	std::vector<uint64_t> sizes, hashes;
+	std::vector<uint32_t> sweepIterations;
+	// The index of every tracked file in the fast track list (notFastTracked if it isn't recently modified), and the list of recently modified files
+	std::vector<uint32_t> fastTrackIndices;
+	std::vector<PathTable::ID> fastTrack;
+	// Cache of the contents of the managed directories, used to skip reading directories which haven't changed during total sweeps
+	DirectoryCache directoryCache;
 	// Counter used to detect deleted files (if we update the counters of all of the scanned files,
 	//	but a file we are tracking doesn't get its counter updated, that means it was deleted)
-	size_t iteration = 0;
+	uint32_t iteration = 0;
+	// Whether or not the tracked files have changed since the snapshot was last saved
+	bool snapshotDirty = false;
+	// How many threads total sweeps walk the folders with
+	size_t walkThreads = ParallelWalker::defaultThreadCount();
 
 	// Function which sets up the file sweaper
 	void setup() {
-		// Remove all of the .wnts folders
+		// Load what we knew about the files the last time we ran (so that the first total sweep only reports changes made while we weren't running)
+		// NOTE: Loaded files are given the previous sweep iteration, so any which no longer exist are reported as deleted by the first total sweep
 		for(auto& folder: folders)
-			remove_all(folder / ".wnts");
+			SweepSnapshot::load(SweepSnapshot::path(folder), [this](std::string_view path, std::filesystem::file_time_type timestamp, uint64_t size, uint64_t hash) {
+				auto [id, added] = paths.insert(path);
+				ensureCapacity();
+				timestamps[id] = timestamp;
+				sizes[id] = size;
+				hashes[id] = hash;
+				sweepIterations[id] = iteration - 1;
+				FileIndex::singleton().add(std::filesystem::path(path));
+
+				// If the saved hash of the file's content has been lost, restore it (so that an unchanged file isn't propagated again)
+				auto wnts = wntsPath(path);
+				if(hash && !exists(wnts)) {
+					create_directories(wnts.parent_path());
+					std::ofstream(wnts) << hash;
+				}
+			});
+	}
+
+	// Function which saves a snapshot of what we know about the files in each managed folder
+	void saveSnapshot() {
+		for(auto& folder: folders) {
+			// Every tracked file in the folder (with a / so that the folder "a" doesn't match the file "ab/c")
+			auto prefix = folder.native() + std::string(1, std::filesystem::path::preferred_separator);
+			std::vector<SweepSnapshot::Entry> entries;
+			paths.forEach([&](PathTable::ID id) {
+				auto& path = paths.path(id);
+				if(path.compare(0, prefix.size(), prefix) != 0) return;
+
+				// Read the hash of any file whose content has changed since the last snapshot
+				if(hashes[id] == 0) std::ifstream(wntsPath(path)) >> hashes[id];
+				entries.push_back({path, timestamps[id], sizes[id], hashes[id]});
+			});
+			SweepSnapshot::save(SweepSnapshot::path(folder), entries);
+		}
+		snapshotDirty = false;
 	}
 
 	// Function which calls sweep, automatically preforming a total sweep every <n> iterations
@@ -54,98 +106,246 @@ struct FilesystemSweeper {
 	}
 
 	// Function which scans the file system and reports (via callback functions) all of the changed, modified, and deleted files
-	void sweep(bool total = false) {
-		// Paths to the files this sweep should scan
-		std::vector<std::filesystem::path> paths;
-		// Pointer to the appropriate timestamp map (default total sweep map)
-		auto* timestamps = &this->timestamps;
-
-		// If we are doing a total sweep, recursively add all of the files to <paths> (except those in the .wnts folder)
-		if(total)
-			enumerateAllFiles(folders, paths);
-		// If we are doing a fasttrack sweep, update the timestamp map point and add all of the current fasttrack files to <paths>
-		else {
-			for (auto& [path, _]: fastTrackTimestamps)
-				paths.push_back(path);
-			timestamps = &fastTrackTimestamps;
-		}
+	//	Total sweeps may be run at a low I/O priority (so they don't compete with other programs when the disk is busy)
+	void sweep(bool total = false, bool lowPriority = false) {
+		auto start = std::chrono::steady_clock::now();
+		// The files this sweep is responsible for (every file for total sweeps, only fast tracked files otherwise)
+		std::vector<PathTable::ID> swept;
 
-		// Variables tracking paths that have been deleted or that should be removed from the fast track (haven't been modiifed recently)
-		std::vector<std::filesystem::path> removedFiles, fastTrackRemovedFiles;
-
-		// For every file this scan should consider...
-		try {
-			for(auto& path: paths) {
-				// Determine the timestamp of when the file was last modified
-				auto timestamp = last_write_time(path);
-				auto pair = std::make_pair(timestamp, iteration);
-
-				// If we aren't tracking this file, that means it was created
-				if(timestamps->find(path) == timestamps->end()) {
-					// File has been created!
-					onFileCreated(path);
-
-					// If the file wasn't already in the fast tracked list, it has been added!
-					if(fastTrackTimestamps.find(path) == fastTrackTimestamps.end())
-						onFileFastTracked(path);
-					fastTrackTimestamps[path] = pair; // Mark the file as being fast tracked
-				// If our stored timestamp for this file is older than its most recent timestamp it has been modified
-				} else if((*timestamps)[path].first < timestamp) {
-					// File has been modified!
-					onFileModified(path);
-
-					// If the file wasn't already in the fast tracked list, it has been added!
-					if(fastTrackTimestamps.find(path) == fastTrackTimestamps.end())
-						onFileFastTracked(path);
-					fastTrackTimestamps[path] = pair; // Mark the file as being fast tracked
-				}
-
-				// Update timestamp and sweep iteration information for this file
-				(*timestamps)[path] = pair;
+		// If we are doing a total sweep, walk all of the folders in parallel (except ignored files and directories) and check every file that was found
+		// NOTE: Files which no longer exist don't have their sweep iteration updated, so they are detected as deleted below
+		if(total) {
+			// NOTE: Files in directories which haven't changed since the last total sweep aren't necessarily checked (see DirectoryCache),
+			//	their sweep iteration is still updated so they aren't considered deleted
+			std::vector<std::filesystem::path> unscanned;
+			for(auto& entry: ParallelWalker::walk(folders, &directoryCache, &unscanned, lowPriority, walkThreads))
+				if(entry.stated)
+					check(entry.path, entry.timestamp, entry.size);
+				else if(auto id = paths.find(entry.path.native()); id != PathTable::invalidID)
+					sweepIterations[id] = iteration;
+				else sweepPaths({entry.path});
+			// NOTE: Nothing is known about the files under directories which couldn't be read, so they are treated as unchanged rather than deleted
+			for(auto& directory: unscanned) {
+				if(useVerboseOutput) std::cerr << "wnts: Failed to read " << directory << ", skipping the files under it" << std::endl;
+				for(auto& path: FileIndex::singleton().files(directory))
+					if(auto id = paths.find(path.native()); id != PathTable::invalidID)
+						sweepIterations[id] = iteration;
+			}
+			paths.forEach([&swept](PathTable::ID id) { swept.push_back(id); });
+		// If we are doing a fasttrack sweep, check all of the current fasttrack files
+		} else {
+			swept = fastTrack;
+			for(auto id: swept) {
+				std::filesystem::file_time_type timestamp;
+				uint64_t size;
+				if(statFile(paths.path(id), timestamp, size))
+					check(id, timestamp, size);
 			}
-		// If we are trying to get the timestamp for a file which no longer exists, mark that file as deleted
-		} catch(std::filesystem::filesystem_error e) {
-			if(e.code().value() == 2)
-				removedFiles.push_back(e.path1());
-			else throw e;
 		}
 
 		// Calculate the current time
 		auto now = std::filesystem::file_time_type::clock::now();
 
-		// For every tracked file...
-		for(auto& [path, pair]: *timestamps) {
-			auto& [timestamp, sweepIteration] = pair;
-
+		// For every file this sweep is responsible for...
+		for(auto id: swept) {
 			// If its sweep iteration doesn't match the current sweep iteration, the file has been deleted
-			if(sweepIteration != iteration) {
+			if(sweepIterations[id] != iteration) {
+				std::filesystem::path path = paths.path(id);
+				// If the file is now ignored, we stop tracking it without deleting it anywhere else
+				if(total && IgnoreRules::singleton().isIgnored(path)) {
+					FileIndex::singleton().remove(path);
+					untrack(id);
+					continue;
+				}
+				// If the file was removed by the message manager, we stop tracking it without telling anyone
+				if(removedByMessageManager(path)) {
+					untrack(id);
+					continue;
+				}
+
 				// File has been deleted!
 				onFileDeleted(path);
 
-				removedFiles.emplace_back(path); // Mark the file as deleted
+				FileIndex::singleton().remove(path);
+				untrack(id);
 			// If the file hasn't been modified recently (within 10 seconds), the file is no longer fast tracked
-			} else if(std::chrono::duration_cast<std::chrono::milliseconds>(now - timestamp).count() > 10'000) {
+			} else if(std::chrono::duration_cast<std::chrono::milliseconds>(now - timestamps[id]).count() > 10'000) {
 				// If the file was already fast tracked, the file has been unfast-tracked!
-				if(fastTrackTimestamps.find(path) != fastTrackTimestamps.end())
-					onFileUnFastTracked(path);
+				if(fastTrackIndices[id] != notFastTracked) {
+					onFileUnFastTracked(paths.path(id));
+					removeFromFastTrack(id);
+				}
+			}
+		}
 
-				fastTrackRemovedFiles.emplace_back(path);
+		iteration++;
+
+		// Save what we know about the files after every total sweep which found changes
+		if(total && snapshotDirty)
+			saveSnapshot();
+
+		// Report how long the sweep took per file
+		if(useVerboseOutput && !swept.empty()) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			std::cout << (total ? "Total" : "Fast track") << " sweep checked " << swept.size() << " files in " << elapsed / 1'000'000.0 << "ms ("
+				<< elapsed / swept.size() << "ns per file)" << std::endl;
+			if(total)
+				std::cout << "\t" << directoryCache.listedDirectories << " directories read, " << directoryCache.prunedDirectories << " unchanged directories skipped ("
+					<< directoryCache.skippedFiles << " files not checked)" << std::endl;
+		}
+	}
+
+	// Function which checks only the provided files (for instance the files a FilesystemWatcher reported changes to),
+	//	reporting (via callback functions) any that have been created, modified, or deleted
+	void sweepPaths(const std::vector<std::filesystem::path>& paths) {
+		for(auto& path: paths) {
+			// Ignored files are never checked (and stop being tracked if we were tracking them)
+			if(IgnoreRules::singleton().isIgnored(path)) {
+				if(auto id = this->paths.find(path.native()); id != PathTable::invalidID) {
+					FileIndex::singleton().remove(path);
+					untrack(id);
+				}
+				continue;
 			}
 
+			std::filesystem::file_time_type timestamp;
+			uint64_t size;
+			if(statFile(path, timestamp, size)) {
+				check(path, timestamp, size);
+				continue;
+			}
+
+			// If the file no longer exists, but we were tracking it, it has been deleted
+			if(auto id = this->paths.find(path.native()); id != PathTable::invalidID) {
+				// If the file was removed by the message manager, we stop tracking it without telling anyone
+				if(removedByMessageManager(path)) {
+					untrack(id);
+					continue;
+				}
+
+				// File has been deleted!
+				onFileDeleted(path);
+
+				FileIndex::singleton().remove(path);
+				untrack(id);
+			}
 		}
+	}
+
+	// Function which checks every file in a directory (and its subdirectories), as well as every file we are tracking in the directory
+	//	(used when a directory is created, moved, or deleted, or when we might have missed events inside of it)
+	void sweepDirectory(const std::filesystem::path& directory) {
+		// Check every file currently in the directory
+		std::vector<PathTable::ID> found;
+		std::vector<std::filesystem::path> unscanned;
+		for(auto& entry: ParallelWalker::walk({directory}, nullptr, &unscanned))
+			found.push_back(check(entry.path, entry.timestamp, entry.size));
+		// Files under directories which couldn't be read weren't found, but they weren't necessarily deleted either
+		for(auto& skipped: unscanned)
+			for(auto& path: FileIndex::singleton().files(skipped))
+				if(auto id = paths.find(path.native()); id != PathTable::invalidID)
+					found.push_back(id);
+
+		// Any file we were tracking in the directory that wasn't found might have been deleted
+		// NOTE: The file index contains the files we are tracking (and those the message manager has written)
+		std::sort(found.begin(), found.end());
+		std::vector<std::filesystem::path> missing;
+		for(auto& path: FileIndex::singleton().files(directory))
+			if(auto id = paths.find(path.native()); id != PathTable::invalidID && !std::binary_search(found.begin(), found.end(), id))
+				missing.emplace_back(std::move(path));
+		sweepPaths(missing);
+	}
+
+protected:
+	// Value of a fast track index marking that a file isn't fast tracked
+	static constexpr uint32_t notFastTracked = std::numeric_limits<uint32_t>::max();
+
+	// Function which checks a single file (whose timestamp and size are already known), reporting (via callback functions) if the file was created or modified
+	//	Returns the file's ID
+	PathTable::ID check(const std::filesystem::path& path, std::filesystem::file_time_type timestamp, uint64_t size) {
+		// Find the file in the table (adding it if we haven't seen it before)
+		auto [id, added] = paths.insert(path.native());
+		if(!added) return check(id, timestamp, size);
+
+		// If we weren't tracking this file, that means it was created
+		ensureCapacity();
+		// File has been created!
+		FileIndex::singleton().add(path);
+		onFileCreated(path);
+
+		timestamps[id] = timestamp;
+		sizes[id] = size;
+		hashes[id] = 0;
+		addToFastTrack(id, path);
+		snapshotDirty = true;
 
-		// Remove deleted files from both the total and fast track maps
-		for(auto& path: removedFiles) {
-			this->timestamps.erase(path);
-			fastTrackTimestamps.erase(path);
+		// Update sweep iteration information for this file
+		sweepIterations[id] = iteration;
+		return id;
+	}
+	PathTable::ID check(PathTable::ID id, std::filesystem::file_time_type timestamp, uint64_t size) {
+		// If our stored timestamp or size for this file doesn't match its current timestamp or size it has been modified
+		// NOTE: The timestamp may have gone backwards if the file was restored while we weren't running
+		if(timestamps[id] != timestamp || sizes[id] != size) {
+			// File has been modified!
+			std::filesystem::path path = paths.path(id);
+			onFileModified(path);
+
+			timestamps[id] = timestamp;
+			sizes[id] = size;
+			hashes[id] = 0;
+			addToFastTrack(id, path);
+			snapshotDirty = true;
 		}
 
-		// Remove unfast-tracked files from the fast track map
-		for(auto& path: fastTrackRemovedFiles)
-			fastTrackTimestamps.erase(path);
+		// Update sweep iteration information for this file
+		sweepIterations[id] = iteration;
+		return id;
+	}
 
-		iteration++;
+	// Function which makes sure the per file arrays are large enough to hold every ID the path table has handed out
+	void ensureCapacity() {
+		if(timestamps.size() >= paths.capacity()) return;
+		timestamps.resize(paths.capacity());
+		sizes.resize(paths.capacity());
+		hashes.resize(paths.capacity());
+		sweepIterations.resize(paths.capacity());
+		fastTrackIndices.resize(paths.capacity(), notFastTracked);
+	}
+
+	// Function which marks a file as being fast tracked (if it isn't already)
+	void addToFastTrack(PathTable::ID id, const std::filesystem::path& path) {
+		if(fastTrackIndices[id] != notFastTracked) return;
+
+		// The file wasn't already in the fast tracked list, it has been added!
+		onFileFastTracked(path);
+		fastTrackIndices[id] = fastTrack.size();
+		fastTrack.push_back(id);
+	}
+
+	// Function which removes a file from the fast track list (moving the last file in the list into its place)
+	void removeFromFastTrack(PathTable::ID id) {
+		auto index = fastTrackIndices[id];
+		if(index == notFastTracked) return;
+
+		fastTrack[index] = fastTrack.back();
+		fastTrackIndices[fastTrack.back()] = index;
+		fastTrack.pop_back();
+		fastTrackIndices[id] = notFastTracked;
+	}
+
+	// Function which checks if a tracked file which no longer exists was removed by the message manager rather than by the user
+	//	(a file deleted by another node, or deleted when we reconnect because the gateway is going to send it to us again)
+	// NOTE: The file index holds every file we are tracking, and only the message manager removes files from it behind our back,
+	//	so reporting these files as deleted would delete them across the whole network
+	static bool removedByMessageManager(const std::filesystem::path& path) { return !FileIndex::singleton().contains(path); }
+
+	// Function which stops tracking a file
+	void untrack(PathTable::ID id) {
+		removeFromFastTrack(id);
+		paths.erase(id);
+		snapshotDirty = true;
 	}
 };
 
-#endif // __FILE_SWEEP_HPP__
\ No newline at end of file
+#endif // __FILE_SWEEP_HPP__
@@ -0,0 +1,192 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which asks the operating system to notify us when files in the managed folders change
+*/
+
+#ifndef __FILE_WATCHER_HPP__
+#define __FILE_WATCHER_HPP__
+
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <boost/predef.h>
+
+#if BOOST_OS_LINUX
+	#include <sys/inotify.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+#include "include_everywhere.hpp"
+#include "ignore_rules.hpp"
+
+// Class which watches the provided folder structure for changes (using inotify on Linux), so that only the files which have actually changed need to be swept
+// When the platform doesn't support watching (or we run out of watches) isWatching returns false and the caller should fall back to periodic total sweeps
+struct FilesystemWatcher {
+	// How long a directory is remembered as recently active (used to decide what to rescan if the kernel drops events)
+	static constexpr auto recentWindow = 60s;
+
+	// The changes reported by a call to poll
+	struct Changes {
+		// Files which were created, modified, or deleted
+		std::vector<std::filesystem::path> files;
+		// Directories which need to be rescanned completely (created, moved, deleted, or possibly missed events)
+		std::vector<std::filesystem::path> directories;
+		// Whether or not the kernel dropped events (and the directories we know about may not cover all of the changes)
+		bool overflowed = false;
+	};
+
+	FilesystemWatcher() {
+#if BOOST_OS_LINUX
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(fd < 0) std::cerr << "wnts: Failed to start watching the filesystem, falling back to sweeping" << std::endl;
+#endif
+	}
+	~FilesystemWatcher() {
+#if BOOST_OS_LINUX
+		if(fd >= 0) ::close(fd);
+#endif
+	}
+	FilesystemWatcher(const FilesystemWatcher&) = delete;
+	FilesystemWatcher& operator=(const FilesystemWatcher&) = delete;
+
+	// Function which checks if the watcher is reliably reporting changes
+	bool isWatching() const { return fd >= 0 && !missingWatches; }
+
+	// Function which starts watching any of the managed <folders> that aren't already being watched (the managed folders change once we connect to a network)
+	void update(const std::vector<std::filesystem::path>& folders) {
+		// If the ignore rules changed, directories which are no longer ignored need to be watched
+		if(rulesGeneration != IgnoreRules::singleton().getGeneration()) {
+			rulesGeneration = IgnoreRules::singleton().getGeneration();
+			for(auto& folder: watchedFolders)
+				watchRecursively(folder);
+		}
+
+		for(auto& folder: folders)
+			if(watchedFolders.find(folder) == watchedFolders.end()) {
+				watchRecursively(folder);
+				watchedFolders.insert(folder);
+				// Anything written to the folder before the watch was added needs to be found by rescanning it
+				if(!firstUpdate) unwatchedDirectories.insert(folder);
+			}
+		firstUpdate = false;
+	}
+
+	// Function which reads all of the events the kernel has queued and converts them into a list of changed files and directories
+	Changes poll() {
+		Changes changes;
+#if BOOST_OS_LINUX
+		if(fd < 0) return changes;
+
+		std::set<std::filesystem::path> files, directories = std::move(unwatchedDirectories);
+		unwatchedDirectories.clear();
+		auto now = std::chrono::steady_clock::now();
+		alignas(inotify_event) char buffer[64 * 1024];
+		while(true) {
+			ssize_t length = ::read(fd, buffer, sizeof(buffer));
+			if(length <= 0) break; // EAGAIN means there are no more events
+
+			for(char* ptr = buffer; ptr < buffer + length; ) {
+				auto& event = *(inotify_event*) ptr;
+				ptr += sizeof(inotify_event) + event.len;
+
+				// If the kernel's queue filled up, we don't know what changed
+				if(event.mask & IN_Q_OVERFLOW) {
+					changes.overflowed = true;
+					continue;
+				}
+
+				auto watch = watches.find(event.wd);
+				if(watch == watches.end()) continue;
+				// The watch was removed (the directory was deleted or unmounted)
+				if(event.mask & IN_IGNORED) {
+					watches.erase(watch);
+					continue;
+				}
+				if(event.len == 0) continue; // Events about the directory itself are reported by its parent
+
+				auto& directory = watch->second;
+				auto path = directory / event.name;
+				if(IgnoreRules::singleton().isIgnored(path, event.mask & IN_ISDIR)) continue;
+				recentDirectories[directory] = now;
+
+				if(event.mask & IN_ISDIR) {
+					// New directories need to be watched (and any files created in them before the watch was added need to be found)
+					if(event.mask & (IN_CREATE | IN_MOVED_TO))
+						watchRecursively(path);
+					directories.insert(path);
+				} else files.insert(path);
+			}
+		}
+
+		// Forget directories which haven't been active recently (on every poll, so the record only ever covers the recent window),
+		//	and if events were dropped, rescan every directory which is left
+		for(auto i = recentDirectories.begin(); i != recentDirectories.end(); )
+			if(now - i->second > recentWindow)
+				i = recentDirectories.erase(i);
+			else {
+				if(changes.overflowed) directories.insert(i->first);
+				i++;
+			}
+
+		changes.files.assign(files.begin(), files.end());
+		changes.directories.assign(directories.begin(), directories.end());
+#endif
+		return changes;
+	}
+
+protected:
+	// inotify file descriptor (-1 if watching isn't supported)
+	int fd = -1;
+	// Whether or not we failed to watch some directories (in which case changes may be missed)
+	bool missingWatches = false;
+	// Map of watch descriptors to the directories they watch
+	std::unordered_map<int, std::filesystem::path> watches;
+	// The managed folders that are being watched, and any which started being watched since the last poll
+	std::set<std::filesystem::path> watchedFolders, unwatchedDirectories;
+	// Whether or not the next update is the first (the folders being watched at startup are covered by the first total sweep)
+	bool firstUpdate = true;
+	// The generation of the ignore rules the watches were added with
+	size_t rulesGeneration = 0;
+	// Directories which have recently had events, and when
+	std::map<std::filesystem::path, std::chrono::steady_clock::time_point> recentDirectories;
+
+	// Function which watches a directory and all of its subdirectories (except for ignored directories)
+	void watchRecursively(const std::filesystem::path& directory) {
+#if BOOST_OS_LINUX
+		if(fd < 0) return;
+
+		if(!watch(directory)) return;
+		std::error_code ec;
+		for(std::filesystem::recursive_directory_iterator i(directory, ec), end; !ec && i != end; i.increment(ec))
+			if(i->is_directory(ec)) {
+				if(IgnoreRules::singleton().isIgnored(i->path(), /*directory*/ true))
+					i.disable_recursion_pending();
+				else watch(i->path());
+			}
+#endif
+	}
+
+	// Function which watches a single directory
+	bool watch(const std::filesystem::path& directory) {
+#if BOOST_OS_LINUX
+		int wd = inotify_add_watch(fd, directory.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+		if(wd < 0) {
+			// If we ran out of watches, we can no longer rely on the watcher to find every change
+			if(errno == ENOSPC) {
+				if(!missingWatches) std::cerr << "wnts: Ran out of filesystem watches (see fs.inotify.max_user_watches), falling back to sweeping" << std::endl;
+				missingWatches = true;
+			}
+			return false;
+		}
+		watches[wd] = directory;
+		return true;
+#else
+		return false;
+#endif
+	}
+};
+
+#endif // __FILE_WATCHER_HPP__
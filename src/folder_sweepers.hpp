@@ -0,0 +1,313 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which sweeps every managed folder with its own sweeper on its own thread
+*/
+
+#ifndef __FOLDER_SWEEPERS_HPP__
+#define __FOLDER_SWEEPERS_HPP__
+
+#include <condition_variable>
+#include <memory>
+#include <set>
+#include <jthread.hpp>
+
+#include "include_everywhere.hpp"
+#include "file_sweep.hpp"
+
+// Class which gives every managed folder its own FilesystemSweeper running on its own thread, so a folder on a slow disk never delays
+//	detecting changes in the others
+// The changes every sweeper finds are merged into a single stream (in the order they were found, which keeps each folder's changes in order)
+//	which is delivered to the callbacks on the thread that calls drain
+struct FolderSweepers {
+	using Clock = std::chrono::steady_clock;
+	using PathCallback = FilesystemSweeper::PathCallback;
+
+	// Function callbacks (see FilesystemSweeper) called by drain
+	PathCallback onFileCreated, onFileModified, onFileDeleted, onFileFastTracked, onFileUnFastTracked;
+	// Function called (from the folders' threads) whenever a change is found, so the thread calling drain can be woken up
+	std::function<void()> onChangeFound;
+	// Function called (by drain) once every folder has finished the total sweep requested of it, with how long the slowest folder's sweep took
+	std::function<void(Clock::duration)> onTotalSweepFinished;
+
+	// How long the sweeps of a folder take
+	struct Stats {
+		// How long the most recent sweep (and total sweep) took, and the average time between a sweep being requested and it finishing
+		Clock::duration lastSweep{}, lastTotalSweep{};
+		double averageLatency = 0;
+		size_t sweeps = 0;
+	};
+
+	FolderSweepers(PathCallback onFileCreated, PathCallback onFileModified, PathCallback onFileDeleted,
+		PathCallback onFileFastTracked, PathCallback onFileUnFastTracked) : onFileCreated(onFileCreated), onFileModified(onFileModified),
+		onFileDeleted(onFileDeleted), onFileFastTracked(onFileFastTracked), onFileUnFastTracked(onFileUnFastTracked) {}
+	FolderSweepers(const FolderSweepers&) = delete;
+	FolderSweepers& operator=(const FolderSweepers&) = delete;
+
+	// Function which starts a sweeper for any of the managed <folders> that doesn't have one, and stops the sweepers of folders which are no longer managed
+	//	(the managed folders change once we connect to a network)
+	// NOTE: Each sweeper is given its own copy of its folder, so the sweepers never read the list of managed folders while it is being changed
+	void update(const std::vector<std::filesystem::path>& folders) {
+		for(auto i = roots.begin(); i != roots.end(); )
+			if(std::find(folders.begin(), folders.end(), (*i)->folders.front()) == folders.end()) {
+				forgetTotalSweep(i->get());
+				i = roots.erase(i); // NOTE: Destroying the root stops (and joins) its thread
+			} else i++;
+
+		for(auto& folder: folders)
+			if(std::find_if(roots.begin(), roots.end(), [&folder](auto& root) { return root->folders.front() == folder; }) == roots.end()) {
+				// NOTE: Walks are split between the folders' threads, so sweeping every folder at once doesn't create an excessive number of threads
+				auto walkThreads = std::max<size_t>(2, ParallelWalker::defaultThreadCount() / folders.size());
+				// The new folder's first sweep is a total sweep, which joins the total sweep in progress (or starts a new one)
+				size_t round;
+				{
+					std::scoped_lock lock(changesMutex);
+					if(totalOwed.empty()) {
+						totalRound++;
+						slowestInRound = {};
+					}
+					round = totalRound;
+				}
+				roots.emplace_back(std::make_unique<Root>(*this, folder, walkThreads, round));
+				std::scoped_lock lock(changesMutex);
+				totalOwed.insert(roots.back().get());
+			}
+	}
+
+	// Function which asks every folder's sweeper to sweep (see FilesystemSweeper::sweep), first checking any of the provided files and directories inside of the folder
+	//	If a folder's sweeper is still busy with a previous sweep, the requests are merged and run once it finishes
+	void request(bool total, bool lowPriority, const std::vector<std::filesystem::path>& files = {}, const std::vector<std::filesystem::path>& directories = {}) {
+		auto now = Clock::now();
+		// A total sweep starts a new round, which is finished once every folder has run a total sweep requested in it
+		size_t round = 0;
+		if(total) {
+			std::scoped_lock lock(changesMutex);
+			round = ++totalRound;
+			slowestInRound = {};
+			totalOwed.clear();
+			for(auto& root: roots) totalOwed.insert(root.get());
+		}
+		for(auto& root: roots) {
+			{
+				std::scoped_lock lock(root->mutex);
+				auto& request = root->request;
+				if(!request.pending) request.requested = now;
+				request.pending = true;
+				// NOTE: Merged total sweeps are only run at a low priority if all of them asked to be
+				if(total) request.lowPriority = (request.total ? request.lowPriority : true) && lowPriority;
+				if(total) request.totalRound = round;
+				request.total |= total;
+				for(auto& file: files)
+					if(root->contains(file)) request.files.push_back(file);
+				for(auto& directory: directories)
+					if(root->contains(directory)) request.directories.push_back(directory);
+			}
+			root->cv.notify_all();
+		}
+	}
+
+	// Function which waits until every folder's sweeper has finished all of the sweeps requested of it
+	void wait() {
+		for(auto& root: roots) {
+			std::unique_lock lock(root->mutex);
+			// NOTE: A folder which has been stopped will never finish the sweeps requested of it
+			root->cv.wait(lock, [&root] { return (!root->request.pending && !root->busy) || root->thread.get_stop_token().stop_requested(); });
+		}
+	}
+
+	// Function which stops every folder's thread, and waits for them to finish (including any sweep in progress)
+	// NOTE: The program may be exiting from one of the folders' threads (signals are delivered to any thread), that thread is detached instead
+	//	of joined (it never returns to the sweep it was running)
+	// NOTE: The folders aren't destroyed, another thread may still be waiting for them
+	void stop() {
+		for(auto& root: roots)
+			root->thread.request_stop();
+		for(auto& root: roots)
+			if(root->thread.get_id() == std::this_thread::get_id())
+				root->thread.detach();
+			else if(root->thread.joinable())
+				root->thread.join();
+	}
+
+	// Function which delivers every change the sweepers have found (in the order they were found) to the callbacks
+	//	Returns the number of changes delivered
+	size_t drain() {
+		std::vector<Change> changes;
+		std::vector<Clock::duration> finishedTotals;
+		{
+			std::scoped_lock lock(changesMutex);
+			changes.swap(this->changes);
+			finishedTotals.swap(this->finishedTotals);
+		}
+
+		for(auto& change: changes)
+			switch(change.type) {
+			break; case Change::Type::created: onFileCreated(change.path);
+			break; case Change::Type::modified: onFileModified(change.path);
+			break; case Change::Type::deleted: onFileDeleted(change.path);
+			break; case Change::Type::fastTracked: onFileFastTracked(change.path);
+			break; case Change::Type::unFastTracked: onFileUnFastTracked(change.path);
+			}
+		// NOTE: Delivered after the changes, which the total sweeps found before they finished
+		if(onTotalSweepFinished)
+			for(auto duration: finishedTotals)
+				onTotalSweepFinished(duration);
+		return changes.size() + finishedTotals.size();
+	}
+
+	// Function which gets the sweep statistics of every folder
+	std::vector<std::pair<std::filesystem::path, Stats>> stats() const {
+		std::vector<std::pair<std::filesystem::path, Stats>> out;
+		for(auto& root: roots) {
+			std::scoped_lock lock(root->mutex);
+			out.emplace_back(root->folders.front(), root->stats);
+		}
+		return out;
+	}
+
+protected:
+	// A change found by one of the sweepers
+	struct Change {
+		enum class Type { created, modified, deleted, fastTracked, unFastTracked } type;
+		std::filesystem::path path;
+	};
+
+	// The sweeps waiting to be run on a folder
+	struct Request {
+		bool pending = false, total = false, lowPriority = false;
+		// The round of total sweeps the (most recently merged) total sweep was requested in
+		size_t totalRound = 0;
+		// When the (oldest merged) request was made
+		Clock::time_point requested;
+		std::vector<std::filesystem::path> files, directories;
+	};
+
+	// A managed folder, along with its sweeper and the thread it is swept on
+	struct Root {
+		// The folder (the sweeper references this list)
+		std::vector<std::filesystem::path> folders;
+		FilesystemSweeper sweeper;
+		// The sweepers this folder belongs to
+		FolderSweepers& owner;
+
+		// Guards the request, busy flag, and stats (and is used to wake the thread)
+		mutable std::mutex mutex;
+		std::condition_variable cv;
+		Request request;
+		bool busy = false;
+		Stats stats;
+
+		// NOTE: The thread is last, so it is stopped before anything it uses is destroyed
+		std::jthread thread;
+
+		Root(FolderSweepers& owner, const std::filesystem::path& folder, size_t walkThreads, size_t totalRound) : folders{folder},
+			sweeper{folders,
+				[&owner](auto& path) { owner.record(Change::Type::created, path); },
+				[&owner](auto& path) { owner.record(Change::Type::modified, path); },
+				[&owner](auto& path) { owner.record(Change::Type::deleted, path); },
+				[&owner](auto& path) { owner.record(Change::Type::fastTracked, path); },
+				[&owner](auto& path) { owner.record(Change::Type::unFastTracked, path); }}, owner(owner) {
+			sweeper.walkThreads = walkThreads;
+			// The folder's first sweep is a total sweep (finding everything that changed while we weren't running or weren't managing it)
+			request.pending = request.total = true;
+			request.totalRound = totalRound;
+			request.requested = Clock::now();
+			thread = std::jthread([this](std::stop_token stop) { threadFunction(stop); });
+		}
+
+		// Function which checks if a path is inside of the folder
+		bool contains(const std::filesystem::path& path) const {
+			auto& folder = folders.front().native();
+			auto& native = path.native();
+			return native.compare(0, folder.size(), folder) == 0
+				&& (native.size() == folder.size() || native[folder.size()] == std::filesystem::path::preferred_separator);
+		}
+
+		// Function run by the folder's thread, runs the requested sweeps
+		void threadFunction(std::stop_token stop) {
+			// Make sure we wake up if we are asked to stop while waiting for a request
+			std::stop_callback wake(stop, [this] {
+				{ std::scoped_lock lock(mutex); }
+				cv.notify_all();
+			});
+
+			// Load what we knew about the folder's files the last time we ran
+			sweeper.setup();
+
+			while(!stop.stop_requested()) {
+				Request next;
+				{
+					std::unique_lock lock(mutex);
+					cv.wait(lock, [&] { return stop.stop_requested() || request.pending; });
+					if(stop.stop_requested()) break;
+					std::swap(next, request);
+					busy = true;
+				}
+
+				auto start = Clock::now();
+				sweeper.sweepPaths(next.files);
+				for(auto& directory: next.directories)
+					sweeper.sweepDirectory(directory);
+				sweeper.sweep(next.total, next.lowPriority);
+				auto end = Clock::now();
+				// NOTE: Reported before the folder stops being busy, so the round has been recorded once waiting for the folders finishes
+				if(next.total) owner.totalSweepFinished(this, next.totalRound, end - start);
+
+				{
+					std::scoped_lock lock(mutex);
+					busy = false;
+					stats.lastSweep = end - start;
+					if(next.total) stats.lastTotalSweep = stats.lastSweep;
+					double latency = std::chrono::duration<double>(end - next.requested).count();
+					stats.averageLatency = stats.sweeps++ == 0 ? latency : stats.averageLatency * 0.7 + latency * 0.3;
+				}
+				cv.notify_all();
+			}
+		}
+	};
+
+	// The changes the sweepers have found which haven't been delivered yet
+	std::mutex changesMutex;
+	std::vector<Change> changes;
+	// The current round of total sweeps, the folders which haven't finished their total sweep in it yet, and how long the slowest finished one took
+	//	(and how long the slowest folder took in every round which has finished but hasn't been delivered yet), guarded by the changes mutex
+	size_t totalRound = 0;
+	std::set<const Root*> totalOwed;
+	Clock::duration slowestInRound{};
+	std::vector<Clock::duration> finishedTotals;
+	// The sweeper of every managed folder
+	// NOTE: Declared after the changes, so the threads (which record changes) are stopped first
+	std::vector<std::unique_ptr<Root>> roots;
+
+	// Function which adds a change to the stream (called from the folders' threads)
+	void record(Change::Type type, const std::filesystem::path& path) {
+		{
+			std::scoped_lock lock(changesMutex);
+			changes.push_back({type, path});
+		}
+		if(onChangeFound) onChangeFound();
+	}
+
+	// Function called (from a folder's thread) when a folder finishes a total sweep requested in <round>, once every folder has finished
+	//	the round is delivered by drain (total sweeps from earlier rounds were superseded, so they aren't counted)
+	void totalSweepFinished(const Root* root, size_t round, Clock::duration duration) {
+		{
+			std::scoped_lock lock(changesMutex);
+			if(round != totalRound || !totalOwed.erase(root)) return;
+			slowestInRound = std::max(slowestInRound, duration);
+			if(!totalOwed.empty()) return;
+			finishedTotals.push_back(slowestInRound);
+		}
+		if(onChangeFound) onChangeFound();
+	}
+
+	// Function which stops waiting for a folder which is no longer managed to finish its total sweep
+	void forgetTotalSweep(const Root* root) {
+		std::scoped_lock lock(changesMutex);
+		if(totalOwed.erase(root) && totalOwed.empty() && slowestInRound > Clock::duration::zero())
+			finishedTotals.push_back(slowestInRound);
+	}
+};
+
+#endif // __FOLDER_SWEEPERS_HPP__
@@ -0,0 +1,494 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides the rules (read from .wntsignore files) deciding which files in the managed folders are ignored
+*/
+
+#ifndef __IGNORE_RULES_HPP__
+#define __IGNORE_RULES_HPP__
+
+#include <map>
+#include <array>
+#include <bitset>
+#include <memory>
+#include <fstream>
+#include <string_view>
+#include <atomic>
+#include <mutex>
+#include <cctype>
+#include <algorithm>
+
+#include "include_everywhere.hpp"
+#include "monitor.hpp"
+
+// Matcher which decides if a path (relative to a managed folder) is ignored, every rule is compiled into a single deterministic automaton so
+//	that checking a path only costs one table lookup per character (no matter how many rules there are)
+// Rules use the same glob syntax as .gitignore:
+//	* matches anything except /, ? matches any one character except /, [abc] [a-z] [!abc] match character classes, ** matches across directories
+//	a rule ending in / only matches directories, a rule containing a / (other than at the end) is anchored to the managed folder
+//	otherwise it matches at any depth, a rule starting with ! re-includes paths an earlier rule ignored, and the last matching rule wins
+// Paths are matched a component at a time (the state after a directory can be reused for everything inside of it), so ignored directories can be pruned during walks
+// NOTE: The ignore file is synced from other nodes, so the automaton is limited to maxStates states, if the rules need more than that
+//	each rule is given its own automaton instead (and every rule's automaton is run over each name, see Fallback)
+struct IgnoreMatcher {
+	// A state of the automaton, the dead state is reached once no rule can match anything further down the path
+	using State = uint32_t;
+	static constexpr State deadState = 0;
+	// The most states an automaton may have
+	static constexpr size_t maxStates = 4096;
+
+	// Rules which are always applied (after any rules in the .wntsignore file, so they can't be overridden)
+	static std::vector<std::string> builtinRules() { return {".wnts/"}; }
+
+	// Creates a matcher from the lines of a .wntsignore file
+	IgnoreMatcher(const std::vector<std::string>& lines) {
+		for(auto& line: lines)
+			parseRule(line);
+		for(auto& line: builtinRules())
+			parseRule(line);
+
+		// If the rules don't fit in a single automaton, give each rule its own
+		if(!compile({0}, automaton)) {
+			std::cerr << "wnts: The ignore rules are too complex to combine, matching them one at a time" << std::endl;
+			fallback = std::make_unique<Fallback>();
+			for(size_t rule = 0; rule < rules.size(); rule++) {
+				Automaton single;
+				if(compile({ruleStarts[rule]}, single))
+					fallback->automata.push_back(std::move(single));
+				else std::cerr << "wnts: Ignore rule " << rule + 1 << " is too complex, it will be skipped" << std::endl;
+			}
+			fallback->intern(fallback->deadStates());
+			fallback->start = fallback->intern(fallback->startStates());
+		}
+		nfa.clear(); // The nondeterministic automaton is no longer needed
+	}
+
+	// Function which gets the state of an empty path (the managed folder itself)
+	State start() const { return fallback ? fallback->start : automaton.start; }
+
+	// Function which advances the automaton over the name of a file or directory, returning the new state
+	//	<ignored> is set to true if the file or directory is ignored
+	// NOTE: For directories the returned state is the state after the trailing / (ready for the names of the directory's children)
+	State enter(State state, std::string_view name, bool directory, bool& ignored) const {
+		if(state == deadState) {
+			ignored = false;
+			return deadState;
+		}
+		if(fallback) return fallback->enter(state, name, directory, ignored, rules);
+
+		for(char c: name)
+			state = automaton.next(state, c);
+		ignored = isIgnored(automaton.decide(state, directory));
+		return directory ? automaton.next(state, '/') : state;
+	}
+
+	// Function which checks if a path (relative to the managed folder) is ignored (a path inside of an ignored directory is also ignored)
+	bool isIgnored(const std::filesystem::path& relative, bool directory) const {
+		State state = start();
+		bool ignored = false;
+		for(auto i = relative.begin(); i != relative.end(); ) {
+			auto name = (i++)->string();
+			state = enter(state, name, i != relative.end() || directory, ignored);
+			if(ignored) return true;
+		}
+		return false;
+	}
+
+	// Function which gets the number of states in the automaton (or in every rule's automaton)
+	size_t stateCount() const {
+		if(!fallback) return automaton.fileDecision.size();
+		size_t count = 0;
+		for(auto& single: fallback->automata)
+			count += single.fileDecision.size();
+		return count;
+	}
+
+protected:
+	// A rule from the ignore file
+	struct Rule {
+		bool negated, directoryOnly;
+	};
+	std::vector<Rule> rules;
+	// The state of the nondeterministic automaton each rule starts from
+	std::vector<uint32_t> ruleStarts;
+
+	// The nondeterministic automaton the rules are first built into
+	struct NFAState {
+		// Transitions consuming a character in the set, and transitions which don't consume anything
+		std::vector<std::pair<std::bitset<256>, uint32_t>> edges;
+		std::vector<uint32_t> epsilons;
+		// The rule which matches when a path ends in this state (-1 if none)
+		int rule = -1;
+	};
+	std::vector<NFAState> nfa = {NFAState{}}; // State 0 is the start state
+
+	// A compiled automaton, characters are mapped to classes (characters which every rule treats the same way) to keep the table small
+	struct Automaton {
+		std::array<uint16_t, 256> characterClass;
+		size_t classCount = 0;
+		std::vector<State> transitions; // transitions[state * classCount + class]
+		// The rule that decides if a file, or directory, ending in each state is ignored (-1 if no rule matches)
+		std::vector<int> fileDecision, directoryDecision;
+		State start = deadState;
+
+		State next(State state, char c) const { return transitions[state * classCount + characterClass[(unsigned char) c]]; }
+		int decide(State state, bool directory) const { return directory ? directoryDecision[state] : fileDecision[state]; }
+	};
+	Automaton automaton;
+
+	// When the rules don't fit in a single automaton, each rule has its own and a state is the combination of every rule's state
+	//	Combined states are numbered as they are first reached (0 is dead), which needs a lock since walks enter names from many threads
+	// NOTE: Only the states after directories are numbered (the state after a file is never used), so there are at most as many as there are distinct directories
+	struct Fallback {
+		std::vector<Automaton> automata;
+		std::mutex mutex;
+		std::vector<std::vector<State>> combined;
+		std::map<std::vector<State>, State> numbers;
+		State start = deadState;
+
+		std::vector<State> deadStates() const { return std::vector<State>(automata.size(), deadState); }
+		std::vector<State> startStates() const {
+			std::vector<State> out;
+			for(auto& single: automata) out.push_back(single.start);
+			return out;
+		}
+
+		// Function which gets the number of a combined state (numbering it if it is new)
+		State intern(std::vector<State>&& states) {
+			auto [i, added] = numbers.try_emplace(states, combined.size());
+			if(added) combined.emplace_back(std::move(states));
+			return i->second;
+		}
+
+		State enter(State state, std::string_view name, bool directory, bool& ignored, const std::vector<Rule>& rules) {
+			std::vector<State> states;
+			{
+				std::scoped_lock lock(mutex);
+				states = combined[state];
+			}
+
+			// The last rule that matches (in any of the automata) decides
+			int rule = -1;
+			bool alive = false;
+			for(size_t i = 0; i < automata.size(); i++) {
+				auto& s = states[i];
+				for(char c: name)
+					s = automata[i].next(s, c);
+				rule = std::max(rule, automata[i].decide(s, directory));
+				if(directory) s = automata[i].next(s, '/');
+				alive |= s != deadState;
+			}
+			ignored = rule >= 0 && !rules[rule].negated;
+			if(!directory || !alive) return deadState;
+
+			std::scoped_lock lock(mutex);
+			return intern(std::move(states));
+		}
+	};
+	// NOTE: Held by pointer so the matcher stays movable (and the fallback can lock from const functions)
+	std::unique_ptr<Fallback> fallback;
+
+	bool isIgnored(int rule) const { return rule >= 0 && !rules[rule].negated; }
+
+	uint32_t addState() {
+		nfa.emplace_back();
+		return nfa.size() - 1;
+	}
+
+	// Function which parses a line of the ignore file into a rule, and adds the rule to the nondeterministic automaton
+	void parseRule(std::string pattern) {
+		// Skip blank lines and comments, and trim trailing whitespace (and carriage returns)
+		while(!pattern.empty() && std::isspace((unsigned char) pattern.back()) && !(pattern.size() > 1 && pattern[pattern.size() - 2] == '\\'))
+			pattern.pop_back();
+		if(pattern.empty() || pattern[0] == '#') return;
+
+		Rule rule{false, false};
+		if(pattern[0] == '!') {
+			rule.negated = true;
+			pattern.erase(0, 1);
+		}
+		if(!pattern.empty() && pattern.back() == '/') {
+			rule.directoryOnly = true;
+			pattern.pop_back();
+		}
+		if(pattern.empty()) return;
+
+		// Rules without a / match at any depth, rules with one are relative to the managed folder
+		if(pattern.find('/') == std::string::npos)
+			pattern = "**/" + pattern;
+		else if(pattern[0] == '/')
+			pattern.erase(0, 1);
+
+		std::bitset<256> any, notSlash;
+		any.set();
+		notSlash.set();
+		notSlash.reset('/');
+
+		// Lambda which adds a state which loops on a set of characters
+		auto addLoop = [this](uint32_t from, const std::bitset<256>& set) {
+			uint32_t loop = addState();
+			nfa[from].epsilons.push_back(loop);
+			nfa[loop].edges.emplace_back(set, loop);
+			return loop;
+		};
+
+		uint32_t current = addState();
+		nfa[0].epsilons.push_back(current);
+		ruleStarts.push_back(current);
+		for(size_t i = 0; i < pattern.size(); ) {
+			bool atComponentStart = i == 0 || pattern[i - 1] == '/';
+			// **/ matches zero or more directories
+			if(atComponentStart && pattern.compare(i, 3, "**/") == 0) {
+				uint32_t inside = addState(), after = addState();
+				nfa[current].epsilons.push_back(after);
+				nfa[current].edges.emplace_back(any, inside);
+				nfa[inside].edges.emplace_back(any, inside);
+				std::bitset<256> slash;
+				slash.set('/');
+				nfa[inside].edges.emplace_back(slash, after);
+				current = after;
+				i += 3;
+			// ** matches anything (including /)
+			} else if(pattern.compare(i, 2, "**") == 0) {
+				current = addLoop(current, any);
+				i += 2;
+			// * matches anything but /
+			} else if(pattern[i] == '*') {
+				current = addLoop(current, notSlash);
+				i++;
+			// Everything else matches a single character
+			} else {
+				std::bitset<256> set;
+				if(pattern[i] == '?') {
+					set = notSlash;
+					i++;
+				} else if(pattern[i] == '[' && pattern.find(']', i + 2) != std::string::npos) {
+					size_t end = pattern.find(']', i + 2);
+					size_t j = i + 1;
+					bool invert = pattern[j] == '!' || pattern[j] == '^';
+					if(invert) j++;
+					for(; j < end; j++)
+						if(j + 2 < end && pattern[j + 1] == '-') {
+							for(int c = (unsigned char) pattern[j]; c <= (unsigned char) pattern[j + 2]; c++)
+								set.set(c);
+							j += 2;
+						} else set.set((unsigned char) pattern[j]);
+					if(invert) set.flip();
+					set.reset('/');
+					i = end + 1;
+				} else {
+					if(pattern[i] == '\\' && i + 1 < pattern.size()) i++;
+					set.set((unsigned char) pattern[i]);
+					i++;
+				}
+
+				uint32_t next = addState();
+				nfa[current].edges.emplace_back(set, next);
+				current = next;
+			}
+		}
+
+		nfa[current].rule = rules.size();
+		rules.push_back(rule);
+	}
+
+	// Function which adds every state reachable without consuming a character to a (sorted) set of states
+	void closure(std::vector<uint32_t>& states) const {
+		std::vector<uint32_t> stack = states;
+		std::vector<bool> seen(nfa.size());
+		for(auto s: states) seen[s] = true;
+		while(!stack.empty()) {
+			auto s = stack.back();
+			stack.pop_back();
+			for(auto e: nfa[s].epsilons)
+				if(!seen[e]) {
+					seen[e] = true;
+					states.push_back(e);
+					stack.push_back(e);
+				}
+		}
+		std::sort(states.begin(), states.end());
+	}
+
+	// Function which converts the part of the nondeterministic automaton reachable from <starts> into a deterministic one (subset construction)
+	//	Returns false if the automaton would need more than maxStates states
+	bool compile(std::vector<uint32_t> starts, Automaton& out) const {
+		closure(starts);
+
+		// Find the states that can be reached
+		std::vector<bool> reachable(nfa.size());
+		std::vector<uint32_t> stack = starts;
+		for(auto s: starts) reachable[s] = true;
+		while(!stack.empty()) {
+			auto s = stack.back();
+			stack.pop_back();
+			for(auto& [_, target]: nfa[s].edges)
+				if(!reachable[target]) {
+					reachable[target] = true;
+					stack.push_back(target);
+				}
+			for(auto e: nfa[s].epsilons)
+				if(!reachable[e]) {
+					reachable[e] = true;
+					stack.push_back(e);
+				}
+		}
+
+		// Group characters which every reachable transition treats the same way into classes
+		std::map<std::vector<bool>, uint16_t> signatures;
+		std::vector<unsigned char> representatives;
+		for(int c = 0; c < 256; c++) {
+			std::vector<bool> signature;
+			for(size_t s = 0; s < nfa.size(); s++)
+				if(reachable[s])
+					for(auto& [set, _]: nfa[s].edges)
+						signature.push_back(set[c]);
+			auto [i, added] = signatures.try_emplace(signature, signatures.size());
+			if(added) representatives.push_back(c);
+			out.characterClass[c] = i->second;
+		}
+		out.classCount = representatives.size();
+
+		// Each deterministic state is a set of nondeterministic states (state 0 is the empty, dead, set)
+		std::map<std::vector<uint32_t>, State> states;
+		std::vector<std::vector<uint32_t>> sets = {{}};
+		states[{}] = deadState;
+		states[starts] = out.start = 1;
+		sets.push_back(starts);
+
+		for(State state = 0; state < sets.size(); state++) {
+			out.transitions.resize((state + 1) * out.classCount, deadState);
+			for(size_t cls = 0; cls < out.classCount; cls++) {
+				std::vector<uint32_t> next;
+				for(auto s: sets[state])
+					for(auto& [set, target]: nfa[s].edges)
+						if(set[representatives[cls]] && std::find(next.begin(), next.end(), target) == next.end())
+							next.push_back(target);
+				closure(next);
+
+				auto [i, added] = states.try_emplace(next, sets.size());
+				if(added) {
+					if(sets.size() >= maxStates) {
+						out = {};
+						return false;
+					}
+					sets.push_back(next);
+				}
+				out.transitions[state * out.classCount + cls] = i->second;
+			}
+
+			// The last rule that matches decides
+			int file = -1, directory = -1;
+			for(auto s: sets[state])
+				if(nfa[s].rule >= 0) {
+					directory = std::max(directory, nfa[s].rule);
+					if(!rules[nfa[s].rule].directoryOnly)
+						file = std::max(file, nfa[s].rule);
+				}
+			out.fileDecision.push_back(file);
+			out.directoryDecision.push_back(directory);
+		}
+		return true;
+	}
+};
+
+// Singleton which holds the compiled ignore rules of every managed folder (loaded from <folder>/.wntsignore when first needed)
+struct IgnoreRules {
+	// Name of the file the rules are read from
+	static constexpr const char* fileName = ".wntsignore";
+
+	// Where in the automaton a directory is (the matcher of the managed folder it is in, and the state after the directory's path)
+	struct Position {
+		std::shared_ptr<const IgnoreMatcher> matcher;
+		IgnoreMatcher::State state = IgnoreMatcher::deadState;
+	};
+
+	// Function which gets the IgnoreRules singleton
+	static IgnoreRules& singleton() {
+		static IgnoreRules instance;
+		return instance;
+	}
+
+	// Function which sets the list of managed folders (called again whenever they change)
+	// NOTE: The rules keep their own copy of the list, since they are used from every thread while the list may be changed by the main thread
+	void setup(const std::vector<std::filesystem::path>& folders) { *this->folders.write_lock() = folders; }
+
+	// Function which forgets every compiled matcher, they are recompiled from the .wntsignore files the next time they are needed
+	void invalidate() {
+		matchers.write_lock()->clear();
+		generation++;
+	}
+	// Function which gets a number that changes every time the rules are invalidated
+	size_t getGeneration() const { return generation; }
+
+	// Function which gets the matcher for a managed folder
+	std::shared_ptr<const IgnoreMatcher> matcherFor(const std::filesystem::path& folder) {
+		if(auto matchers = this->matchers.read_lock(); matchers->count(folder.native()))
+			return matchers->at(folder.native());
+
+		std::vector<std::string> lines;
+		std::ifstream fin(folder / fileName);
+		for(std::string line; std::getline(fin, line); )
+			lines.push_back(line);
+		auto matcher = std::make_shared<const IgnoreMatcher>(lines);
+		matchers.write_lock()->emplace(folder.native(), matcher);
+		return matcher;
+	}
+
+	// Function which finds where a directory is in the automaton of the managed folder containing it
+	//	Returns a position with no matcher if the directory is ignored
+	// NOTE: Directories outside of the managed folders only have the built in rules applied
+	Position positionOf(const std::filesystem::path& directory) {
+		auto [folder, relative] = split(directory);
+
+		Position position{folder.empty() ? builtinMatcher() : matcherFor(folder)};
+		position.state = position.matcher->start();
+		bool ignored = false;
+		for(auto& name: relative) {
+			position.state = position.matcher->enter(position.state, name.string(), /*directory*/ true, ignored);
+			if(ignored) return {};
+		}
+		return position;
+	}
+
+	// Function which checks if a path is ignored
+	bool isIgnored(const std::filesystem::path& path, bool directory = false) {
+		auto [folder, relative] = split(path);
+		return (folder.empty() ? builtinMatcher() : matcherFor(folder))->isIgnored(relative, directory);
+	}
+
+protected:
+	// The managed folders
+	monitor<std::vector<std::filesystem::path>> folders;
+	// The compiled matcher of each managed folder
+	monitor<std::map<std::string, std::shared_ptr<const IgnoreMatcher>>> matchers;
+	std::atomic<size_t> generation = 0;
+
+	// Only the singleton can be constructed
+	IgnoreRules() {}
+
+	// Function which gets a matcher which only applies the built in rules
+	static std::shared_ptr<const IgnoreMatcher> builtinMatcher() {
+		static auto matcher = std::make_shared<const IgnoreMatcher>(std::vector<std::string>{});
+		return matcher;
+	}
+
+	// Function which splits a path into the managed folder containing it and the rest of the path
+	//	(if the path isn't in a managed folder, the folder is empty and the rest of the path is the whole path)
+	std::pair<std::filesystem::path, std::filesystem::path> split(const std::filesystem::path& path) const {
+		auto folders = this->folders.read_lock();
+		for(auto& folder: *folders) {
+			auto [f, p] = std::mismatch(folder.begin(), folder.end(), path.begin(), path.end());
+			if(f != folder.end()) continue;
+
+			std::filesystem::path relative;
+			for(; p != path.end(); p++)
+				relative /= *p;
+			return {folder, relative};
+		}
+		return {{}, path};
+	}
+};
+
+#endif // __IGNORE_RULES_HPP__
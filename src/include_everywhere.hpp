@@ -51,28 +51,6 @@ inline std::filesystem::path wntsPath(const std::filesystem::path& path) {
 	return wntsPath;
 }
 
-// Function which fills an array with paths to all of the files we are responsible for sweaping.
-static void enumerateAllFiles(const std::vector<std::filesystem::path>& folders, std::vector<std::filesystem::path>& paths) {
-	// Recursively add all files in the managed folders
-	for(auto& path: folders)
-		for (std::filesystem::recursive_directory_iterator i(path), end; i != end; ++i)
-			if (!is_directory(i->path())) {
-				// Ignore any paths containing .wnts in their folder tree
-				bool good = true;
-				for(auto folder: i->path())
-					if(folder.string() == ".wnts") {
-						good = false;
-						break;
-					}
-				if(good) paths.push_back(i->path());
-			}
-}
-inline std::vector<std::filesystem::path> enumerateAllFiles(const std::vector<std::filesystem::path>& folders) {
-	std::vector<std::filesystem::path> paths;
-	enumerateAllFiles(folders, paths);
-	return paths;
-}
-
 // Function that converts a string into a size_t
 inline size_t hash(std::string str) {
 	size_t hash = 0;
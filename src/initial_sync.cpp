@@ -0,0 +1,149 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	Implementation for initial_sync.hpp, provides the functions that run in the initial sync worker threads
+*/
+#include "initial_sync.hpp"
+#include "peer_manager.hpp"
+#include "message_manager.hpp"
+#include "sparse_file.hpp"
+
+#include <fstream>
+
+// Function that waits until <bytes> bytes are available in the in flight window and claims them
+//	(returns false if the job was stopped while waiting)
+bool InitialSyncJob::acquireWindow(size_t bytes, std::stop_token& stop) {
+	// Since sending only queues data with our peers, wait for the data already queued to drain below the window
+	if(!PeerManager::singleton().waitForPendingBelow(windowBytes, stop)) return false;
+
+	std::unique_lock lock(windowMutex);
+	// A file larger than the whole window is allowed through once nothing else is in flight
+	windowCV.wait(lock, [&] {
+		return stop.stop_requested() || inFlightBytes == 0 || inFlightBytes + bytes <= windowBytes;
+	});
+	if(stop.stop_requested()) return false;
+
+	inFlightBytes += bytes;
+	return true;
+}
+
+// Function that returns <bytes> bytes to the in flight window
+void InitialSyncJob::releaseWindow(size_t bytes) {
+	{
+		std::scoped_lock lock(windowMutex);
+		inFlightBytes -= bytes;
+	}
+	windowCV.notify_all();
+}
+
+// Function that sends a lock message for the file (if it is locked)
+void InitialSyncJob::sendLockIfLocked(const std::filesystem::path& path) {
+	if(exists(lockFilePath(path))) {
+		auto [lock, _] = loadLockFile(path);
+		lock.timestamp = std::chrono::system_clock::now();
+		PeerManager::singleton().send(lock, destination);
+	}
+}
+
+// Function run by each of the job's worker threads
+void InitialSyncJob::workerFunction(std::stop_token stop) {
+	// Pack that small files are gathered into before being sent
+	FilePackMessage pack;
+	pack.type = Message::Type::initialSyncPack;
+	pack.total = files.size();
+
+	// Lambda which sends the pack (if there is anything in it) and then empties it
+	auto flushPack = [&] {
+		if(pack.files.empty()) return;
+
+		PeerManager::singleton().send(pack, destination);
+		releaseWindow(pack.content.size());
+		for(auto& entry: pack.files)
+			sendLockIfLocked(entry.targetFile);
+
+		pack.files.clear();
+		pack.content.clear();
+	};
+
+	// Claim files until there are none left (or we are asked to stop)
+	for(size_t i = nextIndex++, size = files.size(); i < size && !stop.stop_requested(); i = nextIndex++) {
+		auto& [path, startOffset, receivedVersion] = files[i];
+
+		// Determine how large the file is (if it has been removed since we enumerated it, send it as empty so the total still lines up)
+		std::error_code ec;
+		size_t fileSize = std::filesystem::file_size(path, ec);
+		if(ec) fileSize = 0;
+		// If the file has changed since the receiver started receiving it (or shrunk past the point the receiver has), the receiver needs the whole file again
+		size_t version = fileVersion(path);
+		size_t offset = startOffset <= fileSize && receivedVersion == version ? startOffset : 0;
+
+		// Yield to locks, connects, and other higher priority traffic waiting to be processed
+		while(MessageManager::singleton().hasPendingControlMessages() && !stop.stop_requested())
+			std::this_thread::sleep_for(10ms);
+
+		// Small files are packed together rather than being sent in their own messages
+		if(offset == 0 && fileSize <= FilePackMessage::maxFileSize) {
+			if(!pack.fits(fileSize))
+				flushPack();
+			if(!acquireWindow(fileSize, stop))
+				break;
+
+			std::string content(fileSize, '\0');
+			std::ifstream fin(path, std::ios::binary);
+			fin.read(&content[0], fileSize);
+			content.resize(fin.gcount());
+			pack.add(path, std::chrono::system_clock::now(), content);
+			// If the file shrunk while we were reading it, return the part of the window the pack won't use
+			if(content.size() < fileSize)
+				releaseWindow(fileSize - content.size());
+			continue;
+		}
+
+		// Send the file one chunk at a time (every chunk carries the hash of the whole file, so the receiver can check the chunks add up to it)
+		size_t fileHash = hashFileContent(path);
+		do {
+			FileInitialSyncMessage sync;
+			sync.type = Message::Type::initialSync;
+			sync.targetFile = path;
+			sync.timestamp = std::chrono::system_clock::now();
+			sync.index = i;
+			sync.total = size;
+			sync.offset = offset;
+			sync.fileSize = fileSize;
+			sync.sourceVersion = version;
+			sync.fileHash = fileHash;
+
+			// Make sure there is room in the window for the chunk before reading it
+			size_t chunk = std::min(chunkSize, fileSize - offset);
+			if(!acquireWindow(chunk, stop))
+				break;
+
+			// Read the chunk (only reading the parts which contain data if the file is sparse)
+			// NOTE: If the file can't be read any more the chunk is still sent (as a hole) so the receiver's count lines up,
+			//	the receiver then discards the file since its content won't match the file's hash
+			if(!readSparseRange(path, offset, offset + chunk, sync.fileContent, sync.extents))
+				sync.extents = {{offset + chunk, 0}};
+			sync.length = chunk;
+
+			PeerManager::singleton().send(sync, destination);
+			releaseWindow(chunk);
+			offset += chunk;
+
+			// Yield between chunks of large files as well
+			while(MessageManager::singleton().hasPendingControlMessages() && !stop.stop_requested())
+				std::this_thread::sleep_for(10ms);
+		} while(offset < fileSize && !stop.stop_requested());
+		if(stop.stop_requested())
+			break;
+
+		// If the file is locked also send a lock message
+		sendLockIfLocked(path);
+	}
+
+	// Send any small files which are still waiting in the pack
+	if(!stop.stop_requested())
+		flushPack();
+
+	finishedWorkers++;
+}
@@ -0,0 +1,94 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a background job which streams the content of every managed file to a newly connected node
+*/
+
+#ifndef __INITIAL_SYNC_HPP__
+#define __INITIAL_SYNC_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <jthread.hpp>
+
+#include "networking_include_everywhere.hpp"
+
+// Job which sends every managed file to a newly connected node without blocking the message processing thread
+// Files are read, serialized, and sent by a pool of workers (so the three stages overlap across files),
+//	the total number of bytes that have been read but not yet sent is bounded by a window
+// Small files are bundled together into packs, to avoid paying the per message overhead for every file
+// Large files are sent in chunks, so that a node which loses its connection part way through a large file can resume from where it left off
+struct InitialSyncJob {
+	// Default maximum number of bytes which may be read but not yet sent at the same time (64MB)
+	static constexpr size_t defaultWindowBytes = 64 * 1024 * 1024;
+	// Maximum number of bytes of a file sent in a single message (4MB)
+	static constexpr size_t chunkSize = 4 * 1024 * 1024;
+
+	// A file that needs to be sent, the offset the receiving node already has data up to, and the version of the file that data came from
+	struct File {
+		std::filesystem::path path;
+		size_t offset = 0, sourceVersion = 0;
+	};
+
+	// Function that determines how many workers a job should use by default (upto 4, depending on the hardware)
+	static size_t defaultWorkerCount() {
+		return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4);
+	}
+
+	// Creates a job sending every file in <files> to <destination>, the workers start immediately
+	InitialSyncJob(std::vector<File>&& files, zt::IpAddress destination, size_t workerCount = defaultWorkerCount(), size_t windowBytes = defaultWindowBytes)
+		: files(std::move(files)), destination(destination), windowBytes(windowBytes) {
+		for(size_t i = 0; i < workerCount; i++)
+			workers.emplace_back([this](std::stop_token stop){ this->workerFunction(stop); });
+	}
+	// Stop the workers when the job is destroyed (the jthreads join themselves)
+	~InitialSyncJob() { stop(); }
+
+	// Function which requests that every worker stop sending files
+	void stop() {
+		for(auto& worker: workers)
+			worker.request_stop();
+		// Take the window mutex so that a worker can't miss the notification between checking and waiting
+		{ std::scoped_lock lock(windowMutex); }
+		windowCV.notify_all();
+	}
+
+	// Function which checks if every worker has finished sending its files
+	bool isFinished() const { return finishedWorkers == workers.size(); }
+	// Function which gets the node this job is sending files to
+	const zt::IpAddress& getDestination() const { return destination; }
+
+protected:
+	// The files this job needs to send
+	const std::vector<File> files;
+	// The node the files are being sent to
+	const zt::IpAddress destination;
+
+	// Index of the next file a worker should claim
+	std::atomic<size_t> nextIndex = 0;
+	// Number of workers which have run out of files to send
+	std::atomic<size_t> finishedWorkers = 0;
+
+	// Maximum number of bytes which may be in flight, and the number currently in flight (guarded by the window mutex)
+	const size_t windowBytes;
+	size_t inFlightBytes = 0;
+	std::mutex windowMutex;
+	std::condition_variable windowCV;
+
+	// Threads that read, serialize, and send files
+	std::vector<std::jthread> workers;
+
+	// Function run by each of the job's worker threads
+	void workerFunction(std::stop_token stop);
+	// Function that sends a lock message for the file (if it is locked)
+	void sendLockIfLocked(const std::filesystem::path& path);
+
+	// Functions which claim and release space in the in flight window
+	bool acquireWindow(size_t bytes, std::stop_token& stop);
+	void releaseWindow(size_t bytes);
+};
+
+#endif // __INITIAL_SYNC_HPP__
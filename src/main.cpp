@@ -8,7 +8,13 @@
 #include "ztnode.hpp"
 #include "peer_manager.hpp"
 #include "message_manager.hpp"
-#include "file_sweep.hpp"
+#include "folder_sweepers.hpp"
+#include "file_watcher.hpp"
+#include "change_coalescer.hpp"
+#include "sweep_scheduler.hpp"
+#include "ignore_rules.hpp"
+#include "sparse_file.hpp"
+#include "bounded_queue.hpp"
 #include <csignal>
 #include <Argos/Argos.hpp>
 #include <boost/algorithm/string.hpp>
@@ -22,27 +28,106 @@ void signalCallbackHandler(int signum) {
 }
 
 
-// Callback called whenever a file is created or modified
-void onFileCreatedOrModified(const std::filesystem::path& path) {
+// Pack that small changed files are gathered into before being broadcast
+FilePackMessage pendingPack;
+// Locks waiting to be broadcast after the pack (so they don't overtake the content of the files they lock)
+// NOTE: The lock of a file whose content has never been propagated is held back until its content has been (the other nodes don't have
+//	the file yet, so they would drop the lock), the file's saved hash is written once its content has been propagated
+std::vector<FileMessage> pendingLocks;
+// Files which have changed, but are held back until they stop being modified
+ChangeCoalescer coalescer;
+// Scheduler which decides how often to sweep based on how often files are changing
+SweepScheduler scheduler;
+// Whether or not an ignore file has changed since the last total sweep
+bool ignoreRulesChanged = false;
+
+// The program runs as a pipeline of stages, each on its own thread(s):
+//	- Detection: the folders' sweepers find changes, and the detection thread reads the changed files and turns them into messages
+//	- Processing: the main thread (and the file workers) apply the messages we receive
+//	- Sending: the send thread serializes our messages and hands them to the peers (whose own threads write them to the network)
+// so a slow sweep, or reading a large file, never holds up applying the messages (such as locks) we receive
+
+// Limits on the messages waiting to be sent, once they are reached the detection thread waits (it stops reading files) until there is room
+constexpr size_t maxOutgoingMessages = 1024, maxOutgoingBytes = 64 * 1024 * 1024;
+// Limit on the data queued with our peers, once it is reached the send thread waits for the network to catch up
+constexpr size_t sendWindowBytes = 64 * 1024 * 1024;
+// How long we wait, when exiting, for the messages still waiting to be sent (such as unlocks) to be handed to our peers
+constexpr auto exitDrainTimeout = 5s;
+
+// Messages waiting to be broadcast by the send thread (in the order they were produced)
+BoundedQueue<AnyMessage> outgoing{maxOutgoingMessages, maxOutgoingBytes};
+// How long each pass of the detection thread, and each message the send thread sends, takes
+StageStats detectionStats, sendStats;
+// Used to wake the detection thread when the sweepers find changes
+std::mutex detectionMutex;
+std::condition_variable detectionCV;
+bool changesFound = false;
+// The detection and send threads
+std::jthread detectionThread, sendThread;
+// The sweepers of the managed folders (each swept on its own thread), and the watcher which tells them which files have changed
+// NOTE: Owned here (rather than by main) so that stopPipeline can stop them before the singletons they use are destroyed
+std::unique_ptr<FolderSweepers> sweepers;
+std::unique_ptr<FilesystemWatcher> watcher;
+
+// Function that hands a message to the send thread to be broadcast (waiting if too many messages are already waiting)
+void broadcast(AnyMessage m) {
+	auto bytes = m.contentSize();
+	outgoing.push(std::move(m), bytes);
+}
+
+// Function that broadcasts the pending pack of small files and then any pending locks (except the locks of files the network doesn't have yet)
+void flushPendingPack() {
+	if(!pendingPack.files.empty()) {
+		pendingPack.type = Message::Type::filePack;
+		broadcast(std::move(pendingPack));
+		pendingPack = {};
+	}
+
+	auto held = std::stable_partition(pendingLocks.begin(), pendingLocks.end(), [](const FileMessage& lock) {
+		std::error_code ec;
+		return !exists(wntsPath(lock.targetFile), ec);
+	});
+	for(auto lock = held; lock != pendingLocks.end(); lock++)
+		broadcast(std::move(*lock));
+	pendingLocks.erase(held, pendingLocks.end());
+}
+
+// Function that cancels a file's lock if it hasn't been broadcast yet, returns true if there was a lock to cancel
+bool cancelPendingLock(const std::filesystem::path& path) {
+	auto cancelled = std::find_if(pendingLocks.begin(), pendingLocks.end(), [&path](const FileMessage& lock) { return lock.targetFile == path; });
+	if(cancelled == pendingLocks.end()) return false;
+	pendingLocks.erase(cancelled);
+	return true;
+}
+
+// Function which reads a file whose changes have settled and propagates its content (if it has changed)
+void propagateFileContent(const std::filesystem::path& path) {
+	// NOTE: The file may have been deleted since it changed, in which case it is skipped (the next sweep reports the deletion)
+	std::error_code ec;
+	auto modified = last_write_time(path, ec);
+	if(ec) return;
+	size_t size = file_size(path, ec);
+	if(ec) return;
+
 	// Propagate the file's creation
 	FileContentMessage m;
 	m.type = Message::Type::contentChange;
 	m.targetFile = path;
-	m.timestamp = convertTimepoint<std::chrono::system_clock::time_point>(last_write_time(path));
+	m.timestamp = convertTimepoint<std::chrono::system_clock::time_point>(modified);
 
-	// Read the entire content of the file
-	std::ifstream fin(path, std::ios::binary);
-	fin.seekg(0, std::ios::end);
-	size_t size = fin.tellg();
-	fin.seekg(0, std::ios::beg);
-	m.fileContent.resize(size);
-	fin.read(&m.fileContent[0], size);
-	fin.close();
+	// Read the entire content of the file (skipping over any holes if the file is sparse)
+	// NOTE: If the file can't be read, nothing is sent and its saved hash is left alone (so the change is picked up once it can be read)
+	if(!readSparseRange(path, 0, size, m.fileContent, m.extents)) {
+		std::cerr << "Failed to read " << path << ", not propagating its changes" << std::endl;
+		return;
+	}
+	m.fileSize = size;
 
 	// Determine if we should notify the network of this change (file creation or file contents change)
+	// NOTE: Holes only contain zeros, so hashing just the data gives the same hash as hashing the whole file
 	auto wnts = wntsPath(m.targetFile);
 	size_t hash = ::hash(m.fileContent);
-	bool shouldSend = !exists(wnts);
+	bool shouldSend = !exists(wnts, ec);
 	if(!shouldSend) {
 		size_t oldHash;
 		std::ifstream fin(wnts);
@@ -53,40 +138,215 @@ void onFileCreatedOrModified(const std::filesystem::path& path) {
 
 	// Broadcast the message and update the saved hash if it was determined that we should send this message
 	if(shouldSend) {
-		PeerManager::singleton().send(m); // Broadcast the message
+		// Small (non-sparse) files are gathered into a pack (sent once the sweep finishes), larger files are broadcast on their own
+		if(size <= FilePackMessage::maxFileSize && m.extents.empty() && m.fileContent.size() == size) {
+			if(!pendingPack.fits(size))
+				flushPendingPack();
+			pendingPack.add(m.targetFile, m.timestamp, m.fileContent);
+		} else
+			broadcast(std::move(m));
+
 		std::ofstream fout(wnts);
 		fout << hash;
 	}
 }
 
+// Function which checks if a changed file is an ignore file, and if so makes sure its new rules are applied
+//	(everything is rechecked by a total sweep, so files which are no longer ignored are found and files which are now ignored stop being tracked)
+void checkIgnoreFile(const std::filesystem::path& path) {
+	if(path.filename() != IgnoreRules::fileName) return;
+	IgnoreRules::singleton().invalidate();
+	ignoreRulesChanged = true;
+}
+
+// Callback called whenever a file is created or modified
+void onFileCreatedOrModified(const std::filesystem::path& path) {
+	checkIgnoreFile(path);
+	// Wait for the file to stop changing before reading and propagating it
+	coalescer.changed(path);
+	scheduler.recordChange(path);
+}
+
 // Callback called whenever a file is deleted
 void onFileDeleted(const std::filesystem::path& path) {
+	checkIgnoreFile(path);
+	// Any content (or lock) still waiting to be propagated is no longer needed, and any pending content for other files is sent before the deletion
+	coalescer.cancel(path);
+	cancelPendingLock(path);
+	scheduler.recordChange(path);
+	flushPendingPack();
+
 	// Propagate the file's deletion
 	FileMessage m;
 	m.type = Message::Type::deleteFile;
 	m.targetFile = path;
 	m.timestamp = std::chrono::system_clock::now();
-	PeerManager::singleton().send(m); // Broadcast the message
+	broadcast(std::move(m));
 }
 
 // Callback called whenever a file is fast-tracked
 void onFileFastTracked(const std::filesystem::path& path) {
+	// If the file has already been deleted there is nothing to lock (the next sweep reports the deletion)
+	std::error_code ec;
+	auto modified = last_write_time(path, ec);
+	if(ec) return;
+
 	// Propagate a lock through the network
 	FileMessage m;
 	m.type = Message::Type::lock;
 	m.targetFile = path;
-	m.timestamp = convertTimepoint<std::chrono::system_clock::time_point>(last_write_time(path));
-	PeerManager::singleton().send(m); // Broadcast the message
+	m.timestamp = convertTimepoint<std::chrono::system_clock::time_point>(modified);
+	pendingLocks.push_back(m); // Broadcast the message (once any pending content has been sent)
 }
 
 // Callback called whenever a file is unfast-tracked
 void onFileUnFastTracked(const std::filesystem::path& path) {
+	// Make sure the file's final content goes out before it is unlocked
+	coalescer.flush(path, propagateFileContent);
+	// If the file's lock hasn't been broadcast yet, it is cancelled instead (so the network never sees the lock, or an unlock without a lock)
+	if(cancelPendingLock(path)) {
+		flushPendingPack();
+		return;
+	}
+	// Otherwise the pending content (and locks) go out before the unlock
+	flushPendingPack();
+
 	// Propagate an unlock through the network
+	// NOTE: The lock has already gone out, so the unlock is sent even if the file has since been deleted (otherwise the other nodes would
+	//	hold the lock forever)
+	std::error_code ec;
+	auto modified = last_write_time(path, ec);
 	FileMessage m;
 	m.type = Message::Type::unlock;
 	m.targetFile = path;
-	m.timestamp = convertTimepoint<std::chrono::system_clock::time_point>(last_write_time(path));
-	PeerManager::singleton().send(m); // Broadcast the message
+	m.timestamp = ec ? std::chrono::system_clock::now() : convertTimepoint<std::chrono::system_clock::time_point>(modified);
+	broadcast(std::move(m));
+}
+
+// Function that prints how every stage of the pipeline is performing
+void printPipelineStats(const SweepScheduler::Plan& plan) {
+	std::cout << "Change rate: " << scheduler.getChangeRate() << " changes/s, next fast sweep in " << scheduler.fastInterval().count()
+		<< "ms, next total sweep in " << scheduler.totalInterval().count() << "ms" << (plan.lowPriority ? " (disk busy, swept at idle priority)" : "") << std::endl;
+	for(auto& [folder, stats]: sweepers->stats())
+		std::cout << "\t" << folder << ": last sweep took " << std::chrono::duration<double, std::milli>(stats.lastSweep).count() << "ms, last total sweep took "
+			<< std::chrono::duration<double, std::milli>(stats.lastTotalSweep).count() << "ms, average latency " << stats.averageLatency * 1000 << "ms" << std::endl;
+	std::cout << "Detection: " << detectionStats.count << " passes, average " << detectionStats.average * 1000 << "ms, longest " << detectionStats.longest * 1000 << "ms" << std::endl;
+	std::cout << "Message queue:" << std::endl;
+	MessageManager::singleton().printQueueStats(std::cout);
+	auto queued = outgoing.getStats();
+	std::cout << "Sending: " << queued.waiting << " waiting (" << queued.waitingBytes << " bytes), " << sendStats.count << " sent (average " << sendStats.average * 1000
+		<< "ms, longest " << sendStats.longest * 1000 << "ms), average wait " << queued.averageWait * 1000 << "ms, longest wait " << queued.longestWait * 1000 << "ms, "
+		<< queued.blockedPushes << " times detection waited for room (" << queued.blockedTime * 1000 << "ms)" << std::endl;
+}
+
+// Function that waits until the sweepers find changes (returns true), or until <deadline> or the thread is asked to stop (returns false)
+bool waitForChanges(std::chrono::steady_clock::time_point deadline, std::stop_token& stop) {
+	std::unique_lock lock(detectionMutex);
+	detectionCV.wait_until(lock, deadline, [&stop] { return changesFound || stop.stop_requested(); });
+	bool found = changesFound && !stop.stop_requested();
+	changesFound = false;
+	return found;
+}
+
+// Function run by the detection thread, decides when and what to sweep, and propagates the changes the sweeps find
+void detectionThreadFunction(std::stop_token stop) {
+	// Make sure we wake up if we are asked to stop while waiting for changes
+	std::stop_callback wake(stop, [] {
+		{ std::scoped_lock lock(detectionMutex); }
+		detectionCV.notify_all();
+	});
+
+	while(!stop.stop_requested()) {
+		auto start = std::chrono::steady_clock::now();
+
+		// Decide what this sweep should do
+		// NOTE: The managed folders change on the main thread (once we connect to a network), so we work from a copy of them
+		auto folders = MessageManager::singleton().managedFolders();
+		watcher->update(folders); // Watch (and sweep) any folders we started managing since the last iteration
+		sweepers->update(folders);
+		// NOTE: While the watcher is reliable total sweeps are only a safety net, so they happen much less often
+		scheduler.baseTotalInterval = watcher->isWatching() ? 60s : 10s;
+		auto plan = scheduler.plan();
+
+		// If the watcher is reliable, only check what it reports changed
+		FilesystemWatcher::Changes changes;
+		if(watcher->isWatching()) {
+			changes = watcher->poll();
+			// NOTE: If events were dropped and we don't know which directories were active, fall back to a total sweep
+			if(changes.overflowed && changes.directories.empty())
+				plan.total = true;
+		// Otherwise rescan the directories which are being edited (so new files in them are found without waiting for a total sweep)
+		} else changes.directories = plan.hotDirectories;
+
+		// If the ignore rules changed, every file needs to be rechecked against them (after watching any directories which are no longer ignored)
+		if(ignoreRulesChanged) {
+			watcher->update(folders);
+			plan.total = true;
+			ignoreRulesChanged = false;
+		}
+
+		// The fast track still needs to be swept every iteration, so that files are unfast-tracked once they stop changing
+		// NOTE: The sweeps run on the folders' threads, any changes they find are delivered while we wait for the next sweep
+		sweepers->request(plan.total, plan.lowPriority, changes.files, changes.directories);
+		sweepers->drain();
+		scheduler.sweepFinished(plan);
+		if(useVerboseOutput && plan.total) printPipelineStats(plan);
+
+		// Propagate the changes which have settled, and send any small file changes they gathered
+		coalescer.release(propagateFileContent);
+		flushPendingPack();
+		detectionStats.record(std::chrono::steady_clock::now() - start);
+
+		// Deliver the changes the sweepers find (sending any locks they produced right away) until the next sweep is due
+		while(waitForChanges(scheduler.nextSweep(), stop)) {
+			auto drainStart = std::chrono::steady_clock::now();
+			if(sweepers->drain()) flushPendingPack();
+			detectionStats.record(std::chrono::steady_clock::now() - drainStart);
+		}
+	}
+}
+
+// Function run by the send thread, broadcasts the messages the detection thread produces (in order)
+void sendThreadFunction(std::stop_token stop) {
+	// Make sure we wake up if we are asked to stop while waiting for a message
+	std::stop_callback wake(stop, [] { outgoing.close(); });
+
+	AnyMessage m;
+	while(outgoing.pop(m)) {
+		// Since sending only queues data with our peers, wait for the data already queued to drain below the window
+		if(!PeerManager::singleton().waitForPendingBelow(sendWindowBytes, stop)) break;
+
+		auto start = std::chrono::steady_clock::now();
+		MessageManager::kindOf(m->type).send(std::move(m), zt::IpAddress::ipv6Unspecified()); // Broadcast the message
+		sendStats.record(std::chrono::steady_clock::now() - start);
+	}
+}
+
+// Function that stops the detection and send threads (called when the program exits, before the singletons they use are destroyed)
+//	The messages still waiting to be sent (such as unlocks) are sent first, unless that takes longer than the exit timeout
+void stopPipeline() {
+	// Lambda which joins a thread
+	// NOTE: The program may be exiting from one of the pipeline's threads (signals are delivered to any thread)
+	auto join = [](std::jthread& thread) {
+		if(thread.joinable() && thread.get_id() != std::this_thread::get_id())
+			thread.join();
+	};
+
+	// Stop the detection thread, anything it is still producing is sent (it stops waiting for room in the send queue once the deadline passes)
+	auto deadline = std::chrono::steady_clock::now() + exitDrainTimeout;
+	detectionThread.request_stop();
+	outgoing.setDeadline(deadline);
+	join(detectionThread);
+
+	// Stop the folders' threads
+	// NOTE: The watcher doesn't have a thread of its own, it is only used by the detection thread (and by main while starting up)
+	if(sweepers) sweepers->stop();
+
+	// Wait for the send thread to hand everything still waiting to our peers, then stop it
+	if(!outgoing.drain(deadline))
+		std::cerr << "Dropped " << outgoing.getStats().dropped << " messages which could not be sent before exiting" << std::endl;
+	sendThread.request_stop();
+	join(sendThread);
 }
 
 // Variable defining whether or not to print additional messages
@@ -105,6 +365,14 @@ int main(int argc, char** argv) {
             .help("IP address of a peer on the network we wish to join. (If not set, a new network is established)"))\
         .add(argos::Option{"-p", "--port"}.argument("PORT")\
             .help("Optional port number to connect to (default=" + std::to_string(defaultPort) + ")"))\
+		.add(argos::Option{"-q", "--quiescence"}.argument("MILLISECONDS")\
+			.help("How long a file must go without being modified before its changes are propagated (default=1000)"))\
+		.add(argos::Option{"-l", "--max-latency"}.argument("MILLISECONDS")\
+			.help("The longest a change to a file which is constantly being modified may be held back (default=5000)"))\
+		.add(argos::Option{"-m", "--memory-budget"}.argument("MEGABYTES")\
+			.help("How much memory the content of received messages waiting to be applied may take up before it is spilled to disk, reading new file content from the network pauses once 4 times this can't be spilled (default=256)"))\
+		.add(argos::Option{"-r", "--resend-cache"}.argument("MEGABYTES")\
+			.help("How much memory recently sent and received messages may take up, so they can be resent if they arrive corrupted (default=64)"))\
 		.add(argos::Option{"-v", "--verbose"}.argument("VERBOSE")\
 			.initial_value("false")\
             .help("Flag that enables some extra verbose output"))
@@ -112,6 +380,11 @@ int main(int argc, char** argv) {
 	uint16_t port = args.value("-p").as_uint(defaultPort);
 	auto remoteIP = zt::IpAddress::ipv6FromString(args.value("-c").as_string());
 	useVerboseOutput = args.value("-v").as_bool();
+	coalescer.quiescence = std::chrono::milliseconds(args.value("-q").as_uint(1000));
+	coalescer.maxLatency = std::chrono::milliseconds(args.value("-l").as_uint(5000));
+	MessageManager::singleton().memoryBudget = size_t(args.value("-m").as_uint(256)) * 1024 * 1024;
+	MessageManager::singleton().hardCap = 4 * MessageManager::singleton().memoryBudget;
+	MessageManager::singleton().retransmissionCache.setMaxBytes(size_t(args.value("-r").as_uint(64)) * 1024 * 1024);
 	std::vector<std::filesystem::path> folders; boost::split(folders, args.value("-f").as_string(), boost::is_any_of(","));
 
 	// If neither a list of folders nor remote IP are specified, error
@@ -148,9 +421,25 @@ int main(int argc, char** argv) {
 		PeerManager::singleton().setup(ZeroTierNode::singleton().getIP(), port);
 	});
 
-	// Create a filesystem sweeper that scan the folders from command line, and repoerts its results to the onFile* functions in this file
-	FilesystemSweeper sweeper{folders, onFileCreatedOrModified, onFileCreatedOrModified, onFileDeleted, onFileFastTracked, onFileUnFastTracked};
-	sweeper.setup();
+	// Link the managed folders to the ignore rules (so ignored files are never swept, watched, or propagated)
+	IgnoreRules::singleton().setup(folders);
+
+	// Create a filesystem sweeper for each of the folders (each swept on its own thread), which report their results to the onFile* functions in this file
+	// NOTE: Each sweeper loads the snapshot from our last run, so its first sweep only propagates what changed while we weren't running
+	sweepers = std::make_unique<FolderSweepers>(onFileCreatedOrModified, onFileCreatedOrModified, onFileDeleted, onFileFastTracked, onFileUnFastTracked);
+	// Wake the detection thread as soon as changes are found, instead of once the next sweep is due
+	sweepers->onChangeFound = [] {
+		{
+			std::scoped_lock lock(detectionMutex);
+			changesFound = true;
+		}
+		detectionCV.notify_one();
+	};
+	// The cost of total sweeps is measured (by how long the slowest folder took) once every folder has actually finished the sweep
+	// NOTE: Delivered by drain, so the scheduler is only used by the thread draining the sweepers
+	sweepers->onTotalSweepFinished = [](SweepScheduler::Clock::duration duration) { scheduler.totalSweepFinished(duration); };
+	// Create a watcher which tells us which files have changed (so the sweeper doesn't need to scan everything to find them)
+	watcher = std::make_unique<FilesystemWatcher>();
 
 	// Wait for the node setup to finish
 	networkSetupThread.join();
@@ -164,9 +453,9 @@ int main(int argc, char** argv) {
 	if(remoteIP.isValid()) {
 		try {
 			std::cout << "Attempting to connect to " << remoteIP << "..." << std::endl;
-			peers->emplace_back(std::move(Peer::connect(remoteIP, port)));
+			peers->emplace_back(Peer::connect(remoteIP, port));
 			PeerManager::singleton().setGatewayIP(remoteIP); // Mark the remote IP as our "gateway" to the rest of the network
-			volatile auto _ = peers->back().getSocket().getRemoteIpAddress(); // Call the code's bluff and make sure the connection is valid
+			volatile auto _ = peers->back()->getSocket().getRemoteIpAddress(); // Call the code's bluff and make sure the connection is valid
 			std::cout << "Connection successful!" << std::endl;
 		} catch (ZTError) {
 			std::cerr << "wnts: Failed to connect to " << remoteIP << std::endl;
@@ -180,19 +469,26 @@ int main(int argc, char** argv) {
 		MessageManager::singleton().totalInitialFiles = 0;
 
 
-	// Sweep for the first time then start the main loop
-	sweeper.sweep(/*total*/ true);
-	while(true) {
-		// Note the time this loop iteration starts
-		auto start = std::chrono::system_clock::now();
-
-		// Sweep the file system, with a total sweep every 10 iterations (10 seconds)
-		sweeper.totalSweepEveryN(10);
-
-		// Process messages until a second has elapsed since the start of the loop
-		while(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count() < 1000)
-			MessageManager::singleton().processNextMessage();
-	}
+	// Start the thread which sends our messages, and make sure the pipeline is stopped before the singletons it uses are destroyed
+	sendThread = std::jthread(sendThreadFunction);
+	// NOTE: Singletons are destroyed before any exit function registered before they were created, so the file index (which may not have been
+	//	used yet) is created first
+	FileIndex::singleton();
+	std::atexit(stopPipeline);
+
+	// Sweep for the first time (before processing any messages, so what we find isn't mixed up with what we receive)
+	watcher->update(folders); // Start watching before the first sweep, so that changes made during the sweep aren't missed
+	sweepers->update(folders); // Each folder's sweeper starts with a total sweep
+	sweepers->wait();
+	sweepers->drain();
+	scheduler.sweepFinished(SweepScheduler::Plan{/*total*/ true});
+	coalescer.release(propagateFileContent, /*all*/ true); // Files found on startup aren't being written, there is no reason to wait
+	flushPendingPack();
+
+	// Start detecting changes on the detection thread, while this thread processes the messages we receive
+	detectionThread = std::jthread(detectionThreadFunction);
+	while(true)
+		MessageManager::singleton().processNextMessage(1s);
 
 	signalCallbackHandler(0);
 }
\ No newline at end of file
@@ -7,31 +7,139 @@
 
 #include "peer_manager.hpp"
 #include "message_manager.hpp"
+#include "file_index.hpp"
+#include "sparse_file.hpp"
 
 #include <fstream>
+#include <iomanip>
 
-// Function that calculates the path to a file's lock file
-auto lockFilePath(const std::filesystem::path& p) {
-	auto lockPath = wntsPath(p);
-	return lockPath.remove_filename() / (".lock." + p.filename().string());
+// -- Message Registry --
+
+// Functions which write the details of a message worth logging (the file, or how many files, it is about)
+static void describe(std::ostream&, const Message&) {}
+static void describe(std::ostream& out, const FileMessage& m) { out << " " << m.targetFile; }
+static void describe(std::ostream& out, const FilePackMessage& m) { out << " " << m.files.size() << " files"; }
+
+// Function which deserializes a message stored as an <M>
+template<typename M>
+static AnyMessage decodeAs(cereal::BinaryInputArchive& ar) {
+	AnyMessage out;
+	ar(out.value.emplace<M>());
+	return out;
 }
 
-// Function that loads the data from a lock file
-auto loadLockFile(const std::filesystem::path& p) {
-	std::pair<FileMessage, std::filesystem::perms> out;
+// Function which hashes a message stored as an <M>
+template<typename M>
+static size_t hashAs(const AnyMessage& m) { return Message::hash(*std::get_if<M>(&m.value)); }
+
+// Function which logs a message stored as an <M>, and then processes it with <Process>
+template<typename M, bool (MessageManager::*Process)(const M&)>
+static bool processAs(MessageManager& manager, const AnyMessage& m) {
+	auto& message = *std::get_if<M>(&m.value);
+	auto& kind = MessageManager::kindOf(message.type);
+	if(kind.name && (useVerboseOutput || !kind.verbose)) {
+		std::cout << "[" << message.originatorNode << "] " << kind.name;
+		describe(std::cout, message);
+		std::cout << std::endl;
+	}
+	return (manager.*Process)(message);
+}
 
-	std::ifstream fin(lockFilePath(p), std::ios::binary);
-	cereal::BinaryInputArchive ar(fin);
-	ar (out.first, out.second);
-	fin.close();
+// Function which sends a message stored as an <M>
+template<typename M>
+static void sendAs(AnyMessage m, const zt::IpAddress& destination) { PeerManager::singleton().send(std::move(*std::get_if<M>(&m.value)), destination); }
+
+// Function which creates the registry entry for a type of message which is stored as an <M> and processed by <Process>
+template<typename M, bool (MessageManager::*Process)(const M&)>
+static MessageManager::MessageKind kind(MessageManager::MessageKind::Route route, size_t priority, size_t retryPriority, const char* name, bool verbose = false, uint8_t hashOffset = 0) {
+	MessageManager::MessageKind entry;
+	entry.route = route;
+	entry.priority = entry.sendPriority = priority;
+	entry.retryPriority = retryPriority;
+	entry.name = name;
+	entry.verbose = verbose;
+	entry.hashOffset = hashOffset;
+	entry.decode = &decodeAs<M>;
+	entry.hash = &hashAs<M>;
+	entry.process = &processAs<M, Process>;
+	entry.send = &sendAs<M>;
+	return entry;
+}
 
-	return out;
+// The registry of message types, adding a type of message only requires adding it here (and adding its class to AnyMessage if it has a new one)
+const std::array<MessageManager::MessageKind, 32> MessageManager::kinds = [] {
+	using Route = MessageKind::Route;
+	using M = MessageManager;
+	std::array<MessageKind, 32> kinds{};
+	//																										Route			Priority			Retry priority			Name					Verbose	Hash offset
+	kinds[Message::Type::payload] =				kind<PayloadMessage, &M::processPayloadMessage>(					Route::direct,	payloadPriority,	payloadPriority + 1,	nullptr); // Payloads log themselves
+	kinds[Message::Type::resendRequest] =		kind<ResendRequestMessage, &M::processResendRequestMessage>(		Route::direct,	resendPriority,		resendPriority + 1,		"resend request message", true);
+	kinds[Message::Type::lock] =				kind<FileMessage, &M::processLockMessage>(							Route::file,	lockPriority,		lockPriority + 1,		"lock",					false,	1);
+	kinds[Message::Type::unlock] =				kind<FileMessage, &M::processUnlockMessage>(						Route::file,	lockPriority,		lockPriority + 1,		"unlock",				false,	1);
+	kinds[Message::Type::deleteFile] =			kind<FileMessage, &M::processDeleteFileMessage>(					Route::file,	filePriority,		filePriority + 1,		"delete",				false,	1);
+	kinds[Message::Type::contentChange] =		kind<FileContentMessage, &M::processContentFileMessage>(			Route::file,	filePriority,		filePriority + 1,		"modify",				false,	1);
+	kinds[Message::Type::initialSync] =			kind<FileInitialSyncMessage, &M::processInitialFileSyncMessage>(	Route::file,	lockPriority,		lockPriority + 1,		"sync",					true,	1);
+	kinds[Message::Type::initialSyncRequest] =	kind<InitialSyncRequestMessage, &M::processInitialFileSyncRequestMessage>(Route::barrier, disconnectPriority, lockPriority + 1,	"sync request message",	true);
+	kinds[Message::Type::connect] =				kind<ConnectMessage, &M::processConnectMessage>(					Route::barrier,	connectPriority,	connectPriority + 1,	"connect message");
+	kinds[Message::Type::disconnect] =			kind<Message, &M::processDisconnectMessage>(						Route::barrier,	disconnectPriority,	disconnectPriority + 1,	"disconnect message");
+	kinds[Message::Type::linkLost] =			kind<Message, &M::processLinkLostMessage>(							Route::barrier,	disconnectPriority,	resendPriority + 1,		"link-lost message",	true);
+	kinds[Message::Type::filePack] =			kind<FilePackMessage, &M::processFilePackMessage>(					Route::pack,	filePriority,		filePriority + 1,		"modify");
+	kinds[Message::Type::initialSyncPack] =		kind<FilePackMessage, &M::processInitialSyncPackMessage>(			Route::pack,	lockPriority,		lockPriority + 1,		"sync",					true);
+
+	// Initial syncs are processed alongside locks, but they are bulk data, so on the wire they must not hold up locks
+	kinds[Message::Type::initialSync].sendPriority = kinds[Message::Type::initialSyncPack].sendPriority = filePriority;
+	// Link lost messages are only ever created by our own peers, and resend requests are never resent
+	kinds[Message::Type::linkLost].decode = nullptr;
+	kinds[Message::Type::resendRequest].send = nullptr;
+	return kinds;
+}();
+
+
+// Function that deserializes a message received from the network and adds it to the message queue
+void MessageManager::deserializeMessage(RetransmissionCache::Frame frame) {
+	// Extract the type of message
+	auto type = (Message::Type) uint8_t(frame->at(0));
+	auto& kind = kindOf(type);
+	if(!kind.decode) throw std::runtime_error("Unrecognized message type");
+	// Copy the data into a deserialization buffer
+	std::stringstream backing(*frame);
+	cereal::BinaryInputArchive ar(backing);
+
+	// Deserialize the message as the same type of message that was delivered, and (if it arrived intact) add it to the message queue
+	auto m = kind.decode(ar);
+	if(!validateMessageHash(*m, kind.hash(m) + kind.hashOffset))
+		return;
+	// Keep the frame around in case someone asks for it to be resent (resend requests themselves are never resent)
+	if(type != Message::Type::resendRequest)
+		retransmissionCache.insert(m->messageHash, std::move(frame));
+	enqueue(kind.priority, std::move(m));
 }
 
-// Validate the provided message, returns true if the hashes match, requests a resend and returns false otherwise
-bool MessageManager::validateMessageHash(const Message& m, uint8_t offset /*= 0*/) const {
-	if(useVerboseOutput) std::cout << m.messageHash << " - " << (m.hash() + offset) << std::endl;
-	if(m.messageHash != m.hash() + offset) {
+// Function that applies a message, releasing any messages it was holding up if it was successfully processed or parking it if it needs to be processed later
+void MessageManager::applyMessage(AnyMessage m) {
+	auto& kind = kindOf(m->type);
+	if(!kind.process) throw std::runtime_error("Unrecognized message type");
+	// Read the message's content back in if it was spilled to disk
+	if(!pageIn(m)) {
+		std::cerr << "Failed to read the spilled content of a message, dropping it" << std::endl;
+		discharge(m);
+		return;
+	}
+
+	// If the message was successful, release any messages it was holding up
+	if(kind.process(*this, m)) {
+		discharge(m);
+		releaseParkedMessages(*m);
+	// Otherwise park it until whatever it is waiting on changes
+	} else
+		parkMessage(kind.retryPriority, std::move(m));
+}
+
+
+// Validate the provided message against the hash it should have, returns true if the hashes match, requests a resend and returns false otherwise
+bool MessageManager::validateMessageHash(const Message& m, size_t expectedHash) const {
+	if(useVerboseOutput) std::cout << m.messageHash << " - " << expectedHash << std::endl;
+	if(m.messageHash != expectedHash) {
 		if(useVerboseOutput) std::cerr << "INVALID MESSAGE" << std::endl << std::endl;
 		ResendRequestMessage resend;
 		resend.type = Message::Type::resendRequest;
@@ -44,15 +152,101 @@ bool MessageManager::validateMessageHash(const Message& m, uint8_t offset /*= 0*
 	return true;
 }
 
+// Function that records a file we have started or finished receiving in the sync journal
+void MessageManager::appendToSyncJournal(const std::filesystem::path& path, bool completed, size_t hash /*= 0*/) {
+	std::scoped_lock lock(syncJournalMutex);
+	auto journalPath = syncJournalPath();
+	if(!exists(journalPath)) {
+		auto folder = journalPath;
+		create_directories(folder.remove_filename());
+	}
+
+	std::ofstream fout(journalPath, std::ios::app);
+	if(completed) fout << "+ " << hash << " " << std::quoted(path.string()) << "\n";
+	else fout << "~ " << hash << " " << std::quoted(path.string()) << "\n";
+}
+
+// Function that records a batch of files we have finished receiving in the sync journal
+void MessageManager::appendToSyncJournal(const std::vector<std::pair<std::filesystem::path, size_t>>& completedFiles) {
+	std::scoped_lock lock(syncJournalMutex);
+	auto journalPath = syncJournalPath();
+	if(!exists(journalPath)) {
+		auto folder = journalPath;
+		create_directories(folder.remove_filename());
+	}
+
+	std::ofstream fout(journalPath, std::ios::app);
+	for(auto& [path, hash]: completedFiles)
+		fout << "+ " << hash << " " << std::quoted(path.string()) << "\n";
+}
+
+// Function that loads the files we have completed (and their hashes) and the files we have started receiving (and the version of the source they are being received from) from the sync journal
+void MessageManager::loadSyncJournal(std::map<std::filesystem::path, size_t>& completed, std::map<std::filesystem::path, size_t>& started) const {
+	std::ifstream fin(syncJournalPath());
+	char kind;
+	while(fin >> kind) {
+		size_t hash = 0;
+		std::string path;
+		if(!(fin >> hash >> std::quoted(path)))
+			break; // The last line may have been cut off if we were interrupted while writing it
+
+		if(kind == '+') {
+			completed[path] = hash;
+			started.erase(path);
+		} else {
+			completed.erase(path);
+			started[path] = hash;
+		}
+	}
+}
+
+// Function that removes any lock and partially synced files left in the .wnts folders by a previous run which didn't shut down cleanly
+//	(the rest of the .wnts folder, the saved hashes and sweeper snapshot, is kept so that a restart doesn't propagate every file again)
+void MessageManager::removeStaleFiles() {
+	for(auto& folder: *folders) {
+		auto wnts = wntsPath(folder);
+		std::error_code ec;
+		// Content spilled by messages which were never applied is useless
+		remove_all(wnts / ".spill", ec);
+		std::vector<std::filesystem::path> stale;
+		for(std::filesystem::recursive_directory_iterator i(wnts, ec), end; !ec && i != end; i.increment(ec))
+			if(auto name = i->path().filename().string(); name.rfind(".lock.", 0) == 0 || name.rfind(".partial.", 0) == 0)
+				stale.push_back(i->path());
+
+		for(auto& path: stale) {
+			// Restore the permissions the lock removed from the file it locked
+			auto name = path.filename().string();
+			if(name.rfind(".lock.", 0) == 0) {
+				auto file = folder / relative(path.parent_path(), wnts) / name.substr(6);
+				if(exists(file)) {
+					auto [_, permsToAdd] = loadLockFile(file.lexically_normal());
+					std::filesystem::permissions(file, permsToAdd, std::filesystem::perm_options::add, ec);
+				}
+			}
+			remove(path, ec);
+		}
+	}
+}
+
 // Destructor is responsible for cleaning up
 MessageManager::~MessageManager (){
+	// Stop sending files to any nodes which are still syncing
+	initialSyncJobs.clear();
+
 	// Process all of the messages currently waiting in the queue
 	// NOTE: The peer manager be shutdown first, so we don't need to worry about additional messages while we are trying to shutdown
-	while(!messageQueue->empty())
-		processNextMessage();
-
+	// NOTE: File messages may be requeued by the file workers, so we keep going until both the queue and the workers are empty
+	do {
+		while(!messageQueue.empty())
+			processNextMessage();
+		fileWorkers.wait();
+	} while(!messageQueue.empty());
+
+	// Remove the content spilled by any messages still parked
+	std::error_code ec;
+	if(auto directory = spillDirectory(); !directory.empty()) remove_all(directory, ec);
 	// Make sure that none of the folders are considered locked (prevents weird permission errors on the next run of the program)
-	for(auto path: enumerateAllFiles(*folders)){
+	for(auto& path: FileIndex::singleton().files()){
 		auto lockPath = lockFilePath(path);
 		if(exists(lockPath)) {
 			auto [_, permsToAdd] = loadLockFile(path);
@@ -72,29 +266,10 @@ bool MessageManager::processResendRequestMessage(const ResendRequestMessage& req
 	if(request.originatorNode == ZeroTierNode::singleton().getIP())
 		return true;
 
-	// Find the message that needs to be resent in the old message cache, then resend it
-	for(auto& m: oldMessages) {
-		if(m->messageHash == request.requestedHash) {
-			switch(m->type) {
-			break; case Message::Type::payload:				PeerManager::singleton().send(reference_cast<PayloadMessage>(*m), request.originalDestination);
-			// break; case Message::Type::resendRequest:		PeerManager::singleton().send(reference_cast<ResendRequestMessage>(*m), request.originalDestination);
-			break; case Message::Type::lock:				PeerManager::singleton().send(reference_cast<FileMessage>(*m), request.originalDestination);
-			break; case Message::Type::unlock:				PeerManager::singleton().send(reference_cast<FileMessage>(*m), request.originalDestination);
-			break; case Message::Type::deleteFile:			PeerManager::singleton().send(reference_cast<FileMessage>(*m), request.originalDestination);
-			break; case Message::Type::contentChange:		PeerManager::singleton().send(reference_cast<FileContentMessage>(*m), request.originalDestination);
-			break; case Message::Type::initialSync:			PeerManager::singleton().send(reference_cast<FileInitialSyncMessage>(*m), request.originalDestination);
-			break; case Message::Type::initialSyncRequest:	PeerManager::singleton().send(reference_cast<Message>(*m), request.originalDestination);
-			break; case Message::Type::connect:				PeerManager::singleton().send(reference_cast<ConnectMessage>(*m), request.originalDestination);
-			break; case Message::Type::disconnect:			PeerManager::singleton().send(reference_cast<Message>(*m), request.originalDestination);
-			break; case Message::Type::linkLost:			PeerManager::singleton().send(reference_cast<Message>(*m), request.originalDestination);
-			break; default:
-				throw std::runtime_error("Unrecognized message type");
-			}
-
-			// Message was successfully processed, no need to add back to queue
-			return true;
-		}
-	}
+	// Find the message that needs to be resent in the retransmission cache, and send the exact frame we sent (or received) before
+	// NOTE: The frame is routed as is (without being processed by us again), it still holds the routing information it was first sent with
+	if(auto frame = retransmissionCache.find(request.requestedHash))
+		PeerManager::singleton().routeFrame(std::move(frame), request.originalDestination, zt::IpAddress::ipv6Loopback());
 
 	// Message was successfully processed, no need to add back to queue
 	return true;
@@ -104,6 +279,12 @@ bool MessageManager::processResendRequestMessage(const ResendRequestMessage& req
 constexpr auto writePerms = std::filesystem::perms::owner_write | std::filesystem::perms::group_write | std::filesystem::perms::others_write;
 constexpr auto readPerms = std::filesystem::perms::owner_read | std::filesystem::perms::group_read | std::filesystem::perms::others_read;
 
+// Function that processes a payload (by displaying it)
+bool MessageManager::processPayloadMessage(const PayloadMessage& m) {
+	std::cout << "[" << m.originatorNode << "][payload]:\n" << m.payload << std::endl;
+	return true;
+}
+
 // Function that processes a file lock
 bool MessageManager::processLockMessage(const FileMessage& m) {
 	// If we are still connecting to the network, process this message later
@@ -215,44 +396,67 @@ bool MessageManager::processDeleteFileMessage(const FileMessage& m) {
 	remove(m.targetFile);
 	remove(lockFilePath(m.targetFile));
 	remove(wntsPath(m.targetFile));
+	FileIndex::singleton().remove(m.targetFile);
 
 	// Message was successfully processed, no need to add back to queue
 	return true;
 }
 
-// Function that processes a new file content message
-bool MessageManager::processContentFileMessage(const FileContentMessage& m) {
-	// If we are still connecting to the network, process this message later
-	if(!isFinishedConnecting())
-		return false;
-
+// Function that writes new content to a file (respecting any locks on the file)
+void MessageManager::applyFileContent(const std::filesystem::path& targetFile, const zt::IpAddress& originatorNode, std::string_view content, const std::vector<Extent>& extents /*= {}*/, uint64_t fileSize /*= 0*/) {
 	// Make sure the file isn't locked
 	std::filesystem::perms perms = std::filesystem::perms::none;
-	if(exists(lockFilePath(m.targetFile))) {
-		auto [lock, perms_] = loadLockFile(m.targetFile);
+	if(exists(lockFilePath(targetFile))) {
+		auto [lock, perms_] = loadLockFile(targetFile);
 		perms = perms_;
 
 		// The file can't be deleted because a lock already exists
 		if(lock.originatorNode != ZeroTierNode::singleton().getIP())
-			return true;
+			return;
 
 		// Don't allow the file to be modified unless this message and the lock have the same source
-		if(lock.originatorNode != m.originatorNode)
+		if(lock.originatorNode != originatorNode)
 			perms = std::filesystem::perms::none;
 	}
 
-	// Temporarily add the permissions
-	std::filesystem::permissions(m.targetFile, perms, std::filesystem::perm_options::add);
+	// Temporarily add the permissions (newly created files don't have any permissions to change)
+	bool existed = exists(targetFile);
+	if(existed) std::filesystem::permissions(targetFile, perms, std::filesystem::perm_options::add);
 
 	// Save the file's content (creating any nessicary intermediate directories)
-	auto folder = m.targetFile;
+	auto folder = targetFile;
 	create_directories(folder.remove_filename());
-	std::ofstream fout(m.targetFile);
-	fout << m.fileContent;
-	fout.close();
+	std::ofstream(targetFile, std::ios::binary | std::ios::trunc).close();
+	// The (now empty) file is filled in extent by extent if the content is sparse, leaving holes in between, and is always grown to its full size
+	writeSparseRange(targetFile, 0, std::max<uint64_t>(fileSize, content.size()), content, extents);
+	FileIndex::singleton().add(targetFile);
 
 	// Remove the temporarily added permissions
-	std::filesystem::permissions(m.targetFile, perms, std::filesystem::perm_options::remove);
+	if(existed) std::filesystem::permissions(targetFile, perms, std::filesystem::perm_options::remove);
+}
+
+// Function that processes a new file content message
+bool MessageManager::processContentFileMessage(const FileContentMessage& m) {
+	// If we are still connecting to the network, process this message later
+	if(!isFinishedConnecting())
+		return false;
+
+	applyFileContent(m.targetFile, m.originatorNode, m.fileContent, m.extents, m.fileSize);
+
+	// Message was successfully processed, no need to add back to queue
+	return true;
+}
+
+// Function that processes a pack of new file contents
+bool MessageManager::processFilePackMessage(const FilePackMessage& m) {
+	// If we are still connecting to the network, process this message later
+	if(!isFinishedConnecting())
+		return false;
+
+	// Apply every file in the pack
+	m.forEach([&](const FilePackMessage::Entry& entry, std::string_view content) {
+		applyFileContent(entry.targetFile, m.originatorNode, content);
+	});
 
 	// Message was successfully processed, no need to add back to queue
 	return true;
@@ -260,52 +464,149 @@ bool MessageManager::processContentFileMessage(const FileContentMessage& m) {
 
 // Function that processes an initial file sync
 bool MessageManager::processInitialFileSyncMessage(const FileInitialSyncMessage& m) {
-	// Update metrics regarding the number of files we have received
+	// Update metrics regarding the number of files we need to receive
 	totalInitialFiles = m.total;
-	receivedInitialFiles++;
+	// If the gateway had no files to send us, we are done connecting
+	if(m.targetFile.empty()) {
+		receivedInitialFiles = m.total;
+		return true;
+	}
+
+	// Determine how much of the file we already have
+	auto partialPath = partialFilePath(m.targetFile);
+	size_t received = exists(partialPath) ? file_size(partialPath) : 0;
+	// If an earlier chunk of this file hasn't been processed yet, process this message later
+	if(m.offset > received)
+		return false;
+	// If we already have this chunk (left over from a previous attempt at syncing the file), ignore it
+	if(m.offset != 0 && m.offset < received)
+		return true;
 
-	// Create intermediate directories
-	auto folder = m.targetFile;
+	// Write the chunk to the file's partial content (starting a new file if this is the first chunk)
+	auto folder = partialPath;
 	create_directories(folder.remove_filename());
-	// Write the content of the file to disk
-	std::ofstream fout(m.targetFile);
-	fout << m.fileContent;
-	fout.close();
+	if(m.offset == 0) {
+		std::ofstream(partialPath, std::ios::binary | std::ios::trunc).close();
+		appendToSyncJournal(m.targetFile, /*completed*/ false, m.sourceVersion);
+	}
+	// NOTE: Any holes in the chunk are recreated as holes rather than being filled with zeros
+	writeSparseRange(partialPath, m.offset, m.offset + m.length, m.fileContent, m.extents);
+
+	// Once the last chunk has been received...
+	if(m.offset + m.length >= m.fileSize) {
+		// Make sure the chunks add up to the file that was sent (they may not if the source changed part way through sending it),
+		//	if they don't the file is thrown away, the source's change will be propagated once it is swept
+		if(hashFileContent(partialPath) != m.fileHash) {
+			std::cerr << "Received content of " << m.targetFile << " doesn't match the file it was sent from, discarding it" << std::endl;
+			remove(partialPath);
+			receivedInitialFiles++;
+			return true;
+		}
+
+		// Move the file into place (creating intermediate directories)
+		folder = m.targetFile;
+		create_directories(folder.remove_filename());
+		rename(partialPath, m.targetFile);
+		FileIndex::singleton().add(m.targetFile);
+
+		// Save the file's hash (so the sweeper doesn't propagate the file back to the network) and record that we have the file
+		std::ofstream(wntsPath(m.targetFile)) << m.fileHash;
+		appendToSyncJournal(m.targetFile, /*completed*/ true, m.fileHash);
+
+		// Update metrics regarding the number of files we have received
+		receivedInitialFiles++;
+	}
+
+	// Message was successfully processed, no need to add back to queue
+	return true;
+}
+
+// Function that processes a pack of initially synced files
+bool MessageManager::processInitialSyncPackMessage(const FilePackMessage& m) {
+	// Update metrics regarding the number of files we need to receive
+	totalInitialFiles = m.total;
+
+	// Write every file in the pack to disk, saving their hashes (so the sweeper doesn't propagate them back to the network)
+	std::vector<std::pair<std::filesystem::path, size_t>> completed;
+	m.forEach([&](const FilePackMessage::Entry& entry, std::string_view content) {
+		auto folder = entry.targetFile;
+		create_directories(folder.remove_filename());
+		std::ofstream fout(entry.targetFile, std::ios::binary);
+		fout.write(content.data(), content.size());
+		fout.close();
+
+		FileIndex::singleton().add(entry.targetFile);
+
+		size_t hash = ::hash(std::string(content));
+		std::ofstream(wntsPath(entry.targetFile)) << hash;
+		completed.emplace_back(entry.targetFile, hash);
+	});
+
+	// Record that we have all of the files (in one batch)
+	appendToSyncJournal(completed);
+	receivedInitialFiles += m.files.size();
 
 	// Message was successfully processed, no need to add back to queue
 	return true;
 }
 
 // Function that processes an initial file sync request
-bool MessageManager::processInitialFileSyncRequestMessage(const Message& m) {
+bool MessageManager::processInitialFileSyncRequestMessage(const InitialSyncRequestMessage& m) {
 	// If we are still connecting to the network, process this message later
 	if(!isFinishedConnecting())
 		return false;
 
-	// Send the content of every managed file to the newly connected node
-	auto paths = enumerateAllFiles(*folders);
-	for(size_t i = 0, size = paths.size(); i < size; i++) {
-		FileInitialSyncMessage sync;
-		sync.type = Message::Type::initialSync;
-		sync.targetFile = paths[i];
-		sync.timestamp = std::chrono::system_clock::now();
-		sync.index = i;
-		sync.total = size;
-
-		std::ifstream fin(sync.targetFile);
-		std::getline(fin, sync.fileContent, '\0');
-		fin.close();
-
-		PeerManager::singleton().send(sync, m.originatorNode);
-
-		// If the file is locked also send a lock message
-		if(exists(lockFilePath(sync.targetFile))) {
-			auto [lock, _] = loadLockFile(sync.targetFile);
-			lock.timestamp = std::chrono::system_clock::now();
-			PeerManager::singleton().send(lock, m.originatorNode);
+	// Clean up any jobs which have finished, and stop any job which is already sending files to this node
+	initialSyncJobs.erase(std::remove_if(initialSyncJobs.begin(), initialSyncJobs.end(), [&m](auto& job) {
+		return job->isFinished() || job->getDestination() == m.originatorNode;
+	}), initialSyncJobs.end());
+
+	// Determine which files the node still needs (skipping files it already has the same content for, and resuming partially received files)
+	std::map<std::filesystem::path, size_t> completed(m.completedFiles.begin(), m.completedFiles.end());
+	std::map<std::filesystem::path, const InitialSyncRequestMessage::PartialFile*> partial;
+	for(auto& file: m.partialFiles)
+		partial[file.path] = &file;
+	std::vector<InitialSyncJob::File> files;
+	for(auto& path: FileIndex::singleton().files()) {
+		if(auto i = completed.find(path); i != completed.end()) {
+			size_t hash;
+			if(!loadSavedHash(path, hash))
+				hash = hashFileContent(path);
+			if(hash == i->second)
+				continue;
 		}
+
+		if(auto i = partial.find(path); i != partial.end())
+			files.push_back({path, i->second->offset, i->second->sourceVersion});
+		else files.push_back({path});
+	}
+
+	// Tell the node to delete any files it reports having which we no longer have (they were deleted or renamed while it was away)
+	// NOTE: The deletes wait on the node until it has finished connecting, so they can't be undone by the rest of the sync
+	for(auto& [path, _]: m.completedFiles) {
+		if(FileIndex::singleton().contains(path)) continue;
+
+		FileMessage del;
+		del.type = Message::Type::deleteFile;
+		del.targetFile = path;
+		del.timestamp = std::chrono::system_clock::now();
+		PeerManager::singleton().send(del, m.originatorNode);
 	}
 
+	// If the node already has everything, let it know that it is done connecting
+	if(files.empty()) {
+		FileInitialSyncMessage done;
+		done.type = Message::Type::initialSync;
+		done.timestamp = std::chrono::system_clock::now();
+		done.index = done.total = 0;
+		PeerManager::singleton().send(done, m.originatorNode);
+		return true;
+	}
+
+	// Send the content of every file the node needs in the background
+	//	(so that locks and other messages can still be processed while the sync is in progress)
+	initialSyncJobs.emplace_back(std::make_unique<InitialSyncJob>(std::move(files), m.originatorNode));
+
 	// Message was successfully processed, no need to add back to queue
 	return true;
 }
@@ -314,42 +615,86 @@ bool MessageManager::processInitialFileSyncRequestMessage(const Message& m) {
 bool MessageManager::processConnectMessage(const ConnectMessage& m) {
 	// Save the backup IP addresses
 	PeerManager::singleton().backupPeers = std::move(m.backupPeers);
-	// Save the list of folders the network is managing
-	*folders = std::move(m.managedPaths);
+	// Save the list of folders the network is managing (other threads only ever read a copy of it, taken while it is locked)
+	{
+		std::scoped_lock lock(foldersMutex);
+		*folders = std::move(m.managedPaths);
+	}
+	IgnoreRules::singleton().setup(*folders);
 	// Make sure that any intermediate directories are created
 	for(auto& path: *folders)
 		create_directories(path);
 
-	// Delete managed data in preparation for data syncs
-	auto paths = enumerateAllFiles(*folders);
-	for(auto& path: paths) {
-		auto wnts = wntsPath(path);
-		remove(path);
-		remove(wnts);
+	// Request that the gateway send us the files we need
+	InitialSyncRequestMessage request;
+	request.type = Message::Type::initialSyncRequest;
+
+	if(!folders->empty()) {
+		// Determine which files we received during any previous syncs
+		std::map<std::filesystem::path, size_t> completed;
+		std::map<std::filesystem::path, size_t> started;
+		loadSyncJournal(completed, started);
+
+		// Delete managed data we don't know to be complete in preparation for data syncs, and note the data we do have
+		// NOTE: The folders we manage just changed, so the index is rebuilt from what is on disk
+		FileIndex::singleton().rebuild(*folders);
+		for(auto& path: FileIndex::singleton().files()) {
+			auto wnts = wntsPath(path);
+			if(auto i = completed.find(path); i != completed.end()) {
+				// If the file has changed since it was synced, report its current hash
+				size_t hash = i->second;
+				loadSavedHash(path, hash);
+				request.completedFiles.emplace_back(path, hash);
+				continue;
+			}
+
+			remove(path);
+			remove(wnts);
+			FileIndex::singleton().remove(path);
+		}
+
+		// Note how much of every partially received file we have
+		for(auto& [path, sourceVersion]: started) {
+			auto partialPath = partialFilePath(path);
+			if(exists(partialPath) && !completed.count(path))
+				request.partialFiles.push_back({path, file_size(partialPath), sourceVersion});
+		}
+
+		// Rewrite the journal so that it only contains the files we still have
+		std::ofstream(syncJournalPath(), std::ios::trunc).close();
+		for(auto& [path, hash]: request.completedFiles)
+			appendToSyncJournal(path, /*completed*/ true, hash);
+		for(auto& file: request.partialFiles)
+			appendToSyncJournal(file.path, /*completed*/ false, file.sourceVersion);
 	}
 
 	// Reset file counts (marking that we are not finished connecting to the network)
 	receivedInitialFiles = 0;
 	totalInitialFiles = 1;
 
+	PeerManager::singleton().send(request, m.originatorNode);
+
 	// Message was successfully processed, no need to add back to queue
 	return true;
 }
 
 // Function that handles losing our link to a peer
 bool MessageManager::processLinkLostMessage(const Message& m) {
+	// NOTE: The removed Peer is only destroyed (joining its threads) once the peer list is unlocked, since its threads may be waiting on the lock
+	std::unique_ptr<Peer> removedPeer;
 	zt::IpAddress removedIP; {
 		auto peerLock = PeerManager::singleton().getPeers().write_lock();
 		// Find the Peer that disconnected
 		size_t index = -1;
 		for(size_t i = 0; i < peerLock->size(); i++)
-			if(peerLock[i].getRemoteIP() == m.originatorNode) {
+			if(peerLock[i]->getRemoteIP() == m.originatorNode) {
 				index = i;
 				break;
 			}
 		if(index != std::numeric_limits<size_t>::max()) {
 			// Remove the disconnected Peer from our list of Peers
-			removedIP = peerLock[index].getRemoteIP();
+			removedIP = peerLock[index]->getRemoteIP();
+			removedPeer = std::move(peerLock[index]);
 			peerLock->erase(peerLock->begin() + index);
 
 			// If the removed Peer was our gateway, connect to one of the backup Peers so that the nextwork doesn't become segmented
@@ -360,7 +705,7 @@ bool MessageManager::processLinkLostMessage(const Message& m) {
 					auto& [backupIP, backupPort] = backupPeers[peer];
 					if(backupIP.isValid()) {
 						try {
-							peerLock->insert(peerLock->begin(), std::move(Peer::connect(backupIP, backupPort)));
+							peerLock->insert(peerLock->begin(), Peer::connect(backupIP, backupPort));
 							PeerManager::singleton().setGatewayIP(backupIP); // Mark the backup IP as our "gateway" to the rest of the network
 							std::cout << "Updated gateway to: " << backupIP << std::endl;
 
@@ -375,6 +720,12 @@ bool MessageManager::processLinkLostMessage(const Message& m) {
 		}
 	}
 
+	// The removed Peer's queued data will never be sent, so anyone waiting for it to drain can stop waiting
+	if(removedPeer) {
+		removedPeer.reset();
+		PeerManager::singleton().notifyDrained();
+	}
+
 	// Notify the rest of the network that a Peer disconnected
 	if(removedIP.isValid()) {
 		Message m;
@@ -402,8 +753,7 @@ bool MessageManager::processDisconnectMessage(const Message& m) {
 	}
 
 	// Send ourselves an unlock message for every file (any files locked by different peers should have the message rejected)
-	auto paths = enumerateAllFiles(*folders);
-	for(auto& path: paths) {
+	for(auto& path: FileIndex::singleton().files()) {
 		FileMessage unlock;
 		unlock.type = Message::Type::unlock;
 		unlock.targetFile = path;
@@ -8,12 +8,77 @@
 #ifndef __MESSAGE_QUEUE_HPP__
 #define __MESSAGE_QUEUE_HPP__
 
-#include <queue>
-#include <circular_buffer.hpp>
+#include <array>
+#include <map>
+#include <optional>
+#include <set>
+#include <fstream>
+#include <condition_variable>
 #include "messages.hpp"
+#include "monitor.hpp"
+#include "bucket_priority_queue.hpp"
+#include "sharded_workers.hpp"
+#include "parking_lot.hpp"
+#include "superseded_messages.hpp"
+#include "spill_area.hpp"
+#include "retransmission_cache.hpp"
+#include "initial_sync.hpp"
 
 #include "include_everywhere.hpp"
 
+// Function that calculates the path to a file's lock file
+inline std::filesystem::path lockFilePath(const std::filesystem::path& p) {
+	auto lockPath = wntsPath(p);
+	return lockPath.remove_filename() / (".lock." + p.filename().string());
+}
+
+// Function that calculates the path to the file that a partially synced file's content is stored in until it has been completely received
+inline std::filesystem::path partialFilePath(const std::filesystem::path& p) {
+	auto partialPath = wntsPath(p);
+	return partialPath.remove_filename() / (".partial." + p.filename().string());
+}
+
+// Function that loads the hash of a file's content saved the last time it was propagated (returns false if there is no saved hash)
+inline bool loadSavedHash(const std::filesystem::path& p, size_t& hash) {
+	std::ifstream fin(wntsPath(p));
+	return bool(fin >> hash);
+}
+
+// Function that calculates the hash of a file's content (without loading the whole file into memory)
+inline size_t hashFileContent(const std::filesystem::path& path) {
+	std::ifstream fin(path, std::ios::binary);
+	std::array<char, 64 * 1024> buffer;
+	size_t hash = 0;
+	while(fin.read(buffer.data(), buffer.size()) || fin.gcount() > 0)
+		for(std::streamsize i = 0; i < fin.gcount(); i++)
+			hash += buffer[i]; // NOTE: Matches ::hash
+	return hash;
+}
+
+// Function that identifies the current version of a file by its size and modification time
+//	(used to check that a partially received file is still a prefix of the file it is being received from, returns 0 if the file doesn't exist)
+inline size_t fileVersion(const std::filesystem::path& p) {
+	std::error_code ec;
+	auto size = std::filesystem::file_size(p, ec);
+	if(ec) return 0;
+	auto modified = std::filesystem::last_write_time(p, ec);
+	if(ec) return 0;
+	return std::hash<std::string>{}(std::to_string(size) + ":" + std::to_string(modified.time_since_epoch().count()));
+}
+
+// Function that loads the data from a lock file
+inline std::pair<FileMessage, std::filesystem::perms> loadLockFile(const std::filesystem::path& p) {
+	std::pair<FileMessage, std::filesystem::perms> out;
+
+	std::ifstream fin(lockFilePath(p), std::ios::binary);
+	cereal::BinaryInputArchive ar(fin);
+	ar (out.first, out.second);
+	fin.close();
+
+	return out;
+}
+
+
 // Singleton responsible for processing and verifying messages
 struct MessageManager {
 	friend class PeerManager;
@@ -26,34 +91,101 @@ struct MessageManager {
 	static constexpr auto connectPriority = 1;
 	static constexpr auto disconnectPriority = 2;
 
+	// How long messages may wait in the queue before they are processed ahead of more urgent messages
+	//	(so a steady stream of urgent messages can't starve the rest, control messages are never held back)
+	static constexpr std::chrono::milliseconds lockAgingLimit = 1000ms, fileAgingLimit = 2000ms, payloadAgingLimit = 5000ms;
+	// Maximum number of file messages taken from the queue at once (and put into timestamp order for each file)
+	static constexpr size_t fileBatchSize = 64;
+	// Smallest content which is worth spilling to disk
+	static constexpr size_t spillThreshold = 64 * 1024;
+
+	// Everything the manager needs to know about a type of message, every type of message has an entry in the registry (see kinds in message_manager.cpp)
+	// NOTE: The functions are generated for each type at compile time, so decoding, processing, and resending a message is an array lookup
+	//	and a direct call (no switches over the types, and no virtual calls)
+	struct MessageKind {
+		// How a message is handed to whatever processes it
+		enum class Route : uint8_t {
+			direct, // Processed by the thread calling processNextMessage
+			file, // Concerns a single file, and is applied by the file worker responsible for the file
+			pack, // Concerns many files, and is split between the file workers
+			barrier, // Affects (or needs to see) every file, so waits until every file message before it has been applied
+		} route = Route::direct;
+		// Priority the message is processed with, sent over the network with, and requeued with when it can't be processed yet
+		size_t priority = filePriority, sendPriority = filePriority, retryPriority = filePriority + 1;
+		// Amount the hash of a message received from the network is offset by
+		uint8_t hashOffset = 0;
+		// Name the message is logged with when it is processed (null if it isn't logged), and whether it is only logged in verbose mode
+		const char* name = nullptr;
+		bool verbose = false;
+
+		// Function which deserializes the message (null if it can't be received from the network)
+		AnyMessage (*decode)(cereal::BinaryInputArchive& ar) = nullptr;
+		// Function which hashes the message
+		size_t (*hash)(const AnyMessage& m) = nullptr;
+		// Function which processes the message, returns false if it needs to be processed later
+		bool (*process)(MessageManager& manager, const AnyMessage& m) = nullptr;
+		// Function which sends the message (null if it is never resent)
+		void (*send)(AnyMessage m, const zt::IpAddress& destination) = nullptr;
+	};
+	// The registry of message types, indexed by type
+	static const std::array<MessageKind, 32> kinds;
+
+	// Function that gets the registry entry for a type of message (types which aren't registered get an empty entry)
+	static const MessageKind& kindOf(Message::Type type) { return type < kinds.size() ? kinds[type] : kinds[Message::Type::invalid]; }
+
 
 
 	// The the application is mangaing
 	std::vector<std::filesystem::path>* folders;
+	// Locked while the folders are changed, and while another thread copies them (see managedFolders)
+	mutable std::mutex foldersMutex;
 
 	// Variables tracking how many files we need to receive before our state is the same as the network
-	size_t receivedInitialFiles = 0, totalInitialFiles = 1;
-
-	// Queue of messages waiting to be processed (It is a non-blocking [skiplist based] concurrent queue)
-	// NOTE: Lower priorities = faster execution
-	using Prio = std::pair<size_t, std::unique_ptr<Message>>;
-	struct PrioComp {
-		bool operator() (const Prio& a, const Prio& b) {
-			// If the two messages have the same priority, and are file messages, sort them according to their timestamps
-			if(a.first == b.first) {
-				constexpr auto fileTypes = Message::Type::lock | Message::Type::unlock | Message::Type::deleteFile | Message::Type::contentChange | Message::Type::initialSync;
-				if(a.second->type & fileTypes && b.second->type & fileTypes)
-					return std::chrono::duration_cast<std::chrono::nanoseconds>(
-						reference_cast<FileMessage>(*a.second).timestamp - reference_cast<FileMessage>(*b.second).timestamp
-					).count() < 0; // If a should come first, its timestamp will be smaller and thus the difference will be negative
-			}
-			return a.first > b.first;
-		}
+	// NOTE: Atomic since initial sync messages are applied by the file workers
+	std::atomic<size_t> receivedInitialFiles = 0, totalInitialFiles = 1;
+
+	// Queue of messages waiting to be processed (a lock free bucket queue, so Peer threads never block each other or the processing loop)
+	// NOTE: Lower priorities = faster execution, messages with the same priority are processed in the order they arrived
+	//	(except that messages for the same file are processed in timestamp order), and messages which have waited past their
+	//	priority's aging limit are processed before more urgent messages which also have a limit (control messages have none, and
+	//	are always processed first)
+	//	Only the thread calling processNextMessage may take messages out of the queue
+	// NOTE: Messages are stored inline in the queue's nodes
+	BucketPriorityQueue<AnyMessage> messageQueue;
+	// Used to put the processing thread to sleep while there is nothing to do, and to wake it back up
+	std::mutex wakeMutex;
+	std::condition_variable wakeCV;
+	bool wakeRequested = false;
+	std::atomic<bool> sleeping = false;
+	// Index of the file messages waiting in the queue, used to drop messages which newer messages make obsolete
+	SupersededMessages supersededMessages;
+
+	// How much memory the content of waiting messages (queued, parked, or waiting for a file worker) may take up before large contents are spilled
+	//	to disk, and how much content may be stuck in memory (because it couldn't be spilled) before we stop reading new content from the network
+	size_t memoryBudget = 256 * 1024 * 1024, hardCap = 1024 * 1024 * 1024;
+	// Bytes of content held by waiting messages (all of it, and the part of it which is in memory)
+	std::atomic<size_t> bytesHeld = 0, bytesInMemory = 0;
+	// Where the content of waiting messages is spilled to
+	SpillArea spillArea;
+	// Used to make the threads reading from the network wait while too much content is held (and to wake them back up)
+	std::mutex roomMutex;
+	std::condition_variable roomCV;
+	std::atomic<size_t> producersWaiting = 0, backpressureWaits = 0;
+
+	// Serialized form of the messages that have recently been received or sent (indexed by their hash), so they can be resent if they arrive corrupted
+	// NOTE: Locks itself, since initial sync workers send (and thus record) messages from their own threads
+	RetransmissionCache retransmissionCache{64 * 1024 * 1024};
+
+	// Background jobs sending our files to newly connected nodes
+	std::vector<std::unique_ptr<InitialSyncJob>> initialSyncJobs;
+
+	// Conditions a message which can't be processed yet may be waiting on
+	enum class WaitCondition {
+		connected, // We have finished connecting to the network
+		earlierChunk, // An earlier chunk of the (initial sync) message's file has been received
 	};
-	mutable monitor<std::priority_queue<Prio, std::vector<Prio>, PrioComp>> messageQueue;
-
-	// Circular buffer that maintains a record of the past 100 messages that have been received or sent
-	finalizeable_circular_buffer_array<std::unique_ptr<Message>, 100> oldMessages;
+	// Messages which can't be processed yet (along with the priority they should be requeued with), keyed by what they are waiting on (and the file, if any)
+	ParkingLot<std::pair<WaitCondition, std::string>, std::pair<size_t, AnyMessage>> parkedMessages;
 
 
 
@@ -66,226 +198,369 @@ struct MessageManager {
 	// Destructor is responsible for cleaning up
 	~MessageManager();
 
-	// Function which gets a reference to the managed folders, and sets up the circular buffer to free released pointers
+	// Function which gets a copy of the managed folders (safe to call from any thread)
+	std::vector<std::filesystem::path> managedFolders() const {
+		std::scoped_lock lock(foldersMutex);
+		return folders ? *folders : std::vector<std::filesystem::path>{};
+	}
+
+	// Function which gets a reference to the managed folders
 	void setup(std::vector<std::filesystem::path>& folders) {
 		this->folders = &folders;
-		oldMessages.setFinalizer([](std::unique_ptr<Message>& m){ m.release(); });
+		removeStaleFiles();
 	}
 
 
-	// Function that processes the next message currently in the message queue
-	//	(or waits 1/10 of a second if there is nothing in the queue)
-	void processNextMessage() {
-		// If the queue is empty, sleep for 100ms
-		if(messageQueue->empty()) {
-			std::this_thread::sleep_for(100ms);
+	// Function that adds a message to the queue of messages waiting to be processed (safe to call from any thread)
+	void enqueue(size_t priority, AnyMessage m) {
+		// Messages which cancel out a message already waiting in the queue are dropped (along with the message they cancel out)
+		if(!supersededMessages.queued(m, [](const std::filesystem::path& path) { return exists(lockFilePath(path)); }))
 			return;
-		}
+		// NOTE: Requeued messages are already charged, but may still need to be spilled
+		charge(m);
+		spillIfOverBudget(m);
+		messageQueue.push(priority, std::move(m), [this](AnyMessage& queued) { supersededMessages.track(queued); });
+		// NOTE: The fence pairs with the one in waitForWork, either we see that the processing thread is sleeping or it sees the message
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleeping.load(std::memory_order_relaxed)) wake();
+	}
 
-		// Save the message and remove the node from the queue
-		std::unique_ptr<Message> msgPtr = std::move(reference_cast<Prio>(messageQueue->top()).second);
-		messageQueue->pop();
+	// Function that waits while more content than the hard cap is held in memory by waiting messages, before a message of type <type> is received
+	//	(called by the threads reading from the network, so a node sending faster than we can apply is slowed down by the network instead of exhausting our memory)
+	// NOTE: Spilled content doesn't count against the hard cap, so we only wait once spilling can't keep up
+	// NOTE: Only new file content and payloads wait, control and initial sync messages are always let through, since they may be what
+	//	releases the content which is waiting (such as the sync chunks that let the content parked while we connect be applied)
+	void waitForRoom(Message::Type type, std::stop_token& stop) {
+		if(!appliesBackpressure(type) || bytesInMemory <= hardCap) return;
+		backpressureWaits++;
+
+		std::unique_lock lock(roomMutex);
+		producersWaiting++;
+		while(bytesInMemory > hardCap && !stop.stop_requested())
+			roomCV.wait_for(lock, 100ms);
+		producersWaiting--;
+	}
 
+	// Function that determines if receiving a type of message waits for there to be room for its content
+	static bool appliesBackpressure(Message::Type type) {
+		return type == Message::Type::payload || type == Message::Type::contentChange || type == Message::Type::filePack;
+	}
 
-		// Process the message as the same type of message that was delivered
-		int64_t requeuePriority; // -1 indicates no requeue needed
-		switch(msgPtr->type) {
-		break; case Message::Type::payload: {
-			auto& m = reference_cast<PayloadMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "][payload]:\n" << m.payload << std::endl;
-			requeuePriority = -1;
-		}
-		break; case Message::Type::resendRequest: {
-			auto& m = reference_cast<ResendRequestMessage>(*msgPtr);
-			if(useVerboseOutput) std::cout << "[" << m.originatorNode << "] resend request message" <<  std::endl;
-			requeuePriority = processResendRequestMessage(m) ? -1 : resendPriority + 1;
-		}
-		break; case Message::Type::lock: {
-			auto& m = reference_cast<FileMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] lock " << m.targetFile << std::endl;
-			requeuePriority = processLockMessage(m) ? -1 : lockPriority + 1;
-		}
-		break; case Message::Type::unlock: {
-			auto& m = reference_cast<FileMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] unlock " << m.targetFile << std::endl;
-			requeuePriority = processUnlockMessage(m) ? -1 : lockPriority + 1;
+	// Function that wakes the processing thread if it is waiting for something to do (safe to call from any thread)
+	//	(used to signal work that doesn't go through the queue, such as changes found by the sweepers)
+	void wake() {
+		{
+			std::scoped_lock lock(wakeMutex);
+			wakeRequested = true;
 		}
-		break; case Message::Type::deleteFile: {
-			auto& m = reference_cast<FileMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] delete " << m.targetFile << std::endl;
-			requeuePriority = processDeleteFileMessage(m) ? -1 : filePriority + 1;
-		}
-		break; case Message::Type::contentChange: {
-			auto& m = reference_cast<FileContentMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] modify " << m.targetFile << std::endl;
-			requeuePriority = processContentFileMessage(m) ? -1 : filePriority + 1;
-		}
-		break; case Message::Type::initialSync: {
-			auto& m = reference_cast<FileInitialSyncMessage>(*msgPtr);
-			if(useVerboseOutput) std::cout << "[" << m.originatorNode << "] sync " << m.targetFile << std::endl;
-			requeuePriority = processInitialFileSyncMessage(m) ? -1 : lockPriority + 1;
+		wakeCV.notify_one();
+	}
+
+	// Function that processes the next message currently in the message queue
+	//	(or waits for up to <timeout> for a message to arrive, or for wake to be called, if there is nothing in the queue)
+	//	File messages are handed to the file workers, and may not have been applied yet when this function returns
+	//	Returns true if a message was processed
+	bool processNextMessage(std::chrono::steady_clock::duration timeout = 100ms) {
+		// Lambda which checks if a message newer messages have made obsolete is being taken out of the queue (such messages are dropped)
+		bool superseded = false;
+		auto take = [this, &superseded](AnyMessage& queued) { superseded = !supersededMessages.dequeued(queued); };
+
+		// Take the most urgent message out of the queue
+		AnyMessage message;
+		size_t priority;
+		if(!messageQueue.pop(message, &priority, take)) {
+			waitForWork(timeout);
+			return false;
 		}
-		break; case Message::Type::initialSyncRequest: {
-			auto& m = reference_cast<Message>(*msgPtr);
-			if(useVerboseOutput) std::cout << "[" << m.originatorNode << "] sync request message" << std::endl;
-			requeuePriority = processInitialFileSyncRequestMessage(m) ? -1 : lockPriority + 1;
+		if(superseded) {
+			discharge(message);
+			return true;
 		}
-		break; case Message::Type::connect:{
-			auto& m = reference_cast<ConnectMessage>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] connect message" << std::endl;
-			requeuePriority = processConnectMessage(m) ? -1 : connectPriority + 1;
+
+		// File messages are taken from the queue in batches, so that the messages for each file can be put into timestamp order
+		if(isFileMessage(message->type)) {
+			std::vector<AnyMessage> batch;
+			batch.emplace_back(std::move(message));
+			while(batch.size() < fileBatchSize && messageQueue.popFrom(priority, message, take))
+				if(!superseded)
+					batch.emplace_back(std::move(message));
+				else discharge(message);
+
+			orderByTimestamp(batch);
+			for(auto& m: batch)
+				dispatchMessage(std::move(m));
+		} else
+			dispatchMessage(std::move(message));
+		return true;
+	}
+
+	// Function that prints how many messages are waiting with each priority, and how long messages have waited
+	void printQueueStats(std::ostream& out) const {
+		for(size_t priority = 0; priority < messageQueue.priorityLevels; priority++) {
+			auto& stats = messageQueue.laneStats(priority);
+			if(stats.popped == 0 && messageQueue.depth(priority) == 0) continue;
+			out << "\tPriority " << priority << ": " << messageQueue.depth(priority) << " waiting, " << stats.popped << " processed (" << stats.aged
+				<< " aged), average wait " << stats.averageWait * 1000 << "ms, longest wait " << stats.longestWait * 1000 << "ms" << std::endl;
 		}
-		break; case Message::Type::disconnect: {
-			auto& m = reference_cast<Message>(*msgPtr);
-			std::cout << "[" << m.originatorNode << "] disconnect message" << std::endl;
-			requeuePriority = processDisconnectMessage(m) ? -1 : disconnectPriority + 1;
+		if(supersededMessages.superseded > 0)
+			out << "\t" << supersededMessages.superseded << " superseded file messages dropped (" << supersededMessages.bytesFreed << " bytes freed early)" << std::endl;
+		out << "\tHolding " << bytesHeld << " bytes of content (" << bytesInMemory << " in memory), " << spillArea.spilled << " messages spilled to disk ("
+			<< spillArea.bytesSpilled << " bytes), reading from the network paused " << backpressureWaits << " times" << std::endl;
+		auto cache = retransmissionCache.getStats();
+		out << "\tRetransmission cache: " << cache.frames << " messages (" << cache.bytes << " bytes), " << cache.evicted << " evicted (" << cache.bytesEvicted
+			<< " bytes), " << cache.oversized << " too large to cache, " << cache.hits << " resent, " << cache.misses << " not found" << std::endl;
+	}
+
+	// Function that checks if a type of message concerns a single file
+	static bool isFileMessage(Message::Type type) { return kindOf(type).route == MessageKind::Route::file; }
+
+	// Function that puts the messages for each file in a batch into timestamp order (the order of the messages for different files,
+	//	and of messages which aren't about a single file, is left alone)
+	static void orderByTimestamp(std::vector<AnyMessage>& batch) {
+		// Where in the batch each file's messages are
+		std::map<std::string, std::vector<size_t>> slots;
+		for(size_t i = 0; i < batch.size(); i++)
+			if(isFileMessage(batch[i]->type))
+				slots[batch[i].as<FileMessage>()->targetFile.native()].push_back(i);
+
+		for(auto& [_, indices]: slots) {
+			if(indices.size() < 2) continue;
+			std::vector<AnyMessage> messages;
+			for(auto i: indices) messages.emplace_back(std::move(batch[i]));
+			// NOTE: The sort is stable so messages with the same timestamp (such as the chunks of an initial sync) stay in the order they arrived
+			std::stable_sort(messages.begin(), messages.end(), [](auto& a, auto& b) {
+				return a.template as<FileMessage>()->timestamp < b.template as<FileMessage>()->timestamp;
+			});
+			for(size_t i = 0; i < indices.size(); i++)
+				batch[indices[i]] = std::move(messages[i]);
 		}
-		break; case Message::Type::linkLost: {
-			auto& m = reference_cast<Message>(*msgPtr);
-			if(useVerboseOutput) std::cout << "[" << m.originatorNode << "] link-lost message" << std::endl;
-			requeuePriority = processLinkLostMessage(m) ? -1 : resendPriority + 1;
+	}
+
+	// Function that hands a message to whatever processes it
+	void dispatchMessage(AnyMessage m) {
+		switch(kindOf(m->type).route) {
+		// Messages about a single file are applied by the worker responsible for the file
+		break; case MessageKind::Route::file: {
+			auto key = std::hash<std::string>{}(m.as<FileMessage>()->targetFile.native());
+			fileWorkers.submit(key, std::move(m));
 		}
-		break; default:
-			throw std::runtime_error("Unrecognized message type");
+		// Packs are split, so that each worker applies the files in the pack it is responsible for
+		break; case MessageKind::Route::pack:
+			submitPack(std::move(m));
+		// Messages which affect every file (or which need to see every file) wait for all of the file messages before them to be applied
+		break; case MessageKind::Route::barrier:
+			fileWorkers.wait();
+			applyMessage(std::move(m));
+		break; case MessageKind::Route::direct:
+			applyMessage(std::move(m));
 		}
-
-		// If the message was successful, move the message into the buffer of old messages
-		if(requeuePriority == -1)
-			oldMessages.emplace_back(std::move(msgPtr));
-		// Otherwise move it back into the queue
-		else
-			messageQueue->emplace(requeuePriority, std::move(msgPtr));
 	}
 
+	// Function that applies a message (safe to call from the file workers), releasing any messages it was holding up if it was successfully processed
+	//	or back into the queue if it needs to be processed later
+	void applyMessage(AnyMessage m);
+
+	// Function that determines the priority a type of message is processed with
+	static size_t priorityOf(Message::Type type) { return kindOf(type).priority; }
+
+	// Function that determines the priority a type of message is sent over the network with
+	// NOTE: Initial syncs are processed alongside locks, but they are bulk data, so on the wire they must not hold up locks
+	static size_t sendPriorityOf(Message::Type type) { return kindOf(type).sendPriority; }
+
 	// Function that checks to make sure we have finished connecting to the network
 	bool isFinishedConnecting() { return receivedInitialFiles == totalInitialFiles; }
 
+	// Function that checks if a lock (or anything more urgent) is waiting to be processed
+	//	(background jobs use this to yield to higher priority traffic)
+	bool hasPendingControlMessages() const { return messageQueue.hasPendingUpTo(lockPriority); }
+
 private:
 	// Only the singleton can be constructed
-	MessageManager() {}
+	MessageManager() {
+		messageQueue.setAgingLimit(lockPriority, lockAgingLimit);
+		messageQueue.setAgingLimit(filePriority, fileAgingLimit);
+		messageQueue.setAgingLimit(filePriority + 1, fileAgingLimit);
+		messageQueue.setAgingLimit(payloadPriority, payloadAgingLimit);
+		messageQueue.setAgingLimit(payloadPriority + 1, payloadAgingLimit);
+	}
 
-	// Validate the provided message, returns true if the hashes match, requests a resend and returns false otherwise
-	bool validateMessageHash(const Message& m, uint8_t offset = 0) const;
+	// Validate the provided message against the hash it should have, returns true if the hashes match, requests a resend and returns false otherwise
+	bool validateMessageHash(const Message& m, size_t expectedHash) const;
 
 
-	// Function that deserializes a message received from the network and adds it to the message queue
-	void deserializeMessage(const std::span<std::byte> data) const {
-		// Extract the type of message
-		Message::Type type = (Message::Type) uint8_t(data[0]);
-		// Copy the data into a deserialization buffer
-		std::stringstream backing({(char*) data.data(), data.size()});
-		cereal::BinaryInputArchive ar(backing);
-
-
-		// Deserialize the message as the same type of message that was delivered and add it to the message queue
-		switch(type) {
-		break; case Message::Type::payload: {
-			auto m = std::make_unique<PayloadMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m))
-				return;
-			// Payloads have a low priority
-			messageQueue->emplace(payloadPriority, std::move(m));
-		}
-		break; case Message::Type::resendRequest: {
-			auto m = std::make_unique<ResendRequestMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m))
-				return;
-			// Resend requests are processed before anything else
-			messageQueue->emplace(resendPriority, std::move(m));
-		}
-		break; case Message::Type::lock: {
-			auto m = std::make_unique<FileMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m, 1))
-				return;
-			// File messages have priority 5
-			messageQueue->emplace(lockPriority, std::move(m));
-		}
-		break; case Message::Type::unlock: {
-			auto m = std::make_unique<FileMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m, 1))
-				return;
-			// File messages have priority 5
-			messageQueue->emplace(lockPriority, std::move(m));
-		}
-		break; case Message::Type::deleteFile: {
-			auto m = std::make_unique<FileMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m, 1))
-				return;
-			// File messages have priority 5
-			messageQueue->emplace(filePriority, std::move(m));
-		}
-		break; case Message::Type::contentChange: {
-			auto m = std::make_unique<FileContentMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m, 1))
-				return;
-			// File messages have priority 5
-			messageQueue->emplace(filePriority, std::move(m));
-		}
-		break; case Message::Type::initialSync: {
-			auto m = std::make_unique<FileInitialSyncMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m, 1))
-				return;
-			// Syncs are executed before other file messages 4
-			messageQueue->emplace(lockPriority, std::move(m));
+	// Functions which manage the journal recording our progress through an initial sync (so that an interrupted sync can be resumed)
+	// NOTE: The journal is stored in the .wnts folder of the first managed folder, each line is either <+ hash "path"> marking a completed file
+	//	or <~ "path"> marking a file we have started receiving (its partial content is stored at partialFilePath(path))
+	std::filesystem::path syncJournalPath() const { return wntsPath(managedFolders().front()) / ".syncprogress"; }
+	// NOTE: Files are synced by several file workers at once, so appends to the journal are serialized
+	std::mutex syncJournalMutex;
+	//	(<hash> is the hash of a completed file's content, or the version of the source a started file is being received from)
+	void appendToSyncJournal(const std::filesystem::path& path, bool completed, size_t hash = 0);
+	void appendToSyncJournal(const std::vector<std::pair<std::filesystem::path, size_t>>& completedFiles);
+	void loadSyncJournal(std::map<std::filesystem::path, size_t>& completed, std::map<std::filesystem::path, size_t>& started) const;
+
+
+	// Function that removes any lock and partially synced files left in the .wnts folders by a previous run which didn't shut down cleanly
+	void removeStaleFiles();
+
+	// Function that gets the directory the content of waiting messages is spilled to (empty if we don't know which folders we are managing yet)
+	// NOTE: Called from the Peer threads, so it works from a copy of the folders
+	std::filesystem::path spillDirectory() const {
+		auto folders = managedFolders();
+		return folders.empty() ? std::filesystem::path{} : wntsPath(folders.front()) / ".spill";
+	}
+
+	// Function that charges a message's content against the content held by waiting messages (unless it has already been charged)
+	void charge(AnyMessage& m) {
+		if(m.heldBytes > 0) return;
+		m.heldBytes = m.contentSize();
+		bytesHeld += m.heldBytes;
+		bytesInMemory += m.heldBytes;
+	}
+
+	// Function that spills a message's content to disk if the content held in memory is over the memory budget (and the content is large enough to be worth it)
+	// NOTE: Content can't be spilled until we know which folders we are managing
+	void spillIfOverBudget(AnyMessage& m) {
+		if(m.heldBytes < spillThreshold || !m.spilledTo.empty() || bytesInMemory <= memoryBudget) return;
+		auto directory = spillDirectory();
+		if(directory.empty()) return;
+		if(spillArea.spill(m, directory)) {
+			bytesInMemory -= m.heldBytes;
+			notifyRoom();
 		}
-		break; case Message::Type::connect:{
-			auto m = std::make_unique<ConnectMessage>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m))
-				return;
-			// Connect has highest priority
-			messageQueue->emplace(connectPriority, std::move(m));
+	}
+
+	// Function that reads a message's content back into memory if it was spilled, returns false if it couldn't be read
+	bool pageIn(AnyMessage& m) {
+		if(m.spilledTo.empty()) return true;
+		bytesInMemory += m.heldBytes;
+		return spillArea.restore(m);
+	}
+
+	// Function that stops charging a message's content against the content held by waiting messages (once it has been applied or dropped)
+	void discharge(AnyMessage& m) {
+		if(!m.spilledTo.empty()) spillArea.discard(m);
+		else bytesInMemory -= m.heldBytes;
+		bytesHeld -= m.heldBytes;
+		m.heldBytes = 0;
+		notifyRoom();
+	}
+
+	// Function that wakes up any threads waiting for there to be room
+	void notifyRoom() {
+		if(producersWaiting > 0) {
+			{ std::scoped_lock lock(roomMutex); }
+			roomCV.notify_all();
 		}
-		break; case Message::Type::disconnect: {
-			auto m = std::make_unique<Message>();
-			ar(*m);
-
-			// Validate message hash
-			if(!validateMessageHash(*m))
-				return;
-			// Disconnect is processed after connect
-			messageQueue->emplace(disconnectPriority, std::move(m));
+	}
+
+	// Function that parks a message which couldn't be processed until the condition it is waiting on changes
+	//	(the message is moved back into the queue if the condition has already changed)
+	void parkMessage(size_t priority, AnyMessage message) {
+		// Parked messages may wait for a long time (such as an initial sync waiting for us to finish connecting), so they are spilled if memory is tight
+		spillIfOverBudget(message);
+		std::pair<size_t, AnyMessage> parked{priority, std::move(message)};
+		bool wasParked;
+		// Initial sync chunks wait for the chunks before them, everything else waits for us to finish connecting
+		if(parked.second->type == Message::Type::initialSync) {
+			auto& m = *parked.second.as<FileInitialSyncMessage>();
+			wasParked = parkedMessages.park({WaitCondition::earlierChunk, m.targetFile.native()}, parked, [&m] {
+				auto partialPath = partialFilePath(m.targetFile);
+				return (exists(partialPath) ? file_size(partialPath) : 0) < m.offset;
+			});
+		} else
+			wasParked = parkedMessages.park({WaitCondition::connected, {}}, parked, [this] { return !isFinishedConnecting(); });
+
+		if(!wasParked) enqueue(parked.first, std::move(parked.second));
+	}
+
+	// Function that moves any messages waiting on a condition a successfully processed message may have changed back into the queue
+	void releaseParkedMessages(const Message& m) {
+		auto requeue = [this](std::pair<size_t, AnyMessage>&& parked) { enqueue(parked.first, std::move(parked.second)); };
+		size_t released = 0;
+		if(m.type == Message::Type::initialSync)
+			released += parkedMessages.release({WaitCondition::earlierChunk, static_cast<const FileMessage&>(m).targetFile.native()}, requeue);
+		if(isFinishedConnecting() && parkedMessages.waiting({WaitCondition::connected, {}}))
+			released += parkedMessages.release({WaitCondition::connected, {}}, requeue);
+
+		if(useVerboseOutput && released) {
+			auto stats = parkedMessages.getStats();
+			std::cout << "Released " << released << " parked messages (" << stats.parked << " still parked, average wait " << stats.averageWait * 1000
+				<< "ms, longest wait " << stats.longestWait * 1000 << "ms)" << std::endl;
 		}
-		break; default:
-			throw std::runtime_error("Unrecognized message type");
+	}
+
+	// Function that splits a pack into a pack for each of the file workers, and hands each of them their part
+	void submitPack(AnyMessage m) {
+		if(!pageIn(m)) {
+			std::cerr << "Failed to read the spilled content of a pack, dropping it" << std::endl;
+			discharge(m);
+			return;
 		}
+		auto& pack = *m.as<FilePackMessage>();
+		std::vector<std::optional<FilePackMessage>> parts(fileWorkers.size());
+		pack.forEach([&](const FilePackMessage::Entry& entry, std::string_view content) {
+			auto key = std::hash<std::string>{}(entry.targetFile.native());
+			auto& part = parts[key % parts.size()];
+			if(!part) {
+				part.emplace();
+				reference_cast<Message>(*part) = pack;
+				part->total = pack.total;
+				// NOTE: A part doesn't match the original pack's hash, so it must never be found (and resent) in place of the original pack
+				part->messageHash = 0;
+			}
+			part->add(entry.targetFile, entry.timestamp, content);
+		});
+
+		// NOTE: Workers are chosen by key modulo the number of workers, so the index of each part is its key
+		// NOTE: The parts are charged for the content they hold, instead of the original pack
+		discharge(m);
+		for(size_t i = 0; i < parts.size(); i++)
+			if(parts[i]) {
+				AnyMessage part = std::move(*parts[i]);
+				charge(part);
+				fileWorkers.submit(i, std::move(part));
+			}
+	}
+
+	// Function that blocks until a message is queued, wake is called, or <timeout> passes
+	void waitForWork(std::chrono::steady_clock::duration timeout) {
+		std::unique_lock lock(wakeMutex);
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		wakeCV.wait_for(lock, timeout, [this] { return wakeRequested || !messageQueue.empty(); });
+		sleeping.store(false, std::memory_order_relaxed);
+		wakeRequested = false;
 	}
 
+
+	// Function that deserializes a message received from the network and adds it to the message queue
+	//	The frame is kept in the retransmission cache (if the message arrived intact), so it can be resent without being serialized again
+	void deserializeMessage(RetransmissionCache::Frame frame);
+
 	// Functions that process individual types of messages
 	// NOTE: They all return true if the message was successfully processed and false if the message needs to be readded to the queue for later processing
+	bool processPayloadMessage(const PayloadMessage& m);
 	bool processResendRequestMessage(const ResendRequestMessage& m);
 	bool processLockMessage(const FileMessage& m);
 	bool processUnlockMessage(const FileMessage& m);
 	bool processDeleteFileMessage(const FileMessage& m);
 	bool processContentFileMessage(const FileContentMessage& m);
+	// Function that writes new content to a file (respecting any locks on the file)
+	//	If <extents> isn't empty, the file is written sparsely (see readSparseRange), the file is always <fileSize> bytes long afterwards
+	void applyFileContent(const std::filesystem::path& targetFile, const zt::IpAddress& originatorNode, std::string_view content, const std::vector<std::pair<uint64_t, uint64_t>>& extents = {}, uint64_t fileSize = 0);
 	bool processInitialFileSyncMessage(const FileInitialSyncMessage& m);
-	bool processInitialFileSyncRequestMessage(const Message& m);
+	bool processInitialFileSyncRequestMessage(const InitialSyncRequestMessage& m);
+	bool processFilePackMessage(const FilePackMessage& m);
+	bool processInitialSyncPackMessage(const FilePackMessage& m);
 	bool processConnectMessage(const ConnectMessage& m);
 	bool processLinkLostMessage(const Message& m);
 	bool processDisconnectMessage(const Message& m);
+
+	// Workers which apply file messages, each file is assigned to a single worker (so messages for the same file are applied in order,
+	//	while messages for different files are applied in parallel)
+	// NOTE: Declared last, so the workers are stopped before anything they use is destroyed
+	ShardedWorkers<AnyMessage> fileWorkers{[this](AnyMessage&& m) { applyMessage(std::move(m)); }};
 };
 
 #endif // __MESSAGE_QUEUE_HPP__
\ No newline at end of file
@@ -14,6 +14,9 @@
 #include <cereal/types/string.hpp>
 #include <cereal/archives/binary.hpp>
 #include <filesystem>
+#include <string_view>
+#include <utility>
+#include <variant>
 
 #include "networking_include_everywhere.hpp"
 
@@ -72,7 +75,7 @@ namespace cereal {
 // Base message class; includes type, routing, and error checking information
 struct Message {
 	// Action flag must be enumerator.
-	enum Type : uint8_t {invalid = 0, lock, unlock, deleteFile, contentChange, initialSync, initialSyncRequest, connect, disconnect, payload, resendRequest, linkLost} type;
+	enum Type : uint8_t {invalid = 0, lock, unlock, deleteFile, contentChange, initialSync, initialSyncRequest, connect, disconnect, payload, resendRequest, linkLost, filePack, initialSyncPack} type;
 	// IP of the destination (may be unspecified to broadcast) node
 	zt::IpAddress receiverNode;
 	// IP of the source of the previous hop.
@@ -88,11 +91,14 @@ struct Message {
 		ar (reference_cast<uint8_t>(type), receiverNode, originatorNode, messageHash);
 	}
 
-	// Function that converts the message into a size_t for validation
-	size_t hash() const { return ::hash(hashString()); }
-protected:
-	// Virtual function that compiles all the information about a message into a single string that can be "hash"ed
-	virtual std::string hashString() const {
+	// Function that converts a message into a size_t for validation
+	// NOTE: Takes the message as its real type (hashString isn't virtual), so messages don't need a vtable and are hashed without any virtual calls
+	template<typename M>
+	static size_t hash(const M& m) { return ::hash(m.hashString()); }
+
+	// Function that compiles all the information about a message into a single string that can be "hash"ed
+	// NOTE: Every type of message hides this function with its own version, which builds on its base's version
+	std::string hashString() const {
 		return std::to_string((int)type)
 			+ receiverNode.toString()
 			+ originatorNode.toString();
@@ -111,8 +117,7 @@ struct PayloadMessage : Message {
 		ar (reference_cast<Message>(*this), payload);
 	}
 
-protected:
-	std::string hashString() const override { return Message::hashString() + payload; }
+	std::string hashString() const { return Message::hashString() + payload; }
 };
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( PayloadMessage, cereal::specialization::member_serialize );
 
@@ -128,8 +133,7 @@ struct ResendRequestMessage : Message {
 		ar (reference_cast<Message>(*this), requestedHash, originalDestination);
 	}
 
-protected:
-	std::string hashString() const override { return Message::hashString() + std::to_string(requestedHash) + originalDestination.toString(); }
+	std::string hashString() const { return Message::hashString() + std::to_string(requestedHash) + originalDestination.toString(); }
 };
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( ResendRequestMessage, cereal::specialization::member_serialize );
 
@@ -161,8 +165,7 @@ struct FileMessage : Message {
 		timestamp = std::chrono::system_clock::from_time_t(tm);
     }
 
-protected:
-	std::string hashString() const override {
+	std::string hashString() const {
 		auto time_t = to_time_t(timestamp);
 		return Message::hashString()
 			+ targetFile.string()
@@ -172,38 +175,154 @@ protected:
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( FileMessage, cereal::specialization::member_load_save );
 
 // File content message containing the contents of the file as a payload
+// NOTE: If the file is sparse, only the regions containing data are sent, <extents> records where each region belongs (everything else is a hole)
 struct FileContentMessage : FileMessage {
 	//File content created.
 	std::string fileContent;
+	// List of (offset, length) regions of the file which <fileContent> fills, if empty <fileContent> is the whole file
+	std::vector<std::pair<uint64_t, uint64_t>> extents;
+	// Size of the complete file (including any holes)
+	uint64_t fileSize = 0;
 
 	template <typename Archive>
 	void serialize(Archive& ar) {
-		ar (reference_cast<FileMessage>(*this), fileContent);
+		ar (reference_cast<FileMessage>(*this), fileContent, extents, fileSize);
 	}
 
-protected:
-	std::string hashString() const override { return FileMessage::hashString() + fileContent; }
+	std::string hashString() const {
+		std::string hash = FileMessage::hashString() + fileContent + std::to_string(fileSize);
+		for(auto& [offset, length]: extents)
+			hash += std::to_string(offset) + std::to_string(length);
+		return hash;
+	}
 };
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( FileContentMessage, cereal::specialization::member_serialize );
 
 
 // File initial sync message, a content message with additional information indicating how many files need to be received before our state is synced with the network
+// NOTE: Large files are split across several messages, each message covers <length> bytes starting at <offset> in a file that is <fileSize> bytes long
+// NOTE: A message with an empty target file indicates that there are no files which need to be synced
 struct FileInitialSyncMessage: FileContentMessage {
 	// Variable tracking the total number of files to be synced
 	size_t total,
 	// Variable tracking which index we are
 		index;
+	// Variable tracking where in the file this message's content belongs
+	size_t offset = 0,
+	// Variable tracking how many bytes of the file this message covers (including any holes)
+		length = 0;
+	// Variables tracking the version (see fileVersion) and hash of the whole file being sent, so the receiver can tell if the chunks it has still belong together
+	size_t sourceVersion = 0, fileHash = 0;
 
 	template <typename Archive>
 	void serialize(Archive& ar) {
-		ar (reference_cast<FileContentMessage>(*this), total, index);
+		ar (reference_cast<FileContentMessage>(*this), total, index, offset, length, sourceVersion, fileHash);
 	}
 
-protected:
-	std::string hashString() const override { return FileContentMessage::hashString() + std::to_string(total) + std::to_string(index); }
+	std::string hashString() const { return FileContentMessage::hashString() + std::to_string(total) + std::to_string(index) + std::to_string(offset) + std::to_string(length)
+		+ std::to_string(sourceVersion) + std::to_string(fileHash); }
 };
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( FileInitialSyncMessage, cereal::specialization::member_serialize );
 
+// Message bundling the content of many small files into a single message (avoiding the per message overhead in trees with lots of small files)
+//	The content of the files is stored back to back in <content>, in the same order as the files in the index
+// NOTE: Used as both a content change (filePack) and an initial sync (initialSyncPack) message
+struct FilePackMessage : Message {
+	// Maximum amount of content that will be packed into a single message (1MB)
+	static constexpr size_t budget = 1024 * 1024;
+	// Largest file that will be packed (larger files are sent in their own messages, 64KB)
+	static constexpr size_t maxFileSize = 64 * 1024;
+
+	// Entry in the pack's index, describing one of the files
+	struct Entry {
+		std::filesystem::path targetFile;
+		std::chrono::system_clock::time_point timestamp;
+		// Number of bytes of <content> which belong to this file
+		size_t size;
+
+		template<class Archive>
+		void save(Archive& ar) const { ar (targetFile, std::chrono::system_clock::to_time_t(timestamp), size); }
+		template<class Archive>
+		void load(Archive& ar) {
+			time_t tm;
+			ar (targetFile, tm, size);
+			timestamp = std::chrono::system_clock::from_time_t(tm);
+		}
+	};
+
+	// Index of the files in the pack
+	std::vector<Entry> files;
+	// Content of every file in the pack
+	std::string content;
+	// Variable tracking the total number of files to be synced (only used by initial sync packs)
+	size_t total = 0;
+
+	template <typename Archive>
+	void serialize(Archive& ar) {
+		ar (reference_cast<Message>(*this), files, content, total);
+	}
+
+	// Function which adds a file to the pack
+	void add(const std::filesystem::path& targetFile, std::chrono::system_clock::time_point timestamp, std::string_view fileContent) {
+		files.push_back({targetFile, timestamp, fileContent.size()});
+		content += fileContent;
+	}
+
+	// Function which checks if a file of the given size would fit in the pack
+	bool fits(size_t size) const { return files.empty() || content.size() + size <= budget; }
+
+	// Function which calls <callback> with every file's index entry and content
+	template<typename F>
+	void forEach(F callback) const {
+		size_t offset = 0;
+		for(auto& entry: files) {
+			callback(entry, std::string_view(content).substr(offset, entry.size));
+			offset += entry.size;
+		}
+	}
+
+	std::string hashString() const {
+		std::string hash = Message::hashString();
+		for(auto& entry: files)
+			hash += entry.targetFile.string() + std::to_string(entry.size);
+		return hash + content + std::to_string(total);
+	}
+};
+CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( FilePackMessage, cereal::specialization::member_serialize );
+
+// Message requesting that a gateway send us all of the files we don't already have
+//	Includes the files we finished receiving during previous syncs (and their hashes), and the files we only partially received (and how much we received)
+struct InitialSyncRequestMessage : Message {
+	// List of files we already have, and the hashes of their content
+	std::vector<std::pair<std::filesystem::path, size_t>> completedFiles;
+	// A file we have partially received, how many bytes of it we have, and the version of the source we were receiving it from
+	//	(if the source has changed since, the bytes we have are no longer a prefix of it and it needs to be sent from the start)
+	struct PartialFile {
+		std::filesystem::path path;
+		size_t offset, sourceVersion;
+
+		template <typename Archive>
+		void serialize(Archive& ar) { ar (path, offset, sourceVersion); }
+	};
+	// List of files we have partially received
+	std::vector<PartialFile> partialFiles;
+
+	template <typename Archive>
+	void serialize(Archive& ar) {
+		ar (reference_cast<Message>(*this), completedFiles, partialFiles);
+	}
+
+	std::string hashString() const {
+		std::string hash = Message::hashString();
+		for(auto& [path, fileHash]: completedFiles)
+			hash += path.string() + std::to_string(fileHash);
+		for(auto& file: partialFiles)
+			hash += file.path.string() + std::to_string(file.offset) + std::to_string(file.sourceVersion);
+		return hash;
+	}
+};
+CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( InitialSyncRequestMessage, cereal::specialization::member_serialize );
+
 // Message providing extra information needed when we connect: backup gateway ips and the paths we should be sweeping
 struct ConnectMessage : Message {
 	// List containing backup IPs
@@ -217,7 +336,7 @@ struct ConnectMessage : Message {
 		ar (reference_cast<Message>(*this), backupPeers, managedPaths);
 	}
 
-	std::string hashString() const override {
+	std::string hashString() const {
 		std::string hash = Message::hashString();
 		for(auto& [ip, port]: backupPeers)
 			hash += ip.toString() + std::to_string(port);
@@ -228,4 +347,60 @@ struct ConnectMessage : Message {
 };
 CEREAL_SPECIALIZE_FOR_ALL_ARCHIVES( ConnectMessage, cereal::specialization::member_serialize );
 
+// Any type of message, stored inline (so a queue or buffer of messages doesn't need a separate allocation for every message)
+// NOTE: Several types of message share a class (a lock is a FileMessage, a disconnect is a Message, etc), the class a type is stored as is
+//	determined by the message manager's registry of message types
+struct AnyMessage {
+	// The message (or nothing)
+	std::variant<std::monostate, Message, PayloadMessage, ResendRequestMessage, FileMessage, FileContentMessage, FileInitialSyncMessage,
+		FilePackMessage, InitialSyncRequestMessage, ConnectMessage> value;
+	// Bytes of content charged against the memory held by waiting messages (see MessageManager::charge), and where the content
+	//	has been spilled to disk (empty if the content is in memory, see SpillArea)
+	// NOTE: Neither is ever sent over the network
+	size_t heldBytes = 0;
+	std::filesystem::path spilledTo;
+
+	AnyMessage() = default;
+	template<typename M, typename = std::enable_if_t<std::is_base_of_v<Message, std::decay_t<M>>>>
+	AnyMessage(M&& m) : value(std::in_place_type<std::decay_t<M>>, std::forward<M>(m)) {}
+
+	// Function which gets the message as <Base>, returns null if the message isn't a <Base> (or derived from one)
+	template<typename Base>
+	Base* as() { return std::visit([](auto& m) -> Base* { return cast<Base>(m); }, value); }
+	template<typename Base>
+	const Base* as() const { return std::visit([](auto& m) -> const Base* { return cast<Base>(m); }, value); }
+
+	// Access to the common parts of every message
+	Message* operator->() { return as<Message>(); }
+	const Message* operator->() const { return as<Message>(); }
+	Message& operator*() { return *as<Message>(); }
+	const Message& operator*() const { return *as<Message>(); }
+
+	// Function which checks if there is a message
+	explicit operator bool() const { return value.index() != 0; }
+	// Function which gets the file content the message carries (null if it doesn't carry any)
+	const std::string* content() const {
+		if(auto m = as<FileContentMessage>()) return &m->fileContent;
+		if(auto m = as<FilePackMessage>()) return &m->content;
+		return nullptr;
+	}
+	std::string* content() { return const_cast<std::string*>(std::as_const(*this).content()); }
+	// Function which gets how many bytes of file content the message carries
+	size_t contentSize() const {
+		auto content = this->content();
+		return content ? content->size() : 0;
+	}
+	// A message is only equal to itself (buffers of messages compare their elements to check if they are the same buffer, comparing content would be far too slow)
+	bool operator==(const AnyMessage& other) const { return this == &other; }
+
+protected:
+	// Function which converts a reference to the stored value into a pointer to <Base> (or null if it isn't a <Base>)
+	template<typename Base, typename M>
+	static auto cast(M& m) {
+		using Out = std::conditional_t<std::is_const_v<M>, const Base*, Base*>;
+		if constexpr(std::is_base_of_v<Base, std::remove_const_t<M>>) return Out(&m);
+		else return Out(nullptr);
+	}
+};
+
 #endif // __MESSAGES_HPP__
\ No newline at end of file
@@ -0,0 +1,441 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a function which walks the managed folders using several threads at once
+*/
+
+#ifndef __PARALLEL_WALK_HPP__
+#define __PARALLEL_WALK_HPP__
+
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <jthread.hpp>
+#include <boost/predef.h>
+
+#if BOOST_OS_LINUX
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <sys/syscall.h>
+	#include <cerrno>
+#endif
+
+#include "include_everywhere.hpp"
+#include "ignore_rules.hpp"
+
+// A file found by a walk, and the metadata we need about it
+struct WalkEntry {
+	std::filesystem::path path;
+	std::filesystem::file_time_type timestamp;
+	uint64_t size = 0;
+	// False if the file is in a directory which hasn't changed and wasn't sampled (the timestamp and size weren't fetched)
+	bool stated = true;
+};
+
+// Cache of the contents of every directory seen by previous walks, so that directories which haven't changed since they were last read don't need to be read again
+// A directory's modification time changes whenever a file is created, deleted, or renamed in it, so an unchanged directory still has the same files
+//	(though those files' content may have changed, so a rotating sample of the files in unchanged directories is still checked each walk)
+struct DirectoryCache {
+	// The number of walks it takes for every file in an unchanged directory to be checked
+	static constexpr size_t sampleRounds = 8;
+
+	// What we know about a directory
+	struct Directory {
+		// The directory's modification time, and when we read it
+		std::filesystem::file_time_type timestamp, listedAt;
+		// The names of the files and subdirectories in the directory
+		std::vector<std::string> files, directories;
+		// The last walk which visited the directory (0 if it has never been read)
+		size_t generation = 0;
+	};
+
+	// Statistics about the most recent walk
+	std::atomic<size_t> listedDirectories = 0, prunedDirectories = 0, skippedFiles = 0;
+
+protected:
+	friend struct ParallelWalker;
+	std::mutex mutex;
+	std::unordered_map<std::string, Directory> directories;
+	size_t generation = 0;
+	// The generation of the ignore rules the cached directory contents were filtered with
+	size_t rulesGeneration = 0;
+
+	// Function which finds (or creates) the cache entry for a directory
+	// NOTE: Entries are never moved (unordered_map nodes are stable), and each directory is only visited by a single thread, so the returned entry can be used without the lock
+	Directory& find(const std::filesystem::path& directory) {
+		std::scoped_lock lock(mutex);
+		return directories[directory.native()];
+	}
+};
+
+#if BOOST_OS_LINUX
+// Function that converts a timestamp returned by stat into a filesystem timestamp
+// NOTE: C++17 has no exact conversion, so the offset between the clocks is measured once (the clocks' epochs differ by a whole number of seconds,
+//	so rounding the measurement gives the same offset every run, which lets timestamps be saved and compared across restarts)
+inline std::filesystem::file_time_type toFileTime(const struct timespec& time) {
+	static const auto offset = std::chrono::duration_cast<std::filesystem::file_time_type::duration>(std::chrono::round<std::chrono::seconds>(
+		std::filesystem::file_time_type::clock::now().time_since_epoch()
+		- std::chrono::duration_cast<std::filesystem::file_time_type::duration>(std::chrono::system_clock::now().time_since_epoch())));
+	return std::filesystem::file_time_type(std::chrono::duration_cast<std::filesystem::file_time_type::duration>(std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec)) + offset);
+}
+#endif
+
+// Function that determines the last write time and size of a file (following symlinks), returns false if the file doesn't exist or is a directory
+inline bool statFile(const std::filesystem::path& path, std::filesystem::file_time_type& timestamp, uint64_t& size) {
+#if BOOST_OS_LINUX
+	struct stat info;
+	if(::stat(path.c_str(), &info) != 0 || S_ISDIR(info.st_mode)) return false;
+	timestamp = toFileTime(info.st_mtim);
+	size = info.st_size;
+	return true;
+#else
+	std::error_code ec;
+	if(is_directory(path, ec)) return false;
+	timestamp = last_write_time(path, ec);
+	if(ec) return false;
+	size = file_size(path, ec);
+	return !ec;
+#endif
+}
+
+// Class which walks a set of folders (skipping anything the ignore rules exclude, without ever reading ignored directories) using a pool of threads, each directory that is found is a task,
+//	threads take tasks from the back of their own deque and steal from the front of other threads' deques when they run out
+// On Linux directories are read in large batches (getdents64) and each file's metadata is fetched relative to its directory (statx)
+struct ParallelWalker {
+	// Function that determines how many threads a walk should use by default (upto 8, depending on the hardware)
+	static size_t defaultThreadCount() {
+		return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+	}
+
+	// Function which walks the provided folders, returning every file that was found
+	//	If a cache is provided, directories which haven't changed since the previous walk aren't read
+	//	If <unscanned> is provided, it is filled with every directory which exists but couldn't be read (nothing under them was found,
+	//		so the files under them must not be mistaken for deleted files)
+	//	If <lowPriority> is true, the walk's disk accesses are given idle priority (so the walk doesn't slow down other programs using the disk)
+	static std::vector<WalkEntry> walk(const std::vector<std::filesystem::path>& folders, DirectoryCache* cache = nullptr, std::vector<std::filesystem::path>* unscanned = nullptr,
+		bool lowPriority = false, size_t threadCount = defaultThreadCount()) {
+		ParallelWalker walker(threadCount);
+		walker.cache = cache;
+		if(cache) {
+			cache->generation++;
+			cache->listedDirectories = cache->prunedDirectories = cache->skippedFiles = 0;
+			// If the ignore rules have changed, the cached directory contents were filtered with the wrong rules
+			if(cache->rulesGeneration != IgnoreRules::singleton().getGeneration()) {
+				cache->directories.clear();
+				cache->rulesGeneration = IgnoreRules::singleton().getGeneration();
+			}
+		}
+		for(size_t i = 0; i < folders.size(); i++) {
+			auto position = IgnoreRules::singleton().positionOf(folders[i]);
+			if(!position.matcher) continue; // The folder itself is ignored
+			walker.push(i % threadCount, {folders[i], position.matcher.get(), position.state});
+			walker.matchers.emplace_back(std::move(position.matcher));
+		}
+
+		{
+			std::vector<std::jthread> threads;
+			for(size_t i = 1; i < threadCount; i++)
+				threads.emplace_back([&walker, i, lowPriority] {
+					if(lowPriority) setIOPriority(idleIOPriority);
+					walker.threadFunction(i);
+				});
+			// This thread does its share of the work too (at the same priority as the other threads)
+			int previousPriority = lowPriority ? setIOPriority(idleIOPriority) : -1;
+			walker.threadFunction(0);
+			if(previousPriority >= 0) setIOPriority(previousPriority);
+		} // Threads join here
+
+		// Forget about any directories which no longer exist (weren't visited by this walk)
+		if(cache) {
+			for(auto i = cache->directories.begin(); i != cache->directories.end(); )
+				if(i->second.generation != cache->generation)
+					i = cache->directories.erase(i);
+				else i++;
+		}
+
+		// Merge each thread's results
+		if(unscanned)
+			for(auto& worker: walker.workers)
+				std::move(worker.unscanned.begin(), worker.unscanned.end(), std::back_inserter(*unscanned));
+		size_t total = 0;
+		for(auto& worker: walker.workers) total += worker.results.size();
+		std::vector<WalkEntry> out;
+		out.reserve(total);
+		for(auto& worker: walker.workers)
+			std::move(worker.results.begin(), worker.results.end(), std::back_inserter(out));
+		return out;
+	}
+
+	// The I/O priority which only accesses the disk when nothing else is using it
+	static constexpr int idleIOPriority = 3 << 13; // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+
+	// Function which sets the I/O priority of the calling thread, returning its previous priority (-1 if I/O priorities aren't supported)
+	static int setIOPriority(int priority) {
+#if BOOST_OS_LINUX && defined(SYS_ioprio_set)
+		constexpr int whoProcess = 1; // IOPRIO_WHO_PROCESS (with an ID of 0 refers to the calling thread)
+		int previous = ::syscall(SYS_ioprio_get, whoProcess, 0);
+		if(previous < 0 || ::syscall(SYS_ioprio_set, whoProcess, 0, priority) < 0) return -1;
+		return previous;
+#else
+		return -1;
+#endif
+	}
+
+protected:
+	// A directory waiting to be read, and where it is in the ignore rules' automaton
+	struct Task {
+		std::filesystem::path directory;
+		const IgnoreMatcher* matcher;
+		IgnoreMatcher::State state;
+	};
+
+	// The state owned by each thread
+	struct Worker {
+		// Directories waiting to be read (guarded by the mutex so that other threads can steal them)
+		std::mutex mutex;
+		std::deque<Task> directories;
+		// The files this thread has found, and the directories it couldn't read
+		std::vector<WalkEntry> results;
+		std::vector<std::filesystem::path> unscanned;
+	};
+	std::vector<Worker> workers;
+	// The number of directories which have been found but not finished (once this reaches zero the walk is over), and how many of them are waiting in a deque
+	std::atomic<size_t> pending = 0, queued = 0;
+	// Used to make threads with nothing to do wait until a directory is queued (or the walk is over), and how many threads are waiting
+	std::mutex idleMutex;
+	std::condition_variable idleCV;
+	std::atomic<size_t> idle = 0;
+	// Cache of the directories seen by previous walks (may be null)
+	DirectoryCache* cache = nullptr;
+	// The ignore rules of the folders being walked (kept alive until the walk is finished)
+	std::vector<std::shared_ptr<const IgnoreMatcher>> matchers;
+
+	ParallelWalker(size_t threadCount) : workers(threadCount) {}
+
+	// Function which adds a directory to a thread's deque
+	void push(size_t worker, Task&& task) {
+		pending++;
+		{
+			std::scoped_lock lock(workers[worker].mutex);
+			workers[worker].directories.emplace_back(std::move(task));
+		}
+		queued++;
+		// Wake a waiting thread to take the directory
+		if(idle > 0) {
+			{ std::scoped_lock lock(idleMutex); }
+			idleCV.notify_one();
+		}
+	}
+
+	// Function which checks if a file or directory in a directory is ignored, and queues the directory to be read if it isn't
+	//	Returns true if the file or directory should be included
+	bool include(size_t worker, const Task& parent, std::string_view name, bool directory) {
+		bool ignored;
+		auto state = parent.matcher->enter(parent.state, name, directory, ignored);
+		if(ignored) return false;
+		if(directory) push(worker, {parent.directory / name, parent.matcher, state});
+		return true;
+	}
+
+	// Function which takes a directory from the thread's own deque, or steals one from another thread
+	bool pop(size_t worker, Task& out) {
+		for(size_t i = 0; i < workers.size(); i++) {
+			auto& victim = workers[(worker + i) % workers.size()];
+			std::scoped_lock lock(victim.mutex);
+			if(victim.directories.empty()) continue;
+			// Take our own work depth first (from the back), steal breadth first (from the front) since those directories are likely to be larger
+			if(i == 0) {
+				out = std::move(victim.directories.back());
+				victim.directories.pop_back();
+			} else {
+				out = std::move(victim.directories.front());
+				victim.directories.pop_front();
+			}
+			queued--;
+			return true;
+		}
+		return false;
+	}
+
+	// Function run by each thread, reads directories until there are none left anywhere
+	void threadFunction(size_t worker) {
+		Task task;
+		while(pending > 0) {
+			// If there is nothing to take, wait until a directory is queued (or every directory has been read)
+			if(!pop(worker, task)) {
+				std::unique_lock lock(idleMutex);
+				idle++;
+				idleCV.wait(lock, [this] { return pending == 0 || queued > 0; });
+				idle--;
+				continue;
+			}
+			readDirectory(worker, task);
+
+			// If that was the last directory, wake every waiting thread so they can finish
+			if(--pending == 0) {
+				{ std::scoped_lock lock(idleMutex); }
+				idleCV.notify_all();
+			}
+		}
+	}
+
+	// Function which reads a single directory, recording its files and queueing its subdirectories
+	//	If the directory exists but can't be read, it is recorded as unscanned (along with everything under it)
+	void readDirectory(size_t worker, const Task& task) {
+		auto& results = workers[worker].results;
+		auto& directory = task.directory;
+#if BOOST_OS_LINUX
+		int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(fd < 0) {
+			// NOTE: A directory which was removed before we got to it really is gone (along with its files)
+			if(errno != ENOENT && errno != ENOTDIR)
+				workers[worker].unscanned.push_back(directory);
+			return;
+		}
+
+		// If the directory hasn't changed since we last read it, use the cached list of its contents
+		DirectoryCache::Directory* cached = nullptr;
+		auto listedAt = std::filesystem::file_time_type::clock::now();
+		if(cache) {
+			struct stat info;
+			cached = &cache->find(directory);
+			if(::fstat(fd, &info) == 0) {
+				auto timestamp = toFileTime(info.st_mtim);
+				// NOTE: A directory modified within a couple seconds of when we read it might have changed again without its timestamp changing, so it is always read again
+				if(cached->generation > 0 && cached->timestamp == timestamp && timestamp + 2s < cached->listedAt) {
+					readCachedDirectory(worker, task, fd, *cached);
+					::close(fd);
+					return;
+				}
+				cached->timestamp = timestamp;
+			}
+			cached->files.clear();
+			cached->directories.clear();
+			cache->listedDirectories++;
+		}
+
+		alignas(8) char buffer[32 * 1024];
+		bool failed = false;
+		while(true) {
+			long length = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+			if(length < 0) failed = errno != ENOENT;
+			if(length <= 0) break;
+
+			for(long offset = 0; offset < length; ) {
+				// Layout of the entries returned by getdents64
+				struct linux_dirent64 { ino64_t d_ino; off64_t d_off; unsigned short d_reclen; unsigned char d_type; char d_name[]; };
+				auto& entry = *(linux_dirent64*) (buffer + offset);
+				offset += entry.d_reclen;
+
+				std::string_view name = entry.d_name;
+				if(name == "." || name == "..") continue;
+
+				// Symlinks are followed to files (but not to directories), if the filesystem doesn't tell us the type we need to check
+				unsigned char type = entry.d_type;
+				Stat info;
+				if(type == DT_UNKNOWN) {
+					if(!statAt(fd, entry.d_name, /*follow*/ false, info)) continue;
+					type = S_ISDIR(info.mode) ? DT_DIR : S_ISLNK(info.mode) ? DT_LNK : DT_REG;
+				}
+
+				if(type == DT_DIR) {
+					if(include(worker, task, name, /*directory*/ true) && cached)
+						cached->directories.emplace_back(name);
+					continue;
+				}
+				// NOTE: Ignored files are never stat'ed
+				if(!include(worker, task, name, /*directory*/ false)) continue;
+				if(!statAt(fd, entry.d_name, /*follow*/ true, info) || S_ISDIR(info.mode)) continue;
+				results.push_back({directory / name, info.timestamp, info.size});
+				if(cached) cached->files.emplace_back(name);
+			}
+		}
+		::close(fd);
+
+		// If the directory couldn't be read completely, we don't know what is in it (and its partial contents aren't cached)
+		if(failed) {
+			workers[worker].unscanned.push_back(directory);
+			if(cached) cached->generation = 0;
+		} else if(cached) {
+			cached->listedAt = listedAt;
+			cached->generation = cache->generation;
+		}
+#else
+		std::error_code ec;
+		for(std::filesystem::directory_iterator i(directory, ec), end; !ec && i != end; i.increment(ec)) {
+			auto name = i->path().filename().string();
+			if(i->is_directory(ec)) {
+				if(!i->is_symlink(ec)) include(worker, task, name, /*directory*/ true);
+				continue;
+			}
+			if(!include(worker, task, name, /*directory*/ false)) continue;
+			WalkEntry entry{i->path()};
+			if(statFile(entry.path, entry.timestamp, entry.size))
+				results.emplace_back(std::move(entry));
+		}
+		if(ec && ec != std::errc::no_such_file_or_directory && ec != std::errc::not_a_directory)
+			workers[worker].unscanned.push_back(directory);
+#endif
+	}
+
+#if BOOST_OS_LINUX
+	// Function which reports the contents of a directory which hasn't changed from the cache, only a rotating sample of its files are checked for modifications
+	// NOTE: The cached contents have already been filtered by the ignore rules
+	void readCachedDirectory(size_t worker, const Task& task, int fd, DirectoryCache::Directory& cached) {
+		auto& results = workers[worker].results;
+		auto& directory = task.directory;
+		cached.generation = cache->generation;
+		cache->prunedDirectories++;
+
+		for(auto& name: cached.directories)
+			include(worker, task, name, /*directory*/ true);
+
+		for(size_t i = 0; i < cached.files.size(); i++) {
+			auto& name = cached.files[i];
+			Stat info;
+			if((i + cache->generation) % DirectoryCache::sampleRounds == 0) {
+				if(statAt(fd, name.c_str(), /*follow*/ true, info) && !S_ISDIR(info.mode))
+					results.push_back({directory / name, info.timestamp, info.size});
+			} else {
+				results.push_back({directory / name, {}, 0, /*stated*/ false});
+				cache->skippedFiles++;
+			}
+		}
+	}
+
+	// The metadata fetched about each file
+	struct Stat {
+		mode_t mode;
+		std::filesystem::file_time_type timestamp;
+		uint64_t size;
+	};
+
+	// Function which fetches the metadata of a file relative to a directory (using statx when available, so that only the fields we need are fetched)
+	static bool statAt(int directory, const char* name, bool follow, Stat& out) {
+	#ifdef STATX_MTIME
+		struct statx info;
+		if(::statx(directory, name, (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_MTIME | STATX_SIZE, &info) != 0)
+			return false;
+		out.mode = info.stx_mode;
+		out.timestamp = toFileTime({(time_t) info.stx_mtime.tv_sec, (long) info.stx_mtime.tv_nsec});
+		out.size = info.stx_size;
+	#else
+		struct stat info;
+		if(::fstatat(directory, name, &info, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+			return false;
+		out.mode = info.st_mode;
+		out.timestamp = toFileTime(info.st_mtim);
+		out.size = info.st_size;
+	#endif
+		return true;
+	}
+#endif
+};
+
+#endif // __PARALLEL_WALK_HPP__
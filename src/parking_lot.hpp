@@ -0,0 +1,98 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which holds onto work that can't be done until some condition changes
+*/
+
+#ifndef __PARKING_LOT_HPP__
+#define __PARKING_LOT_HPP__
+
+#include <deque>
+#include <map>
+#include <mutex>
+
+#include "include_everywhere.hpp"
+
+// Class which holds values (such as messages which can't be processed yet) grouped by the condition they are waiting on,
+//	so that they are left alone until the condition changes instead of being retried over and over
+// Values waiting on the same condition are released in the order they were parked
+template<typename Key, typename T>
+struct ParkingLot {
+	using Clock = std::chrono::steady_clock;
+
+	// Statistics about the values which have been parked
+	struct Stats {
+		// Number of values currently parked, ever parked, and released
+		size_t parked = 0, totalParked = 0, totalReleased = 0;
+		// Average and longest time (in seconds) a released value was parked for
+		double averageWait = 0, longestWait = 0;
+	};
+
+	// Function which parks a value until <key> is released, unless <blocked>() returns false
+	//	<blocked> is checked while the lot is locked, so a release which happens at the same time can never be missed
+	//	Returns true if the value was parked (and moved into the lot), false if it wasn't (and is left untouched)
+	template<typename Func>
+	bool park(const Key& key, T& value, Func&& blocked) {
+		std::scoped_lock lock(mutex);
+		if(!blocked()) return false;
+
+		lot[key].push_back({std::move(value), Clock::now()});
+		stats.parked++;
+		stats.totalParked++;
+		return true;
+	}
+
+	// Function which releases every value waiting on <key>, calling <release>(value) for each of them in the order they were parked
+	//	Returns the number of values released
+	template<typename Func>
+	size_t release(const Key& key, Func&& release) {
+		std::deque<Parked> released;
+		{
+			std::scoped_lock lock(mutex);
+			auto i = lot.find(key);
+			if(i == lot.end()) return 0;
+			released = std::move(i->second);
+			lot.erase(i);
+
+			auto now = Clock::now();
+			for(auto& parked: released) {
+				double wait = std::chrono::duration<double>(now - parked.since).count();
+				stats.totalReleased++;
+				stats.averageWait += (wait - stats.averageWait) / stats.totalReleased;
+				stats.longestWait = std::max(stats.longestWait, wait);
+			}
+			stats.parked -= released.size();
+		}
+
+		// NOTE: The values are released after the lock is dropped, so releasing may park values again
+		for(auto& parked: released)
+			release(std::move(parked.value));
+		return released.size();
+	}
+
+	// Function which checks if any values are waiting on <key>
+	bool waiting(const Key& key) const {
+		std::scoped_lock lock(mutex);
+		return lot.count(key);
+	}
+
+	// Function which gets the current statistics
+	Stats getStats() const {
+		std::scoped_lock lock(mutex);
+		return stats;
+	}
+
+protected:
+	// A parked value, and when it was parked
+	struct Parked {
+		T value;
+		Clock::time_point since;
+	};
+
+	mutable std::mutex mutex;
+	std::map<Key, std::deque<Parked>> lot;
+	Stats stats;
+};
+
+#endif // __PARKING_LOT_HPP__
@@ -0,0 +1,137 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides an open addressing hash table which interns paths into small integer IDs
+*/
+
+#ifndef __PATH_TABLE_HPP__
+#define __PATH_TABLE_HPP__
+
+#include <string>
+#include <string_view>
+#include <limits>
+
+#include "include_everywhere.hpp"
+
+// Table which assigns every path it is given a small integer ID (reusing the IDs of erased paths), so that per path data can be stored in flat arrays indexed by ID
+// Lookups use open addressing with linear probing, each slot stores the path's hash so most mismatches are rejected without comparing strings
+struct PathTable {
+	// Type used to identify a path
+	using ID = uint32_t;
+	static constexpr ID invalidID = std::numeric_limits<ID>::max();
+
+	// Function which finds the ID of a path (invalidID if the path isn't in the table)
+	ID find(std::string_view path) const {
+		if(slots.empty()) return invalidID;
+		size_t hash = hashOf(path);
+		for(size_t slot = hash & mask(); ; slot = (slot + 1) & mask()) {
+			auto& s = slots[slot];
+			if(s.id == emptySlot) return invalidID;
+			if(s.id != erasedSlot && s.hash == uint32_t(hash) && paths[s.id] == path) return s.id;
+		}
+	}
+
+	// Function which finds the ID of a path, adding it to the table if it isn't already present (with a single probe)
+	//	Returns the ID and whether or not the path was added
+	std::pair<ID, bool> insert(std::string_view path) {
+		if((count + erased + 1) * 10 > slots.size() * 7) rehash();
+
+		size_t hash = hashOf(path);
+		size_t firstErased = std::numeric_limits<size_t>::max();
+		size_t slot = hash & mask();
+		for(; ; slot = (slot + 1) & mask()) {
+			auto& s = slots[slot];
+			if(s.id == emptySlot) break;
+			if(s.id == erasedSlot) {
+				if(firstErased == std::numeric_limits<size_t>::max()) firstErased = slot;
+			} else if(s.hash == uint32_t(hash) && paths[s.id] == path) return {s.id, false};
+		}
+		// Reuse the first erased slot we passed (if any)
+		if(firstErased != std::numeric_limits<size_t>::max()) {
+			slot = firstErased;
+			erased--;
+		}
+
+		ID id;
+		if(!freeIDs.empty()) {
+			id = freeIDs.back();
+			freeIDs.pop_back();
+			paths[id] = path;
+		} else {
+			id = paths.size();
+			paths.emplace_back(path);
+		}
+		slots[slot] = {uint32_t(hash), id};
+		count++;
+		return {id, true};
+	}
+
+	// Function which removes a path from the table (its ID may be reused)
+	void erase(ID id) {
+		size_t hash = hashOf(paths[id]);
+		for(size_t slot = hash & mask(); ; slot = (slot + 1) & mask()) {
+			auto& s = slots[slot];
+			if(s.id == emptySlot) return;
+			if(s.id == id) {
+				s.id = erasedSlot;
+				break;
+			}
+		}
+		paths[id].clear();
+		paths[id].shrink_to_fit();
+		freeIDs.push_back(id);
+		count--;
+		erased++;
+	}
+
+	// Function which gets the path associated with an ID
+	const std::string& path(ID id) const { return paths[id]; }
+	// Function which gets the number of paths in the table
+	size_t size() const { return count; }
+	// Function which gets one more than the largest ID that has been assigned (the size arrays indexed by ID need to be)
+	size_t capacity() const { return paths.size(); }
+
+	// Function which calls <func> with the ID of every path in the table
+	template<typename Func>
+	void forEach(Func&& func) const {
+		for(auto& s: slots)
+			if(s.id != emptySlot && s.id != erasedSlot)
+				func(s.id);
+	}
+
+protected:
+	// Values of a slot's ID which mark it as empty, or as previously used (so that probes continue past it)
+	static constexpr ID emptySlot = invalidID, erasedSlot = invalidID - 1;
+
+	struct Slot {
+		uint32_t hash;
+		ID id = emptySlot;
+	};
+	std::vector<Slot> slots;
+	// The path associated with each ID (erased paths are left empty), and the IDs which can be reused
+	std::vector<std::string> paths;
+	std::vector<ID> freeIDs;
+	size_t count = 0, erased = 0;
+
+	size_t mask() const { return slots.size() - 1; }
+	static size_t hashOf(std::string_view path) { return std::hash<std::string_view>{}(path); }
+
+	// Function which resizes the slot array (doubling it if it is mostly full of live paths), removing any erased slots
+	void rehash() {
+		size_t size = std::max<size_t>(16, slots.size());
+		while((count + 1) * 10 > size * 5) size *= 2;
+
+		std::vector<Slot> old = std::move(slots);
+		slots.assign(size, Slot{});
+		for(auto& s: old)
+			if(s.id != emptySlot && s.id != erasedSlot) {
+				size_t slot = s.hash & mask();
+				while(slots[slot].id != emptySlot) slot = (slot + 1) & mask();
+				slots[slot] = s;
+			}
+		erased = 0;
+	}
+};
+
+#endif // __PATH_TABLE_HPP__
@@ -7,12 +7,10 @@
 #include "peer.hpp"
 #include "peer_manager.hpp"
 
-// Function run by the Peer's thread
+// Function run by the Peer's listening thread
 void Peer::threadFunction(std::stop_token stop) {
-	// Variable tracking how much data we should expect to receive in this message
-	uint64_t dataSize = 0;
-	// Variable tracking how much data we have currently received
-	uint64_t dataReceived = 0;
+	// Block of memory the socket receives data into
+	std::array<std::byte, maxFrameSize> receiveBlock;
 
 	// Loop unil the thread is requested to stop
 	while(!stop.stop_requested()) {
@@ -23,46 +21,37 @@ void Peer::threadFunction(std::stop_token stop) {
 
 			// If there is data ready to be received...
 			if((*pollres & zt::PollEventBitmask::ReadyToReceiveAny) != 0) {
-				// Get a pointer to the buffer's memory
-				std::byte* bufferMem = &buffer[0];
-
-				// If we haven't determined how much data we have to receive...
-				if(dataSize == 0) {
-					// Read a uint64 worth of data (remember it may take multiple loop iterations to receive that data)
-					auto res = socket.receive(bufferMem + dataReceived, sizeof(dataSize) - dataReceived);
-					ZTCPP_THROW_ON_ERROR(res, ZTError);
-					dataReceived += *res;
-
-					// Once we have read the uint64...
-					if(dataReceived >= sizeof(dataSize)) {
-						// Mark it is as our data size
-						dataSize = *((uint64_t*) bufferMem);
-						dataReceived -= sizeof(dataSize); // Subtracting to account for the possibility of extra data
-
-						// If there is extra data in the buffer, move it to the front and resize the buffer to match our data
-						if(dataReceived > 0) memmove(bufferMem, bufferMem + sizeof(dataSize), buffer.size() - sizeof(dataSize));
-						buffer.resize(dataSize);
-					}
-				// If we have determined how much data we have to receive...
-				} else {
-					// Read <dataSize> bytes of data (remember it may take multiple loop iterations to receive that data)
-					auto res = socket.receive(bufferMem + dataReceived, buffer.size() - dataReceived);
-					ZTCPP_THROW_ON_ERROR(res, ZTError);
-					dataReceived += *res;
-
-					// Once we have read <dataSize> bytes...
-					if(dataReceived >= dataSize) {
-						// Process the message
-						processMessage({buffer.data(), dataSize});
-
-						// If there is extra data in the buffer, move it to the front
-						if(dataReceived > 0) memmove(bufferMem, bufferMem + dataSize, buffer.size() - dataSize);
-
-						// Reset our data size back to 0 (we need to get the size of the next message from the network)
-						dataReceived -= dataSize; // Subtracting to account for the possibility of extra data
-						dataSize = 0;
+				// Add whatever data is available to the end of the buffer (remember a frame may take multiple loop iterations to receive)
+				auto res = socket.receive(receiveBlock.data(), receiveBlock.size());
+				ZTCPP_THROW_ON_ERROR(res, ZTError);
+				buffer.insert(buffer.end(), receiveBlock.begin(), receiveBlock.begin() + *res);
+
+				// Process every complete frame in the buffer
+				size_t consumed = 0;
+				while(buffer.size() - consumed >= sizeof(FrameHeader)) {
+					FrameHeader header;
+					std::memcpy(&header, buffer.data() + consumed, sizeof(header));
+					// If we haven't received all of the frame's data yet, wait for more data
+					if(buffer.size() - consumed - sizeof(header) < header.length)
+						break;
+
+					// Add the frame's data to the message it is a part of
+					auto frameStart = buffer.begin() + consumed + sizeof(header);
+					auto& message = partialMessages[header.stream];
+					message.insert(message.end(), frameStart, frameStart + header.length);
+					consumed += sizeof(header) + header.length;
+
+					// If that was the last frame of the message, process the message
+					if(header.flags & FrameHeader::lastFrameFlag) {
+						// If too much content is waiting to be applied, stop reading new content until there is room (the network slows down the sender)
+						// NOTE: The first byte of every message is its type
+						if(!message.empty()) MessageManager::singleton().waitForRoom((Message::Type) uint8_t(message.front()), stop);
+						processMessage({message.data(), message.size()});
+						partialMessages.erase(header.stream);
 					}
 				}
+				// Remove the processed frames from the buffer
+				buffer.erase(buffer.begin(), buffer.begin() + consumed);
 			}
 		} catch(ZTError e) {
 			std::string error = e.what();
@@ -71,10 +60,10 @@ void Peer::threadFunction(std::stop_token stop) {
 			{
 				// We have been disconnected and this peer is no longer valid
 				// Create a new message indicating that our connection to the Peer has been severed
-				auto m = std::make_unique<Message>();
-				m->type = Message::Type::linkLost;
-				m->originatorNode = getRemoteIP();
-				MessageManager::singleton().messageQueue->emplace(MessageManager::disconnectPriority, std::move(m)); // Same priority as disconnect messages
+				Message m;
+				m.type = Message::Type::linkLost;
+				m.originatorNode = getRemoteIP();
+				MessageManager::singleton().enqueue(MessageManager::disconnectPriority, std::move(m)); // Same priority as disconnect messages
 
 				return;
 
@@ -85,6 +74,69 @@ void Peer::threadFunction(std::stop_token stop) {
 	}
 }
 
+// Function run by the Peer's sending thread
+void Peer::sendingThreadFunction(std::stop_token stop) {
+	auto& state = sendQueues;
+	// Make sure we wake up if we are asked to stop while waiting for something to send
+	std::stop_callback wake(stop, [&state] {
+		{ std::scoped_lock lock(state.mutex); }
+		state.cv.notify_all();
+	});
+
+	// Lambda which sends a block of data, making sure all of it gets sent
+	auto sendAll = [this](const void* data, size_t size) {
+		auto bytes = (const std::byte*) data;
+		while(size > 0) {
+			auto res = socket.send(bytes, size);
+			ZTCPP_THROW_ON_ERROR(res, ZTError);
+			bytes += *res;
+			size -= *res;
+		}
+	};
+
+	while(!stop.stop_requested()) {
+		// Wait for a message to send, and pick the most urgent one
+		FrameHeader header;
+		std::shared_ptr<const std::string> data;
+		size_t offset;
+		{
+			std::unique_lock lock(state.mutex);
+			state.cv.wait(lock, [&] {
+				return stop.stop_requested() || std::any_of(state.queues.begin(), state.queues.end(), [](auto& q) { return !q.empty(); });
+			});
+			if(stop.stop_requested()) break;
+
+			size_t priority = 0;
+			while(state.queues[priority].empty()) priority++;
+			auto& message = state.queues[priority].front();
+
+			// Claim the next frame of the message (removing it from its queue once the last frame has been claimed)
+			data = message.data;
+			offset = message.sent;
+			header.stream = message.stream;
+			header.priority = priority;
+			header.length = std::min(maxFrameSize, data->size() - offset);
+			header.flags = offset + header.length >= data->size() ? FrameHeader::lastFrameFlag : 0;
+			message.sent += header.length;
+			state.queuedBytes -= header.length;
+			if(header.flags & FrameHeader::lastFrameFlag)
+				state.queues[priority].pop_front();
+		}
+		// Let anyone waiting for our queue to drain know it got smaller
+		PeerManager::singleton().notifyDrained();
+
+		// Send the frame
+		try {
+			sendAll(&header, sizeof(header));
+			sendAll(data->data() + offset, header.length);
+		// If we fail to send, stop sending (the listening thread will notice that the link has been lost)
+		} catch(ZTError e) {
+			std::cerr << "[ZT][Error] " << e.what() << std::endl;
+			return;
+		}
+	}
+}
+
 
 // Function that processes a message
 void Peer::processMessage(std::span<std::byte> data) {
@@ -9,49 +9,95 @@
 
 #include <jthread.hpp>
 #include <cstring>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <condition_variable>
 #include "messages.hpp"
+#include "message_manager.hpp"
 
 #include "networking_include_everywhere.hpp"
 
-// Class representing a connection to another Peer on the network, it wraps a TCP socket and listening thread
+// Class representing a connection to another Peer on the network, it wraps a TCP socket, a listening thread, and a sending thread
+// Messages are split into frames, each tagged with the logical stream (message) it belongs to and the message's priority,
+//	the sending thread always sends the next frame from the most urgent message waiting to be sent, so control messages
+//	(locks, resend requests, etc...) can jump ahead of bulk file content on the wire, the receiver reassembles each stream
 class Peer {
+public:
+	// Header sent before every frame
+	struct FrameHeader {
+		// The stream (message) the frame belongs to
+		uint32_t stream;
+		// Number of bytes of data following the header
+		uint32_t length;
+		// Priority of the message (lower = more urgent)
+		uint8_t priority;
+		// Flags marking the last frame of a message
+		uint8_t flags;
+		uint8_t padding[2] = {0, 0};
+
+		static constexpr uint8_t lastFrameFlag = 1;
+	};
+	static_assert(sizeof(FrameHeader) == 12, "Frame headers should be 12 bytes");
+
+	// Maximum amount of data sent in a single frame (64KB)
+	static constexpr size_t maxFrameSize = 64 * 1024;
+	// Number of priority classes (one for every MessageManager priority)
+	static constexpr size_t priorityClasses = MessageManager::payloadPriority + 1;
+
+private:
 	// The socket we are listening and sending on
 	zt::Socket socket;
-	// Listening thread
-	std::jthread listeningThread;
+
+	// Message waiting to be sent, and how much of it has already been sent
+	struct OutgoingMessage {
+		std::shared_ptr<const std::string> data;
+		uint32_t stream;
+		size_t sent = 0;
+	};
+	// Queues of messages waiting to be sent (one per priority class) and the synchronization needed to share them with the sending thread
+	struct SendQueues {
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::array<std::deque<OutgoingMessage>, priorityClasses> queues;
+		uint32_t nextStream = 0;
+		// Number of bytes waiting to be sent
+		std::atomic<size_t> queuedBytes = 0;
+	};
+	// NOTE: Must be declared before the threads so it outlives them
+	mutable SendQueues sendQueues;
+
+	// Listening and sending threads
+	std::jthread listeningThread, sendingThread;
 
 	// Cached IP address and port of the remote peer
 	mutable zt::IpAddress remoteIP;
 	mutable uint16_t remotePort = -1;
 
 	// Buffer we receive data in
-	std::vector<std::byte> buffer = std::vector<std::byte>{30, {}};
+	std::vector<std::byte> buffer;
+	// Messages which have been partially received (indexed by stream)
+	std::unordered_map<uint32_t, std::vector<std::byte>> partialMessages;
 
 public:
 	Peer() {}
 	Peer(zt::Socket&& _socket) : socket(std::move(_socket)),
-		listeningThread([this](std::stop_token stop){ this->threadFunction(stop); })
+		listeningThread([this](std::stop_token stop){ this->threadFunction(stop); }),
+		sendingThread([this](std::stop_token stop){ this->sendingThreadFunction(stop); })
 	{ }
 
-	Peer(Peer&& other) { *this = std::move(other); }
-	Peer& operator=(Peer&& other) {
-		// Wait for the other peer's thread to shutdown before we move
-		if(other.listeningThread.joinable()) {
-			other.listeningThread.request_stop();
-			other.listeningThread.join();
-		}
-
-		socket = std::move(other.socket);
-		listeningThread = std::jthread([this](std::stop_token stop){ this->threadFunction(stop); });
-
-		return *this;
-	};
+	// Peers can't be copied or moved, since their threads refer to them (the Peer Manager holds every Peer by pointer instead)
+	Peer(const Peer&) = delete;
+	Peer& operator=(const Peer&) = delete;
 
 	// Function that returns a new peer representing a connection to the provided ip and port.
 	// Attempts the connection <retryAttempts> times (0 = infinite times, default 3)
 	//	with a delay of <timeBetweenAttempts> (default 100ms) between each attempt.
 	template<typename Duration = std::chrono::milliseconds>
-	static Peer connect(const zt::IpAddress& ip, uint16_t port, size_t retryAttempts = 3, Duration timeBetweenAttempts = 100ms) {
+	static std::unique_ptr<Peer> connect(const zt::IpAddress& ip, uint16_t port, size_t retryAttempts = 3, Duration timeBetweenAttempts = 100ms) {
 		// We change 0 to the maximum number stored in a size_t (heat death of the unversise timeframe attempts)
 		if(retryAttempts == 0) retryAttempts--;
 
@@ -74,7 +120,7 @@ public:
 		if(!connectionSocket.isOpen())
 			throw std::runtime_error("Failed to connect");
 
-		return { std::move(connectionSocket) };
+		return std::make_unique<Peer>(std::move(connectionSocket));
 	}
 
 
@@ -99,17 +145,25 @@ public:
 		return remotePort;
 	}
 
-	// Send some data to to the connected peer
-	void send(const void* data, uint64_t size) const {
-		zt::Socket& socket = reference_cast<zt::Socket>(this->socket);
-		// Before we send data, we send the size of the data
-		socket.send(&size, sizeof(size));
-		socket.send(data, size);
+	// Queue some data to be sent to the connected peer, <priority> is the MessageManager priority of the message the data represents
+	// NOTE: The data is shared (not copied) between every peer it is sent to
+	void send(std::shared_ptr<const std::string> data, size_t priority) const {
+		{
+			std::scoped_lock lock(sendQueues.mutex);
+			sendQueues.queuedBytes += data->size();
+			sendQueues.queues[std::min(priority, priorityClasses - 1)].push_back({std::move(data), sendQueues.nextStream++});
+		}
+		sendQueues.cv.notify_one();
 	}
 
+	// Function which gets the number of bytes waiting to be sent to the connected peer
+	size_t pendingBytes() const { return sendQueues.queuedBytes.load(); }
+
 protected:
-	// Function run by the Peer's thread
+	// Function run by the Peer's listening thread
 	void threadFunction(std::stop_token stop);
+	// Function run by the Peer's sending thread
+	void sendingThreadFunction(std::stop_token stop);
 
 	// Function that processes a message
 	void processMessage(std::span<std::byte> data);
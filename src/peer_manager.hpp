@@ -23,7 +23,12 @@ class PeerManager {
 	// Thread that listens for incoming connections
 	std::jthread listeningThread;
 	// List of peers (guarded by a monitor, access to this object ges through a mutex)
-	monitor<std::vector<Peer>> peers;
+	// NOTE: Peers are held by pointer, since a Peer can't be moved while its threads are running
+	monitor<std::vector<std::unique_ptr<Peer>>> peers;
+	// Used to wake threads waiting for the data queued with our peers to drain
+	// NOTE: Must be locked before (never while holding) the peer list's lock
+	std::mutex drainMutex;
+	std::condition_variable drainCV;
 
 public:
 	// The IP address of the Peer which provides connectivity to the rest of the network
@@ -65,25 +70,20 @@ public:
 					{
 						auto peerLock = peers.write_lock();
 						for(auto& peer: *peerLock)
-							backupPeers.emplace_back(peer.getRemoteIP(), peer.getRemotePort());
+							backupPeers.emplace_back(peer->getRemoteIP(), peer->getRemotePort());
 
 						// Add the peer to the peer list
-						peerLock->emplace_back(std::move(*sock));
-						peerIP = peerLock->back().getRemoteIP();
+						peerLock->emplace_back(std::make_unique<Peer>(std::move(*sock)));
+						peerIP = peerLock->back()->getRemoteIP();
 					}
 
 					// Notify the new peer of its backup Peers
 					ConnectMessage connectMessage;
 					connectMessage.type = Message::Type::connect;
 					connectMessage.backupPeers = backupPeers;
-					connectMessage.managedPaths = *MessageManager::singleton().folders;
+					connectMessage.managedPaths = MessageManager::singleton().managedFolders();
 					send(connectMessage, peerIP); // The write lock must be released before we send, otherwise we have the same thread taking multiple locks
-
-					// Add a message to the queue requesting all of the data be sent to the new node
-					auto syncRequest = std::make_unique<Message>();
-					syncRequest->type = Message::Type::initialSyncRequest;
-					syncRequest->originatorNode = peerIP; // Mark that data should be sent to the newly connected peer
-					MessageManager::singleton().messageQueue->emplace(MessageManager::disconnectPriority, std::move(syncRequest)); // Same priority as disconnect
+					// NOTE: The new peer responds with a request for the files it doesn't already have
 
 					std::cout << "Accepted Connection from: " << peerIP << std::endl;
 				}
@@ -102,48 +102,43 @@ public:
 		msg.receiverNode = destination;
 		msg.senderNode = ZeroTierNode::singleton().getIP();
 		if(msg.originatorNode == zt::IpAddress::ipv6Unspecified()) msg.originatorNode = msg.senderNode;
-		msg.messageHash = msg.hash();
+		msg.messageHash = Message::hash(msg);
 
 		// Serialize the data
 		std::stringstream stream;
-		cereal::BinaryOutputArchive ar(stream);
-		ar << msg;
+		{
+			cereal::BinaryOutputArchive ar(stream);
+			ar << msg;
+		}
+		auto frame = std::make_shared<const std::string>(stream.str());
 
-		// Forward the data (based on the added routing information)
-		routeData(nonstd::span<std::byte>{(std::byte*) stream.str().data(), stream.str().size()}, destination,
-			broadcastToSelf ? zt::IpAddress::ipv6Unspecified() : zt::IpAddress::ipv6Loopback());
+		// Keep the serialized message around in case it needs to be resent (resend requests themselves are never resent)
+		if(msg.type != Message::Type::resendRequest)
+			MessageManager::singleton().retransmissionCache.insert(msg.messageHash, frame);
 
-		// Move the message into the buffer of old messages
-		MessageManager::singleton().oldMessages.emplace_back(std::make_unique<MSG>(std::move(msg)));
+		// Forward the data (based on the added routing information)
+		routeFrame(std::move(frame), destination, broadcastToSelf ? zt::IpAddress::ipv6Unspecified() : zt::IpAddress::ipv6Loopback());
 	}
 
-
-	// Function which gets a reference to the array of peers
-	monitor<std::vector<Peer>>& getPeers() { return peers; }
-
-	// Functions which get or set the gateway IP
-	const zt::IpAddress& getGatewayIP() { return gatewayIP; }
-	void setGatewayIP(const zt::IpAddress& ip) { gatewayIP = ip; }
-
-private:
-	// Only the singleton can be constructed
-	PeerManager() {}
-
-	// Function which forwards some binary data (it figures out which nodes should receive the data)
-	void routeData(const std::span<std::byte> data, const zt::IpAddress& destination, zt::IpAddress source = zt::IpAddress::ipv6Unspecified()) const {
+	// Function which forwards an already serialized message (it figures out which nodes should receive the data)
+	// NOTE: The frame is shared (not copied) between every peer it is sent to and the retransmission cache
+	void routeFrame(RetransmissionCache::Frame frame, const zt::IpAddress& destination, zt::IpAddress source = zt::IpAddress::ipv6Unspecified()) const {
 		// Read lock the peers
 		auto lock = peers.read_lock();
 
+		// The priority of the message (so that peers can send urgent messages ahead of bulk data)
+		size_t priority = MessageManager::sendPriorityOf((Message::Type) uint8_t(frame->at(0)));
+
 		// Lambda that sends the data to every connected node (including ourselves) except the node that data just came from
 		auto forward2all = [&]() {
 			// Send the data to every peer (except the source)
 			for(auto& peer: *lock)
-				if(peer.getRemoteIP() != source)
-					peer.send(data.data(), data.size());
+				if(peer->getRemoteIP() != source)
+					peer->send(frame, priority);
 
 			// Process the data locally (unless we are the source)
 			if( !(source == zt::IpAddress::ipv6Loopback() || source == zt::IpAddress::ipv4Loopback() || source == ZeroTierNode::singleton().getIP()) )
-				MessageManager::singleton().deserializeMessage(data);
+				MessageManager::singleton().deserializeMessage(frame);
 		};
 
 
@@ -152,13 +147,13 @@ private:
 			forward2all();
 		// If we are the destination, process the data locally
 		else if(destination == zt::IpAddress::ipv6Loopback() || destination == zt::IpAddress::ipv4Loopback() || destination == ZeroTierNode::singleton().getIP())
-			MessageManager::singleton().deserializeMessage(data);
+			MessageManager::singleton().deserializeMessage(frame);
 		else {
 			// Find the directly connected peer we need to forward data to
 			bool directLink = false;
 			for(auto& peer: *lock)
-				if(peer.getRemoteIP() == destination) {
-					peer.send(data.data(), data.size());
+				if(peer->getRemoteIP() == destination) {
+					peer->send(frame, priority);
 					directLink = true;
 					break;
 				}
@@ -168,6 +163,47 @@ private:
 				forward2all();
 		}
 	}
+
+
+	// Function which gets the number of bytes waiting to be sent to all of our peers
+	size_t pendingBytes() const {
+		size_t bytes = 0;
+		for(auto& peer: *peers.read_lock())
+			bytes += peer->pendingBytes();
+		return bytes;
+	}
+
+	// Function which waits until at most <bytes> bytes are waiting to be sent to our peers
+	//	Returns false if it was stopped first
+	bool waitForPendingBelow(size_t bytes, std::stop_token stop) {
+		// NOTE: Registered before locking, since the callback runs right away (and locks) if we are already stopped
+		std::stop_callback wake(stop, [this] { notifyDrained(); });
+		std::unique_lock lock(drainMutex);
+		drainCV.wait(lock, [&] { return stop.stop_requested() || pendingBytes() <= bytes; });
+		return !stop.stop_requested();
+	}
+
+	// Function which wakes the threads waiting for our peers' queues to drain (called whenever data leaves a queue, or a peer is removed)
+	void notifyDrained() {
+		{ std::scoped_lock lock(drainMutex); }
+		drainCV.notify_all();
+	}
+
+	// Function which gets a reference to the array of peers
+	monitor<std::vector<std::unique_ptr<Peer>>>& getPeers() { return peers; }
+
+	// Functions which get or set the gateway IP
+	const zt::IpAddress& getGatewayIP() { return gatewayIP; }
+	void setGatewayIP(const zt::IpAddress& ip) { gatewayIP = ip; }
+
+private:
+	// Only the singleton can be constructed
+	PeerManager() {}
+
+	// Function which forwards some binary data received from a peer (it figures out which nodes should receive the data)
+	void routeData(const std::span<std::byte> data, const zt::IpAddress& destination, zt::IpAddress source = zt::IpAddress::ipv6Unspecified()) const {
+		routeFrame(std::make_shared<const std::string>((const char*) data.data(), data.size()), destination, source);
+	}
 };
 
 #endif // __PEER_MANAGER_HPP__
\ No newline at end of file
@@ -0,0 +1,117 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a cache of recently sent and received messages, so that they can be resent if they arrive corrupted
+*/
+
+#ifndef __RETRANSMISSION_CACHE_HPP__
+#define __RETRANSMISSION_CACHE_HPP__
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "include_everywhere.hpp"
+
+// Class which holds the serialized form (frame) of recently sent and received messages, indexed by their hash
+// The cache is bounded by the total size of the frames it holds, the least recently used frames are evicted first
+//	(so a burst of small messages, such as locks, can't push out the larger file messages a peer may still ask for)
+// NOTE: Frames are immutable and shared, the same frame is held by the cache and every peer it is waiting to be sent to
+struct RetransmissionCache {
+	// A serialized message
+	using Frame = std::shared_ptr<const std::string>;
+
+	// Statistics about the cache
+	struct Stats {
+		// Number of frames (and bytes) currently cached
+		size_t frames = 0, bytes = 0;
+		// Number of frames ever inserted, evicted to make room (and how many bytes they held), and too large to cache at all
+		size_t inserted = 0, evicted = 0, bytesEvicted = 0, oversized = 0;
+		// Number of lookups which found (or didn't find) their frame
+		size_t hits = 0, misses = 0;
+	};
+
+	RetransmissionCache(size_t maxBytes) : maxBytes(maxBytes) {}
+	RetransmissionCache(const RetransmissionCache&) = delete;
+	RetransmissionCache& operator=(const RetransmissionCache&) = delete;
+
+	// Function which adds a frame to the cache (under the hash of the message it holds), evicting old frames to make room
+	//	If the hash is already cached, the existing frame is kept and marked as recently used
+	void insert(size_t hash, Frame frame) {
+		if(!frame) return;
+		std::scoped_lock lock(mutex);
+		if(auto i = index.find(hash); i != index.end()) {
+			order.splice(order.end(), order, i->second);
+			return;
+		}
+		if(frame->size() > maxBytes) {
+			stats.oversized++;
+			return;
+		}
+
+		stats.bytes += frame->size();
+		stats.frames++;
+		stats.inserted++;
+		index[hash] = order.insert(order.end(), {hash, std::move(frame)});
+		evict(maxBytes);
+	}
+
+	// Function which finds the frame holding the message with <hash>, marking it as recently used
+	//	Returns nullptr if the frame isn't cached
+	Frame find(size_t hash) {
+		std::scoped_lock lock(mutex);
+		auto i = index.find(hash);
+		if(i == index.end()) {
+			stats.misses++;
+			return nullptr;
+		}
+
+		stats.hits++;
+		order.splice(order.end(), order, i->second);
+		return i->second->frame;
+	}
+
+	// Function which changes how many bytes the cache may hold (evicting frames if it now holds too many)
+	void setMaxBytes(size_t bytes) {
+		std::scoped_lock lock(mutex);
+		maxBytes = bytes;
+		evict(maxBytes);
+	}
+
+	// Function which gets the current statistics
+	Stats getStats() const {
+		std::scoped_lock lock(mutex);
+		return stats;
+	}
+
+protected:
+	// A cached frame, and the hash it is indexed by
+	struct Entry {
+		size_t hash;
+		Frame frame;
+	};
+
+	mutable std::mutex mutex;
+	size_t maxBytes;
+	// Frames from least to most recently used, and where each hash's frame is in that order
+	std::list<Entry> order;
+	std::unordered_map<size_t, std::list<Entry>::iterator> index;
+	Stats stats;
+
+	// Function which evicts the least recently used frames until the cache holds at most <limit> bytes (called while locked)
+	void evict(size_t limit) {
+		while(stats.bytes > limit && !order.empty()) {
+			auto& oldest = order.front();
+			stats.bytes -= oldest.frame->size();
+			stats.frames--;
+			stats.evicted++;
+			stats.bytesEvicted += oldest.frame->size();
+			index.erase(oldest.hash);
+			order.pop_front();
+		}
+	}
+};
+
+#endif // __RETRANSMISSION_CACHE_HPP__
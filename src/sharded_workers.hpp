@@ -0,0 +1,121 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a pool of worker threads where each job is assigned to a worker by a key
+*/
+
+#ifndef __SHARDED_WORKERS_HPP__
+#define __SHARDED_WORKERS_HPP__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <jthread.hpp>
+
+#include "include_everywhere.hpp"
+
+// Pool of worker threads, each with its own queue of jobs
+// Every job is given a key, and all of the jobs with the same key are run by the same worker (in the order they were submitted),
+//	while jobs with different keys may run in parallel
+template<typename Job>
+struct ShardedWorkers {
+	// Function that determines how many workers a pool should have by default (upto 8, depending on the hardware)
+	static size_t defaultWorkerCount() {
+		return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+	}
+
+	ShardedWorkers(std::function<void(Job&&)> process, size_t workerCount = defaultWorkerCount()) : process(std::move(process)) {
+		workers.reserve(workerCount);
+		for(size_t i = 0; i < workerCount; i++)
+			workers.emplace_back(std::make_unique<Worker>());
+		// NOTE: The threads are only started once every worker exists
+		for(auto& worker: workers)
+			worker->thread = std::jthread([this, worker = worker.get()](std::stop_token stop) { threadFunction(*worker, stop); });
+	}
+	~ShardedWorkers() {
+		// Stop the threads before anything they use is destroyed
+		for(auto& worker: workers) {
+			worker->thread.request_stop();
+			if(worker->thread.joinable()) worker->thread.join();
+		}
+	}
+	ShardedWorkers(const ShardedWorkers&) = delete;
+	ShardedWorkers& operator=(const ShardedWorkers&) = delete;
+
+	// Function which queues a job on the worker responsible for <key>
+	void submit(size_t key, Job&& job) {
+		auto& worker = *workers[key % workers.size()];
+		outstanding++;
+		submitted++;
+		{
+			std::scoped_lock lock(worker.mutex);
+			worker.jobs.emplace_back(std::move(job));
+		}
+		worker.cv.notify_one();
+	}
+
+	// Function which waits until every submitted job has finished
+	void wait() {
+		std::unique_lock lock(idleMutex);
+		idleCV.wait(lock, [this] { return outstanding == 0; });
+	}
+
+	// Function which gets the number of workers
+	size_t size() const { return workers.size(); }
+	// Function which gets the number of jobs which have been submitted but haven't finished
+	size_t pending() const { return outstanding; }
+
+	// Number of jobs which have been submitted, and which have finished
+	std::atomic<size_t> submitted = 0, completed = 0;
+
+protected:
+	// A worker thread and its queue
+	struct Worker {
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<Job> jobs;
+		std::jthread thread;
+	};
+
+	// Function which runs the job
+	std::function<void(Job&&)> process;
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	// Number of jobs which haven't finished (and used to wait for it to reach zero)
+	std::atomic<size_t> outstanding = 0;
+	std::mutex idleMutex;
+	std::condition_variable idleCV;
+
+	// Function run by each worker thread, runs the worker's jobs in order
+	void threadFunction(Worker& worker, std::stop_token stop) {
+		// Make sure we wake up if we are asked to stop while waiting for a job
+		std::stop_callback wake(stop, [&worker] {
+			{ std::scoped_lock lock(worker.mutex); }
+			worker.cv.notify_all();
+		});
+
+		while(!stop.stop_requested()) {
+			Job job;
+			{
+				std::unique_lock lock(worker.mutex);
+				worker.cv.wait(lock, [&] { return stop.stop_requested() || !worker.jobs.empty(); });
+				if(stop.stop_requested()) break;
+				job = std::move(worker.jobs.front());
+				worker.jobs.pop_front();
+			}
+
+			process(std::move(job));
+			completed++;
+
+			// If this was the last job, wake up anyone waiting for the pool to be idle
+			if(--outstanding == 0) {
+				{ std::scoped_lock lock(idleMutex); }
+				idleCV.notify_all();
+			}
+		}
+	}
+};
+
+#endif // __SHARDED_WORKERS_HPP__
@@ -0,0 +1,135 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides functions which read and write files without expanding the holes in sparse files
+*/
+
+#ifndef __SPARSE_FILE_HPP__
+#define __SPARSE_FILE_HPP__
+
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <algorithm>
+
+#include "include_everywhere.hpp"
+
+// A region of a file (offset from the start of the file, length) which contains data, everything outside of the extents is a hole
+using Extent = std::pair<uint64_t, uint64_t>;
+
+// Function that reads the part of a file between <begin> and <end>, skipping over any holes
+//	If the range contains holes, <extents> is filled with every region that contains data and <content> only contains that data,
+//	otherwise <extents> is left empty and <content> contains the whole range
+//	If the whole range is a hole, <extents> holds a single empty extent at the end of the range (so it can't be mistaken for a range without holes)
+//	Returns false if the file couldn't be opened (<content> and <extents> are left empty, which must not be mistaken for a range of data)
+// NOTE: On platforms which can't find holes (no SEEK_DATA) the range is always read as if it contains no holes
+inline bool readSparseRange(const std::filesystem::path& path, uint64_t begin, uint64_t end, std::string& content, std::vector<Extent>& extents) {
+	content.clear();
+	extents.clear();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+
+#ifdef SEEK_DATA
+	// Find every region of the range which contains data
+	for(uint64_t pos = begin; pos < end; ) {
+		off_t data = ::lseek(fd, pos, SEEK_DATA);
+		if(data < 0) {
+			// ENXIO means there is no more data (the rest of the range is a hole), anything else means the filesystem can't tell us where the holes are
+			if(errno != ENXIO) extents = {{begin, end - begin}};
+			break;
+		}
+		if(uint64_t(data) >= end) break;
+
+		off_t hole = ::lseek(fd, data, SEEK_HOLE);
+		uint64_t dataEnd = hole < 0 ? end : std::min<uint64_t>(hole, end);
+		extents.emplace_back(data, dataEnd - data);
+		pos = dataEnd;
+	}
+#else
+	extents = {{begin, end - begin}};
+#endif
+
+	// Lambda that reads a block of data at an offset, returns how much was read (less than <length> only if the file ends first)
+	// NOTE: A single read is capped (at just under 2GB on Linux) and may be interrupted, so we keep reading until we have everything
+	auto read = [fd](char* data, uint64_t length, uint64_t offset) {
+		uint64_t total = 0;
+		while(total < length) {
+			ssize_t read = ::pread(fd, data + total, length - total, offset + total);
+			if(read < 0 && errno == EINTR) continue;
+			if(read <= 0) break;
+			total += read;
+		}
+		return total;
+	};
+
+	// Read the data in each extent
+	for(auto& [offset, length]: extents) {
+		size_t start = content.size();
+		content.resize(start + length);
+		uint64_t got = read(&content[start], length, offset);
+		// If the file was truncated while we were reading it, treat the missing data as zeros
+		if(got < length)
+			std::fill(content.begin() + start + got, content.end(), '\0');
+	}
+	::close(fd);
+
+	// If the whole range is data, there is no need to send any extents
+	if(extents.size() == 1 && extents[0] == Extent{begin, end - begin})
+		extents.clear();
+	// If the whole range is a hole, mark it with an empty extent
+	else if(extents.empty() && begin < end)
+		extents = {{end, 0}};
+	return true;
+}
+
+// Function that writes data read by readSparseRange into the part of a file between <begin> and <end>, leaving holes between the extents
+//	(the file is created if it doesn't exist and grown to at least <end> bytes)
+inline void writeSparseRange(const std::filesystem::path& path, uint64_t begin, uint64_t end, std::string_view content, const std::vector<Extent>& extents) {
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0666);
+	if(fd < 0)
+		throw std::filesystem::filesystem_error("Failed to open file", path, std::error_code(errno, std::generic_category()));
+
+	// Lambda that writes a block of data at an offset
+	auto write = [fd](const char* data, uint64_t length, uint64_t offset) {
+		while(length > 0) {
+			ssize_t written = ::pwrite(fd, data, length, offset);
+			if(written < 0 && errno == EINTR) continue;
+			if(written <= 0) return;
+			data += written;
+			length -= written;
+			offset += written;
+		}
+	};
+
+	// If there are no holes, write the whole range
+	if(extents.empty())
+		write(content.data(), content.size(), begin);
+	else {
+		uint64_t pos = begin, consumed = 0;
+		for(auto& [offset, length]: extents) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+			// Punch out any data that is already in the gap before this extent
+			if(offset > pos) ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, offset - pos);
+#endif
+			write(content.data() + consumed, length, offset);
+			consumed += length;
+			pos = offset + length;
+		}
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if(end > pos) ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, end - pos);
+#endif
+	}
+
+	// Make sure the file extends to the end of the range (any trailing hole is created by growing the file)
+	struct stat info;
+	if(::fstat(fd, &info) == 0 && uint64_t(info.st_size) < end)
+		::ftruncate(fd, end);
+	::close(fd);
+}
+
+#endif // __SPARSE_FILE_HPP__
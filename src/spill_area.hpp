@@ -0,0 +1,80 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which moves the content of waiting messages to disk while too much memory is held by waiting messages
+*/
+
+#ifndef __SPILL_AREA_HPP__
+#define __SPILL_AREA_HPP__
+
+#include <atomic>
+#include <fstream>
+
+#include "include_everywhere.hpp"
+#include "messages.hpp"
+
+// Class which spills the (file) content of messages into files in a directory, and pages it back in when the message is needed
+// NOTE: Only the content is spilled, the rest of the message (which is small) stays in memory
+struct SpillArea {
+	// Number of messages spilled, and the amount of content spilled
+	std::atomic<size_t> spilled = 0, bytesSpilled = 0;
+
+	// Function which moves a message's content into a file in <directory>
+	//	Returns false (leaving the message untouched) if the content couldn't be written
+	bool spill(AnyMessage& m, const std::filesystem::path& directory) {
+		auto content = m.content();
+		if(!content || !m.spilledTo.empty()) return false;
+
+		std::error_code ec;
+		create_directories(directory, ec);
+		auto path = directory / std::to_string(nextID++);
+		std::ofstream fout(path, std::ios::binary);
+		fout.write(content->data(), content->size());
+		fout.close();
+		if(!fout) {
+			remove(path, ec);
+			return false;
+		}
+
+		spilled++;
+		bytesSpilled += content->size();
+		std::string().swap(*content);
+		m.spilledTo = std::move(path);
+		return true;
+	}
+
+	// Function which reads a spilled message's content back into the message (and removes the file it was spilled to)
+	//	Returns false if the content couldn't be read back
+	bool restore(AnyMessage& m) {
+		if(m.spilledTo.empty()) return true;
+
+		std::error_code ec;
+		auto& content = *m.content();
+		auto size = file_size(m.spilledTo, ec);
+		std::ifstream fin(m.spilledTo, std::ios::binary);
+		if(!ec) {
+			content.resize(size);
+			fin.read(content.data(), content.size());
+		}
+		bool success = !ec && fin;
+		fin.close();
+		discard(m);
+		return success;
+	}
+
+	// Function which removes the file a message's content was spilled to (without reading it back)
+	void discard(AnyMessage& m) {
+		if(m.spilledTo.empty()) return;
+
+		std::error_code ec;
+		remove(m.spilledTo, ec);
+		m.spilledTo.clear();
+	}
+
+protected:
+	// ID of the next file content is spilled to
+	std::atomic<size_t> nextID = 0;
+};
+
+#endif // __SPILL_AREA_HPP__
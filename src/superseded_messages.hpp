@@ -0,0 +1,114 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which tracks the file messages waiting in the message queue, so that messages made obsolete by newer ones are never applied
+*/
+
+#ifndef __SUPERSEDED_MESSAGES_HPP__
+#define __SUPERSEDED_MESSAGES_HPP__
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "include_everywhere.hpp"
+#include "messages.hpp"
+
+// Class which indexes the file messages waiting in the message queue by their file, and marks the ones which newer messages make obsolete:
+//	- A content change is superseded by a newer content change or delete (from the same node) for the same file
+//	- A delete is superseded by a newer delete (from the same node) for the same file
+//	- A lock and the matching unlock (from the same node) cancel each other out, as long as the file isn't already locked
+// Only messages from the same node supersede each other, since a message from another node might be rejected by a lock
+// The content of a superseded message is freed as soon as it is superseded, the message itself is dropped when it is taken out of the queue
+// NOTE: Messages are stored inline in the queue, so the index points at the messages where they wait in the queue (see track and dequeued)
+struct SupersededMessages {
+	// Number of messages which have been superseded, and the amount of file content that was freed early because of it
+	std::atomic<size_t> superseded = 0, bytesFreed = 0;
+
+	// Function which checks a message that is about to be added to the queue, marking any waiting messages it supersedes
+	//	<isLocked>(path) is used to check if a file is currently locked
+	//	Returns false if the message cancels out a waiting message, and shouldn't be added to the queue at all
+	bool queued(const AnyMessage& m, const std::function<bool(const std::filesystem::path&)>& isLocked) {
+		if(!isTracked(m->type)) return true;
+		auto& message = *m.as<FileMessage>();
+
+		std::scoped_lock lock(mutex);
+		auto i = pending.find(message.targetFile.native());
+		if(i == pending.end()) return true;
+		// NOTE: Newest first, so an unlock cancels out the most recent lock
+		for(auto j = i->second.rbegin(); j != i->second.rend(); j++) {
+			auto other = *j;
+			if(marked.count(other) || other->originatorNode != message.originatorNode || other->timestamp > message.timestamp) continue;
+
+			switch(message.type) {
+			// Content changes and deletes replace any older content change (and deletes replace any older delete)
+			break; case Message::Type::contentChange: case Message::Type::deleteFile:
+				if(other->type == Message::Type::contentChange || (other->type == message.type && message.type == Message::Type::deleteFile))
+					mark(other);
+			// An unlock cancels out the lock it matches (unless the file is already locked, in which case the lock may change who holds it)
+			break; case Message::Type::unlock:
+				if(other->type == Message::Type::lock && !isLocked(message.targetFile)) {
+					mark(other);
+					superseded++;
+					return false;
+				}
+			break; default: break;
+			}
+		}
+		return true;
+	}
+
+	// Function which records that a message is waiting in the queue (called once the message is in its place in the queue,
+	//	and before it can be taken out, so that the recorded address stays valid until dequeued is called)
+	void track(AnyMessage& m) {
+		if(!isTracked(m->type)) return;
+		auto message = m.as<FileMessage>();
+
+		std::scoped_lock lock(mutex);
+		pending[message->targetFile.native()].push_back(message);
+	}
+
+	// Function which records that a message is being taken out of the queue (called before the message is moved out of its place in the queue)
+	//	Returns false if the message has been superseded (and should be dropped instead of processed)
+	bool dequeued(AnyMessage& m) {
+		if(!isTracked(m->type)) return true;
+		auto message = m.as<FileMessage>();
+
+		std::scoped_lock lock(mutex);
+		if(auto i = pending.find(message->targetFile.native()); i != pending.end()) {
+			auto& waiting = i->second;
+			waiting.erase(std::remove(waiting.begin(), waiting.end(), message), waiting.end());
+			if(waiting.empty()) pending.erase(i);
+		}
+		return marked.erase(message) == 0;
+	}
+
+protected:
+	std::mutex mutex;
+	// The messages waiting in the queue for each file, and the ones which have been superseded
+	std::unordered_map<std::string, std::vector<FileMessage*>> pending;
+	std::unordered_set<const FileMessage*> marked;
+
+	// Function which checks if a type of message is tracked
+	// NOTE: Initial sync messages are chunks of a file rather than the whole file, so they never supersede each other
+	static bool isTracked(Message::Type type) {
+		return type == Message::Type::lock || type == Message::Type::unlock || type == Message::Type::deleteFile || type == Message::Type::contentChange;
+	}
+
+	// Function which marks a waiting message as superseded, freeing its content
+	void mark(FileMessage* message) {
+		marked.insert(message);
+		superseded++;
+		if(message->type == Message::Type::contentChange) {
+			auto& content = static_cast<FileContentMessage&>(*message);
+			bytesFreed += content.fileContent.size();
+			std::string().swap(content.fileContent);
+			decltype(content.extents)().swap(content.extents);
+		}
+	}
+};
+
+#endif // __SUPERSEDED_MESSAGES_HPP__
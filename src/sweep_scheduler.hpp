@@ -0,0 +1,142 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a class which decides when the filesystem should be swept, based on how often files have recently been changing
+*/
+
+#ifndef __SWEEP_SCHEDULER_HPP__
+#define __SWEEP_SCHEDULER_HPP__
+
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+
+#include "include_everywhere.hpp"
+
+// Class which adapts how often the filesystem is swept to how often files are changing:
+//	while files are being edited, fast track sweeps (and rescans of the directories being edited) happen often to keep detection latency low,
+//	while the tree is idle sweeps back off, and total sweeps are spaced out so they never take more than a small fraction of the time
+// Total sweeps are run at idle I/O priority when the disk is busy with other work
+struct SweepScheduler {
+	using Clock = std::chrono::steady_clock;
+
+	// Bounds on how often fast track sweeps happen
+	std::chrono::milliseconds minFastInterval = 250ms, maxFastInterval = 2000ms;
+	// How often total sweeps happen while files are changing, and how much longer the interval may grow while the tree is idle
+	std::chrono::milliseconds baseTotalInterval = 10s;
+	size_t maxIdleMultiplier = 6;
+	// The largest fraction of the time total sweeps may take up
+	double maxTotalDutyCycle = 0.05;
+	// The maximum number of hot directories reported by plan
+	size_t maxHotDirectories = 16;
+
+	// What the next sweep should do
+	struct Plan {
+		// Whether the sweep should be a total sweep, and whether it should be run at a low I/O priority
+		bool total = false, lowPriority = false;
+		// Directories that have recently had changes and should be rescanned
+		std::vector<std::filesystem::path> hotDirectories;
+	};
+
+	SweepScheduler() { lastFast = lastTotal = Clock::now(); }
+
+	// Function which records that a file was created, modified, or deleted
+	void recordChange(const std::filesystem::path& path) {
+		changesSinceLastSweep++;
+		directoryHeat[path.parent_path().native()] += 1;
+	}
+
+	// Function which decides what the sweep that is about to happen should do
+	Plan plan(Clock::time_point now = Clock::now()) {
+		Plan plan;
+		plan.total = now >= lastTotal + totalInterval();
+		plan.lowPriority = plan.total && diskBusy();
+
+		// The directories with the most recent changes are hot
+		std::vector<std::pair<double, std::string>> hot;
+		for(auto& [directory, heat]: directoryHeat)
+			if(heat >= 1) hot.emplace_back(heat, directory);
+		std::sort(hot.begin(), hot.end(), std::greater<>());
+		for(size_t i = 0; i < hot.size() && i < maxHotDirectories; i++)
+			plan.hotDirectories.emplace_back(hot[i].second);
+
+		// Directories cool off once a plan has seen them (and are forgotten once they are cold)
+		// NOTE: Cooling off here rather than when the sweep finishes means a directory with a single change is hot for the next sweep
+		for(auto i = directoryHeat.begin(); i != directoryHeat.end(); )
+			if((i->second *= 0.5) < 0.1)
+				i = directoryHeat.erase(i);
+			else i++;
+		return plan;
+	}
+
+	// Function which records that a sweep finished, updating the change rate estimate
+	void sweepFinished(const Plan& plan, Clock::time_point now = Clock::now()) {
+		double elapsed = std::chrono::duration<double>(now - lastFast).count();
+		if(elapsed > 0) {
+			double rate = changesSinceLastSweep / elapsed;
+			changeRate = changeRate * (1 - smoothing) + rate * smoothing;
+		}
+		lastFast = now;
+		changesSinceLastTotal += changesSinceLastSweep;
+		changesSinceLastSweep = 0;
+
+		if(plan.total) {
+			lastTotal = now;
+			// The longer the tree goes without changing, the further apart total sweeps become
+			idleTotalSweeps = changesSinceLastTotal == 0 ? idleTotalSweeps + 1 : 0;
+			changesSinceLastTotal = 0;
+		}
+	}
+
+	// Function which records how long a total sweep took (once it has actually finished), updating the sweep cost estimate
+	void totalSweepFinished(Clock::duration duration) {
+		double cost = std::chrono::duration<double>(duration).count();
+		lastTotalCost = cost;
+		totalCost = totalCost == 0 ? cost : totalCost * (1 - smoothing) + cost * smoothing;
+	}
+
+	// Function which calculates how long to wait between fast track sweeps (shorter the more files are changing)
+	std::chrono::milliseconds fastInterval() const {
+		auto interval = std::chrono::milliseconds(int64_t(maxFastInterval.count() / (1 + changeRate * 4)));
+		return std::clamp(interval, minFastInterval, maxFastInterval);
+	}
+
+	// Function which calculates how long to wait between total sweeps
+	std::chrono::milliseconds totalInterval() const {
+		std::chrono::milliseconds interval = baseTotalInterval * int64_t(1 + std::min(idleTotalSweeps, maxIdleMultiplier - 1));
+		// Total sweeps of a large tree are spaced out so that they don't take up more than the duty cycle
+		auto minimum = std::chrono::milliseconds(int64_t(totalCost / maxTotalDutyCycle * 1000));
+		return std::max(interval, minimum);
+	}
+
+	// Function which determines when the next sweep should happen
+	Clock::time_point nextSweep() const { return lastFast + fastInterval(); }
+
+	// Function which gets the current estimates (changes per second, and seconds per total sweep)
+	double getChangeRate() const { return changeRate; }
+	double getTotalSweepCost() const { return totalCost; }
+
+	// Function which determines if the disk is busy with other work
+	//	Uses the kernel's I/O pressure information if it is available, otherwise assumes the disk is busy if the last total sweep took much longer than usual
+	bool diskBusy() const {
+		std::ifstream fin("/proc/pressure/io");
+		std::string some, average;
+		if(fin >> some >> average && some == "some" && average.rfind("avg10=", 0) == 0)
+			return std::stod(average.substr(6)) > 10.0; // More than 10% of the last 10 seconds spent waiting on I/O
+		return totalCost > 0 && lastTotalCost > totalCost * 2;
+	}
+
+protected:
+	// How much weight new measurements are given in the moving averages
+	static constexpr double smoothing = 0.3;
+
+	Clock::time_point lastFast, lastTotal;
+	// Moving averages of the number of changes per second, and the number of seconds a total sweep takes (and the most recent total sweep's cost)
+	double changeRate = 0, totalCost = 0, lastTotalCost = 0;
+	size_t changesSinceLastSweep = 0, changesSinceLastTotal = 0, idleTotalSweeps = 0;
+	// How many changes each directory has recently had (decays every time a sweep is planned)
+	std::unordered_map<std::string, double> directoryHeat;
+};
+
+#endif // __SWEEP_SCHEDULER_HPP__
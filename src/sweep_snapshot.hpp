@@ -0,0 +1,139 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides functions which save and load the sweeper's knowledge of the managed files, so that it survives restarts
+*/
+
+#ifndef __SWEEP_SNAPSHOT_HPP__
+#define __SWEEP_SNAPSHOT_HPP__
+
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <boost/predef.h>
+
+#if BOOST_OS_LINUX
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "include_everywhere.hpp"
+
+// A snapshot of every file the sweeper knew about (path, modification time, size, and content hash)
+// The file is a header, followed by a fixed size record for every file, followed by all of the paths packed together,
+//	so it can be memory mapped and read in place
+struct SweepSnapshot {
+	static constexpr char magic[8] = {'W', 'N', 'T', 'S', 'S', 'N', 'A', 'P'};
+	static constexpr uint32_t version = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t count;
+	};
+	struct Record {
+		int64_t timestamp;
+		uint64_t size;
+		uint64_t hash;
+		uint32_t pathOffset, pathLength;
+	};
+
+	// A file to save into a snapshot
+	struct Entry {
+		std::string_view path;
+		std::filesystem::file_time_type timestamp;
+		uint64_t size, hash;
+	};
+
+	// Function which calculates where the snapshot for a managed folder is stored
+	static std::filesystem::path path(const std::filesystem::path& folder) { return wntsPath(folder) / ".snapshot"; }
+
+	// Function which saves a snapshot (the snapshot is written to a temporary file and then moved into place, so a crash never leaves a partial snapshot)
+	static bool save(const std::filesystem::path& path, const std::vector<Entry>& entries) {
+		auto temporary = path;
+		temporary += ".tmp";
+		create_directories(path.parent_path());
+
+		{
+			std::ofstream fout(temporary, std::ios::binary | std::ios::trunc);
+			Header header;
+			std::memcpy(header.magic, magic, sizeof(magic));
+			header.version = version;
+			header.count = entries.size();
+			fout.write((const char*) &header, sizeof(header));
+
+			uint32_t offset = 0;
+			for(auto& entry: entries) {
+				Record record{entry.timestamp.time_since_epoch().count(), entry.size, entry.hash, offset, uint32_t(entry.path.size())};
+				fout.write((const char*) &record, sizeof(record));
+				offset += entry.path.size();
+			}
+			for(auto& entry: entries)
+				fout.write(entry.path.data(), entry.path.size());
+
+			if(!fout) return false;
+		}
+
+		std::error_code ec;
+		rename(temporary, path, ec);
+		return !ec;
+	}
+
+	// Function which loads a snapshot, calling <func>(path, timestamp, size, hash) for every file in it
+	//	Returns false (without calling func) if there is no snapshot or it is invalid
+	template<typename Func>
+	static bool load(const std::filesystem::path& path, Func&& func) {
+#if BOOST_OS_LINUX
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		struct stat info;
+		if(::fstat(fd, &info) != 0 || info.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+		size_t size = info.st_size;
+		void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if(mapped == MAP_FAILED) return false;
+		::madvise(mapped, size, MADV_SEQUENTIAL);
+
+		bool valid = parse((const char*) mapped, size, func);
+		::munmap(mapped, size);
+		return valid;
+#else
+		std::ifstream fin(path, std::ios::binary);
+		if(!fin) return false;
+		std::string data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+		return parse(data.data(), data.size(), func);
+#endif
+	}
+
+protected:
+	// Function which validates the data of a snapshot and then reports every file in it
+	template<typename Func>
+	static bool parse(const char* data, size_t size, Func&& func) {
+		if(size < sizeof(Header)) return false;
+		Header header;
+		std::memcpy(&header, data, sizeof(header));
+		if(std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version) return false;
+
+		size_t pathsStart = sizeof(Header) + size_t(header.count) * sizeof(Record);
+		if(pathsStart > size) return false;
+		auto* records = (const Record*) (data + sizeof(Header));
+		for(size_t i = 0; i < header.count; i++)
+			if(pathsStart + records[i].pathOffset + records[i].pathLength > size)
+				return false;
+
+		for(size_t i = 0; i < header.count; i++) {
+			auto& record = records[i];
+			func(std::string_view(data + pathsStart + record.pathOffset, record.pathLength),
+				std::filesystem::file_time_type(std::filesystem::file_time_type::duration(record.timestamp)), record.size, record.hash);
+		}
+		return true;
+	}
+};
+
+#endif // __SWEEP_SNAPSHOT_HPP__
@@ -0,0 +1,95 @@
+/*
+	Name: Joshua Dahl, Antonio Massa, and Annette McDonough
+	Date: 4/19/22
+
+	File that provides a test checking that restarting and reconnecting to a network never makes the sweeper report deletions
+	for the files the message manager removes when it reconnects
+*/
+
+#include <fstream>
+
+#include "../src/file_sweep.hpp"
+
+bool useVerboseOutput = false;
+
+// Function which exits with an error if a condition doesn't hold
+void expect(bool condition, const std::string& message) {
+	if(condition) return;
+	std::cerr << "FAILED: " << message << std::endl;
+	std::exit(1);
+}
+
+// A sweeper of <folders> which records every file it reports as deleted
+struct RecordingSweeper {
+	std::vector<std::filesystem::path> deleted;
+	FilesystemSweeper sweeper;
+
+	RecordingSweeper(const std::vector<std::filesystem::path>& folders) : sweeper{folders,
+		[](auto&) {}, [](auto&) {},
+		[this](auto& path) { deleted.push_back(path); },
+		[](auto&) {}, [](auto&) {}} {}
+};
+
+int main() {
+	// NOTE: The managed folders are relative paths (just as main makes them), so work in a fresh temporary directory
+	auto root = std::filesystem::temp_directory_path() / "wnts-restart-test";
+	std::filesystem::remove_all(root);
+	create_directories(root / "managed" / "sub");
+	std::filesystem::current_path(root);
+	std::vector<std::filesystem::path> folders = {"managed"};
+	IgnoreRules::singleton().setup(folders);
+
+	// Files which were synced from the gateway, received live, created locally, and which the user deletes while we aren't running
+	std::vector<std::filesystem::path> synced = {"managed/synced"}, unjournaled = {"managed/received", "managed/sub/local"};
+	std::filesystem::path deletedOffline = "managed/deletedOffline";
+	for(auto& path: {synced[0], unjournaled[0], unjournaled[1], deletedOffline})
+		std::ofstream(path) << "content of " << path.string();
+
+	// First run: sweep everything and save the snapshot
+	{
+		RecordingSweeper first(folders);
+		first.sweeper.setup();
+		first.sweeper.sweep(/*total*/ true);
+		first.sweeper.saveSnapshot();
+		expect(first.deleted.empty(), "the first sweep reported deletions");
+	}
+
+	// Restart: the user deleted a file while we weren't running, the snapshot is loaded and the first sweep reports the deletion
+	remove(deletedOffline);
+	RecordingSweeper restarted(folders);
+	restarted.sweeper.setup();
+	restarted.sweeper.sweep(/*total*/ true);
+	expect(restarted.deleted == std::vector<std::filesystem::path>{deletedOffline}, "a file deleted while we weren't running wasn't reported");
+	restarted.deleted.clear();
+
+	// Reconnect: the message manager removes every file the sync journal doesn't list as completed (see processConnectMessage)
+	FileIndex::singleton().rebuild(folders);
+	for(auto& path: unjournaled) {
+		remove(path);
+		remove(wntsPath(path));
+		FileIndex::singleton().remove(path);
+	}
+
+	// Neither a total sweep nor a sweep of the files and directories (as the watcher would report them) may report those files as deleted
+	restarted.sweeper.sweepPaths(unjournaled);
+	restarted.sweeper.sweepDirectory("managed/sub");
+	restarted.sweeper.sweep(/*total*/ true);
+	expect(restarted.deleted.empty(), "files removed when reconnecting were reported as deleted (and would be deleted across the network)");
+
+	// The files aren't tracked any more, so the snapshot saved afterwards doesn't bring them back on the next restart either
+	restarted.sweeper.saveSnapshot();
+	RecordingSweeper again(folders);
+	again.sweeper.setup();
+	again.sweeper.sweep(/*total*/ true);
+	expect(again.deleted.empty(), "files removed when reconnecting were reported as deleted after another restart");
+
+	// A file the user deletes once we are connected is still reported
+	remove(synced[0]);
+	again.sweeper.sweep(/*total*/ true);
+	expect(again.deleted == synced, "a file deleted by the user wasn't reported");
+
+	std::filesystem::current_path(root.parent_path());
+	std::filesystem::remove_all(root);
+	std::cout << "Passed" << std::endl;
+	return 0;
+}